@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include <esp_types.h>
+
+#include "esp_log.h"
+
+#include "utils.h"
+
+#include "access_metrics.h"
+
+
+#define TAG "METRICS"
+
+
+static const char* StageNames[ACCESS_STAGE_COUNT] = {
+    "UartToMain",
+    "LocalLookup",
+    "NomosQueue",
+    "Connect",
+    "Response",
+    "Body",
+    "Parse",
+    "Decision",
+    "TapToUnlock",
+    "UartQueue",
+    "DoorAck"
+};
+
+// 1 ms to 10 s, roughly 1-2-5. A tap decided in under 800 ms lands in the first 9 buckets.
+const uint32_t AccessMetricsBucketBoundsUs[ACCESS_METRICS_BUCKET_COUNT - 1] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000, 10000000
+};
+
+static AccessMetrics accessMetrics    = {};
+static portMUX_TYPE  accessMetricsMux = portMUX_INITIALIZER_UNLOCKED;
+
+
+//
+static int bucket_index(uint32_t us) {
+    int bucket = 0;
+    while ((bucket < (ACCESS_METRICS_BUCKET_COUNT - 1)) && (us > AccessMetricsBucketBoundsUs[bucket])) {
+        bucket++;
+    }
+    return bucket;
+}
+
+
+//
+void access_metrics_record(AccessStage stage, int64_t durationUs) {
+    uint32_t us     = (durationUs < 0) ? 0 : ((durationUs > UINT32_MAX) ? UINT32_MAX : (uint32_t)durationUs);
+    int      bucket = bucket_index(us);
+
+    portENTER_CRITICAL(&accessMetricsMux);
+    AccessStageStats& stats = accessMetrics.stages[stage];
+    stats.count++;
+    stats.lastUs = us;
+    stats.totalUs += us;
+    stats.buckets[bucket]++;
+    if (us > stats.maxUs) {
+        stats.maxUs = us;
+    }
+    portEXIT_CRITICAL(&accessMetricsMux);
+}
+
+void access_metrics_budget_expired() {
+    portENTER_CRITICAL(&accessMetricsMux);
+    accessMetrics.budgetExpiredCount++;
+    portEXIT_CRITICAL(&accessMetricsMux);
+}
+
+//
+void access_metrics_refused_at_deadline() {
+    portENTER_CRITICAL(&accessMetricsMux);
+    accessMetrics.refusedAtDeadlineCount++;
+    portEXIT_CRITICAL(&accessMetricsMux);
+}
+
+//
+void access_metrics_get(AccessMetrics* pMetrics) {
+    portENTER_CRITICAL(&accessMetricsMux);
+    *pMetrics = accessMetrics;
+    portEXIT_CRITICAL(&accessMetricsMux);
+}
+
+void access_metrics_get_stage(AccessStage stage, AccessStageStats* pStats) {
+    portENTER_CRITICAL(&accessMetricsMux);
+    *pStats = accessMetrics.stages[stage];
+    portEXIT_CRITICAL(&accessMetricsMux);
+}
+
+const char* access_metrics_stage_name(AccessStage stage) {
+    return StageNames[stage];
+}
+
+//
+uint32_t access_metrics_percentile(const AccessStageStats& stats, uint32_t percent) {
+    if (stats.count == 0) {
+        return 0;
+    }
+
+    // Rank of the sample at this percentile, rounded up so p99 of a few samples is the slowest
+    uint64_t rank = (((uint64_t)stats.count * percent) + 99) / 100;
+    rank          = (rank == 0) ? 1 : rank;
+
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < (ACCESS_METRICS_BUCKET_COUNT - 1); bucket++) {
+        seen += stats.buckets[bucket];
+        if (seen >= rank) {
+            uint32_t bound = AccessMetricsBucketBoundsUs[bucket];
+            return (bound < stats.maxUs) ? bound : stats.maxUs;
+        }
+    }
+    return stats.maxUs;
+}
+
+//
+void access_metrics_log() {
+    AccessMetrics metrics;
+    access_metrics_get(&metrics);
+
+    for (int stage = 0; stage < ACCESS_STAGE_COUNT; stage++) {
+        const AccessStageStats& stats = metrics.stages[stage];
+        if (stats.count == 0) {
+            continue;
+        }
+
+        ESP_LOGI(TAG, "%-11s n=%u last=%u us avg=%u us p50<=%u us p95<=%u us p99<=%u us max=%u us", StageNames[stage], stats.count, stats.lastUs,
+                 (uint32_t)(stats.totalUs / stats.count), access_metrics_percentile(stats, 50), access_metrics_percentile(stats, 95),
+                 access_metrics_percentile(stats, 99), stats.maxUs);
+
+        char line[ACCESS_METRICS_BUCKET_COUNT * 11 + 1];
+        int  len = 0;
+        for (int bucket = 0; bucket < ACCESS_METRICS_BUCKET_COUNT; bucket++) {
+            len += snprintf(line + len, sizeof(line) - len, " %u", stats.buckets[bucket]);
+        }
+        ESP_LOGI(TAG, "%-11s buckets (1/2/5/10/20/50/100/200/500 ms, 1/2/5/10 s, more):%s", StageNames[stage], line);
+    }
+    ESP_LOGI(TAG, "Access budget expired %u time(s), %u refused as unknown.", metrics.budgetExpiredCount, metrics.refusedAtDeadlineCount);
+}
@@ -0,0 +1,62 @@
+#ifndef __ACCESS_METRICS__H__
+#define __ACCESS_METRICS__H__
+
+#include <stdint.h>
+
+
+// Where the time goes between a tap and the door's decision
+enum AccessStage {
+    ACCESS_STAGE_UartToMain,  // Frame received by the UART task until the main task picks it up
+    ACCESS_STAGE_LocalLookup, // RFID cache and member db
+    ACCESS_STAGE_NomosQueue,  // Waiting for the Nomos task to start the request
+    ACCESS_STAGE_Connect,     // TLS handshake, only counted when a new connection was needed
+    ACCESS_STAGE_Response,    // Request sent until the first byte of the response
+    ACCESS_STAGE_Body,        // First byte until the last byte was read and fed to the JSON parser
+    ACCESS_STAGE_Parse,       // Last byte until the parsed result was checked
+    ACCESS_STAGE_Decision,    // Tap until the door was opened, or the member was refused or asked for a PIN
+    ACCESS_STAGE_TapToUnlock, // Tap until UNLOCK_DOOR was queued for the STM32, only for granted taps
+    ACCESS_STAGE_UartQueue,   // LOCK_DOOR or UNLOCK_DOOR queued until the UART task woke and sent it
+    ACCESS_STAGE_DoorAck,     // LOCK_DOOR or UNLOCK_DOOR first sent until the STM32 ACKed it. The relay switches before the ACK.
+
+    ACCESS_STAGE_COUNT
+};
+
+// Fixed histogram buckets, each counting durations up to its bound. The last bucket takes the rest.
+#define ACCESS_METRICS_BUCKET_COUNT 14
+
+extern const uint32_t AccessMetricsBucketBoundsUs[ACCESS_METRICS_BUCKET_COUNT - 1];
+
+struct AccessStageStats {
+    uint32_t count;
+    uint32_t lastUs;
+    uint32_t maxUs;
+    uint64_t totalUs;
+    uint32_t buckets[ACCESS_METRICS_BUCKET_COUNT];
+};
+
+struct AccessMetrics {
+    AccessStageStats stages[ACCESS_STAGE_COUNT];
+    uint32_t         budgetExpiredCount;     // Decisions made offline because Nomos didn't answer in time
+    uint32_t         refusedAtDeadlineCount; // Of those, unknown cards and PINs told to try again
+};
+
+
+// NOTE: Recorded from the main thread, and the UART task for ACKs. Any task can read them.
+
+//
+void access_metrics_record(AccessStage stage, int64_t durationUs);
+void access_metrics_budget_expired();
+void access_metrics_refused_at_deadline();
+
+//
+void        access_metrics_get(AccessMetrics* pMetrics);
+void        access_metrics_get_stage(AccessStage stage, AccessStageStats* pStats);
+const char* access_metrics_stage_name(AccessStage stage);
+
+// Upper bound of the bucket holding the given percentile, or maxUs if that's the last bucket
+uint32_t access_metrics_percentile(const AccessStageStats& stats, uint32_t percent);
+
+// Two lines per stage: count, last, average, p50, p95, p99 and max, then the bucket counts
+void access_metrics_log();
+
+#endif //__ACCESS_METRICS__H__
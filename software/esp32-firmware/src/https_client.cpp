@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <esp_types.h>
+
+#include "esp_system.h"
+#include "esp_log.h"
+#include <esp_timer.h>
+
+#include "lwip/sockets.h"
+
+#include "esp_tls.h"
+
+#include "utils.h"
+
+#include "https_client.h"
+
+
+// Servers drop idle keep-alive connections (IIS after 120s, nginx after 75s). Reconnect
+// proactively rather than finding out when a write goes nowhere.
+#define HTTPS_CLIENT_IDLE_TIMEOUT_US SECONDS_IN_US(60)
+
+// How often the cancel callback is polled while waiting for the response
+#define HTTPS_CLIENT_CANCEL_POLL_MS 50
+
+
+enum RequestResult {
+    REQUEST_Success,
+    REQUEST_Failed,
+    REQUEST_StaleConnection, // The connection was closed by the server before any of the response arrived
+    REQUEST_Cancelled,
+    REQUEST_TimedOut,
+};
+
+enum BodyMode {
+    BODY_ContentLength,
+    BODY_Chunked,
+    BODY_UntilClose,
+};
+
+enum ChunkState {
+    CHUNK_Size,
+    CHUNK_Data,
+    CHUNK_DataEnd,
+    CHUNK_Trailer,
+};
+
+struct BodyReader {
+    BodyMode   mode;
+    size_t     remaining; // BODY_ContentLength: bytes left in the body, BODY_Chunked: bytes left in the chunk
+    ChunkState chunkState;
+    int        lineLength;
+    bool       bDone;
+    bool       bAborted;
+
+    HttpsBodyCallback callback;
+    void*             pContext;
+};
+
+
+//
+static void* tls_connect(const char* web_url, const esp_tls_cfg_t& cfg) {
+    return esp_tls_conn_http_new(web_url, &cfg);
+}
+
+static void tls_close(void* pConnection) {
+    esp_tls_conn_delete((struct esp_tls*)pConnection);
+}
+
+static int tls_write(void* pConnection, const char* data, size_t len) {
+    int ret;
+    do {
+        ret = esp_tls_conn_write((struct esp_tls*)pConnection, data, len);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+    return ret;
+}
+
+static int tls_read(void* pConnection, char* pBuffer, size_t len) {
+    int ret;
+    do {
+        ret = esp_tls_conn_read((struct esp_tls*)pConnection, pBuffer, len);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+    if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+        return 0;
+    }
+    return ret;
+}
+
+static bool tls_wait_readable(void* pConnection, int64_t waitUs) {
+    struct esp_tls* tls = (struct esp_tls*)pConnection;
+
+    // Data already decrypted by mbedtls won't show up on the socket
+    if (esp_tls_get_bytes_avail(tls) > 0) {
+        return true;
+    }
+
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(tls->sockfd, &readSet);
+
+    // Readable, or an error the read itself will report
+    struct timeval timeout = { 0, (long)waitUs };
+    return select(tls->sockfd + 1, &readSet, NULL, NULL, &timeout) != 0;
+}
+
+static void tls_set_timeout(void* pConnection, int timeoutMs) {
+    struct esp_tls* tls = (struct esp_tls*)pConnection;
+
+    // esp_tls only sets this once, from cfg.timeout_ms at connect
+    struct timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+    setsockopt(tls->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+const HttpsTransport HttpsTlsTransport = {
+    tls_connect,
+    tls_close,
+    tls_write,
+    tls_read,
+    tls_wait_readable,
+    tls_set_timeout,
+};
+
+//
+static bool write_all(HttpsClient* pClient, const char* data, size_t len) {
+    size_t written_bytes = 0;
+    do {
+        int ret = pClient->pTransport->write(pClient->pConnection, data + written_bytes, len - written_bytes);
+        if (ret <= 0) {
+            return false;
+        }
+        written_bytes += ret;
+    } while (written_bytes < len);
+
+    return true;
+}
+
+// Returns the number of bytes read, 0 if the connection was closed, or < 0 on error
+static int read_some(HttpsClient* pClient, char* pBuffer, size_t len) {
+    return pClient->pTransport->read(pClient->pConnection, pBuffer, len);
+}
+
+// cfg.timeout_ms, or less if the deadline is sooner. 0 for no timeout, < 0 if the deadline has passed.
+static int timeout_ms(const HttpsClient* pClient) {
+    int timeoutMs = pClient->cfg.timeout_ms;
+    if (pClient->deadline != 0) {
+        int64_t remainingMs = (pClient->deadline - esp_timer_get_time()) / 1000;
+        if (remainingMs <= 0) {
+            return -1;
+        }
+        if ((timeoutMs == 0) || (remainingMs < timeoutMs)) {
+            timeoutMs = (int)remainingMs;
+        }
+    }
+    return timeoutMs;
+}
+
+static bool is_cancelled(HttpsClient* pClient) {
+    return (pClient->cancelCallback != NULL) && pClient->cancelCallback(pClient->pCancelContext);
+}
+
+// Waits for something to read, polling the cancel callback and the deadline.
+// Returns REQUEST_Success when there is something to read.
+static RequestResult wait_readable(HttpsClient* pClient) {
+    if ((pClient->cancelCallback == NULL) && (pClient->deadline == 0)) {
+        return REQUEST_Success;
+    }
+
+    while (true) {
+        if (is_cancelled(pClient)) {
+            return REQUEST_Cancelled;
+        }
+
+        int64_t waitUs = HTTPS_CLIENT_CANCEL_POLL_MS * 1000;
+        if (pClient->deadline != 0) {
+            int64_t remaining = pClient->deadline - esp_timer_get_time();
+            if (remaining <= 0) {
+                return REQUEST_TimedOut;
+            }
+            waitUs = (remaining < waitUs) ? remaining : waitUs;
+        }
+
+        if (pClient->pTransport->wait_readable(pClient->pConnection, waitUs)) {
+            return REQUEST_Success;
+        }
+    }
+}
+
+static bool deliver_body(BodyReader* pReader, const char* data, size_t len) {
+    if ((len > 0) && !pReader->callback(data, len, pReader->pContext)) {
+        pReader->bAborted = true;
+        return false;
+    }
+    return true;
+}
+
+static void feed_body(BodyReader* pReader, const char* data, size_t len) {
+    if (pReader->mode == BODY_UntilClose) {
+        deliver_body(pReader, data, len);
+        return;
+    }
+
+    if (pReader->mode == BODY_ContentLength) {
+        size_t used = (len < pReader->remaining) ? len : pReader->remaining;
+        if (deliver_body(pReader, data, used)) {
+            pReader->remaining -= used;
+            pReader->bDone = (pReader->remaining == 0);
+        }
+        return;
+    }
+
+    // BODY_Chunked
+    size_t i = 0;
+    while ((i < len) && !pReader->bDone && !pReader->bAborted) {
+        char ch = data[i];
+
+        if (pReader->chunkState == CHUNK_Size) {
+            i++;
+            if (isxdigit((unsigned char)ch) && (pReader->lineLength >= 0)) {
+                int digit            = isdigit((unsigned char)ch) ? (ch - '0') : (tolower((unsigned char)ch) - 'a' + 10);
+                pReader->remaining = (pReader->remaining << 4) | digit;
+            } else if (ch == '\n') {
+                pReader->chunkState = (pReader->remaining == 0) ? CHUNK_Trailer : CHUNK_Data;
+                pReader->lineLength = 0;
+            } else if (ch != '\r') {
+                // Chunk extension, ignore the rest of the line
+                pReader->lineLength = -1;
+            }
+        } else if (pReader->chunkState == CHUNK_Data) {
+            size_t available = len - i;
+            size_t used      = (available < pReader->remaining) ? available : pReader->remaining;
+            if (!deliver_body(pReader, data + i, used)) {
+                return;
+            }
+            i += used;
+            pReader->remaining -= used;
+            if (pReader->remaining == 0) {
+                pReader->chunkState = CHUNK_DataEnd;
+            }
+        } else if (pReader->chunkState == CHUNK_DataEnd) {
+            i++;
+            if (ch == '\n') {
+                pReader->chunkState = CHUNK_Size;
+                pReader->lineLength = 0;
+            }
+        } else if (pReader->chunkState == CHUNK_Trailer) {
+            i++;
+            if (ch == '\n') {
+                pReader->bDone      = (pReader->lineLength == 0);
+                pReader->lineLength = 0;
+            } else if (ch != '\r') {
+                pReader->lineLength++;
+            }
+        }
+    }
+}
+
+static RequestResult do_request(HttpsClient* pClient, const char* request,
+                                HttpsResponse* pResponse, HttpsBodyCallback bodyCallback, void* pContext) {
+    if (is_cancelled(pClient)) {
+        return REQUEST_Cancelled;
+    }
+
+    int64_t sentTime = esp_timer_get_time();
+    if (!write_all(pClient, request, strlen(request))) {
+        return REQUEST_StaleConnection;
+    }
+    int64_t firstByteTime = 0;
+
+    // Read until the end of the headers. Whatever follows them is the start of the body.
+    char*  pHeaderEnd = NULL;
+    size_t len        = 0;
+    while (pHeaderEnd == NULL) {
+        size_t maxLen = (ARRAY_COUNT(pClient->headerBuffer) - len) - 1;
+        if (maxLen == 0) {
+            ESP_LOGE(pClient->tag, "Response headers too large.");
+            return REQUEST_Failed;
+        }
+
+        RequestResult waitResult = wait_readable(pClient);
+        if (waitResult != REQUEST_Success) {
+            return waitResult;
+        }
+
+        int ret = read_some(pClient, pClient->headerBuffer + len, maxLen);
+        if (ret <= 0) {
+            if (len == 0) {
+                return REQUEST_StaleConnection;
+            }
+            ESP_LOGE(pClient->tag, "Read returned -0x%x", -ret);
+            return REQUEST_Failed;
+        }
+
+        if (len == 0) {
+            firstByteTime = esp_timer_get_time();
+        }
+
+        len += ret;
+        pClient->headerBuffer[len] = '\0';
+        pHeaderEnd                 = strstr(pClient->headerBuffer, "\r\n\r\n");
+    }
+
+    char*  pBodyStart = pHeaderEnd + 4;
+    size_t bodyLen    = (pClient->headerBuffer + len) - pBodyStart;
+    pHeaderEnd[2]     = '\0'; // Keep the CRLF of the last header
+
+    //
+    int minorVersion = 0;
+    if (sscanf(pClient->headerBuffer, "HTTP/1.%d %d", &minorVersion, &pResponse->statusCode) != 2) {
+        ESP_LOGE(pClient->tag, "Malformed status line.");
+        return REQUEST_Failed;
+    }
+    pResponse->pHeaders = pClient->headerBuffer;
+
+    char value[32];
+    bool bKeepAlive = (minorVersion >= 1);
+    if (https_client_get_header(*pResponse, "Connection", value, sizeof(value))) {
+        bKeepAlive = strcasecmp(value, "close") != 0;
+    }
+
+    BodyReader reader;
+    bzero(&reader, sizeof(reader));
+    reader.callback = bodyCallback;
+    reader.pContext = pContext;
+    if (https_client_get_header(*pResponse, "Transfer-Encoding", value, sizeof(value)) && (strcasestr(value, "chunked") != NULL)) {
+        reader.mode       = BODY_Chunked;
+        reader.chunkState = CHUNK_Size;
+    } else if (https_client_get_header(*pResponse, "Content-Length", value, sizeof(value))) {
+        reader.mode      = BODY_ContentLength;
+        reader.remaining = strtoul(value, NULL, 10);
+        reader.bDone     = (reader.remaining == 0);
+    } else if ((pResponse->statusCode == 204) || (pResponse->statusCode == 304)) {
+        reader.mode  = BODY_ContentLength;
+        reader.bDone = true;
+    } else {
+        reader.mode = BODY_UntilClose;
+        bKeepAlive  = false;
+    }
+
+    feed_body(&reader, pBodyStart, bodyLen);
+
+    char chunk[512];
+    while (!reader.bDone && !reader.bAborted) {
+        RequestResult waitResult = wait_readable(pClient);
+        if (waitResult != REQUEST_Success) {
+            return waitResult;
+        }
+
+        int ret = read_some(pClient, chunk, sizeof(chunk));
+        if (ret == 0) {
+            if (reader.mode != BODY_UntilClose) {
+                ESP_LOGE(pClient->tag, "Connection closed mid-response.");
+                return REQUEST_Failed;
+            }
+            break;
+        } else if (ret < 0) {
+            ESP_LOGE(pClient->tag, "Read returned -0x%x", -ret);
+            return REQUEST_Failed;
+        }
+
+        feed_body(&reader, chunk, ret);
+    }
+
+    if (reader.bAborted) {
+        return REQUEST_Failed;
+    }
+
+    pClient->lastTimings.responseUs = firstByteTime - sentTime;
+    pClient->lastTimings.bodyUs     = esp_timer_get_time() - firstByteTime;
+
+    if (!bKeepAlive) {
+        https_client_close(pClient);
+    }
+
+    return REQUEST_Success;
+}
+
+//
+void https_client_init(HttpsClient* pClient, const char* tag, const esp_tls_cfg_t& cfg) {
+    bzero(pClient, sizeof(HttpsClient));
+    pClient->tag        = tag;
+    pClient->cfg        = cfg;
+    pClient->pTransport = &HttpsTlsTransport;
+}
+
+void https_client_close(HttpsClient* pClient) {
+    if (pClient->pConnection != NULL) {
+        pClient->pTransport->close(pClient->pConnection);
+        pClient->pConnection = NULL;
+    }
+}
+
+void https_client_set_transport(HttpsClient* pClient, const HttpsTransport* pTransport) {
+    https_client_close(pClient);
+    pClient->pTransport = pTransport;
+}
+
+void https_client_set_cancel(HttpsClient* pClient, HttpsCancelCallback cancelCallback, void* pContext) {
+    pClient->cancelCallback = cancelCallback;
+    pClient->pCancelContext = pContext;
+}
+
+void https_client_set_deadline(HttpsClient* pClient, int64_t deadline) {
+    pClient->deadline = deadline;
+}
+
+bool https_client_request(HttpsClient* pClient, const char* web_url, const char* request,
+                          HttpsResponse* pResponse, HttpsBodyCallback bodyCallback, void* pContext) {
+    bzero(pResponse, sizeof(HttpsResponse));
+    bzero(&pClient->lastTimings, sizeof(HttpsTimings));
+
+    if ((pClient->pConnection != NULL) && ((esp_timer_get_time() - pClient->lastUsedTime) > HTTPS_CLIENT_IDLE_TIMEOUT_US)) {
+        https_client_close(pClient);
+    }
+
+    // A reused connection may have been closed by the server since it was last used. In that case
+    // the request is retried once over a fresh connection.
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool bReused = (pClient->pConnection != NULL);
+        if (!bReused) {
+            esp_tls_cfg_t cfg = pClient->cfg;
+            cfg.timeout_ms    = timeout_ms(pClient);
+            if (cfg.timeout_ms < 0) {
+                pClient->timedOutCount++;
+                ESP_LOGE(pClient->tag, "Deadline passed before connecting.");
+                return false;
+            }
+
+            int64_t connectStart = esp_timer_get_time();
+            pClient->pConnection = pClient->pTransport->connect(web_url, cfg);
+            if (pClient->pConnection == NULL) {
+                ESP_LOGE(pClient->tag, "Connection failed.");
+                return false;
+            }
+            pClient->lastTimings.connectUs = esp_timer_get_time() - connectStart;
+            pClient->handshakeCount++;
+        }
+
+        // The connection keeps whatever timeout its connect or last request had, which may have been
+        // cut short by that request's deadline
+        int timeoutMs = timeout_ms(pClient);
+        pClient->pTransport->set_timeout(pClient->pConnection, (timeoutMs < 0) ? 1 : timeoutMs);
+
+        RequestResult result = do_request(pClient, request, pResponse, bodyCallback, pContext);
+        if (result == REQUEST_Success) {
+            if (bReused) {
+                pClient->reusedCount++;
+            }
+            pClient->lastUsedTime = esp_timer_get_time();
+
+            ESP_LOGI(pClient->tag, "Request sent over %s connection (%u handshakes, %u reused).",
+                     bReused ? "a reused" : "a new", pClient->handshakeCount, pClient->reusedCount);
+            return true;
+        }
+
+        // A cancelled request leaves the response half read, so the connection can't be reused either
+        https_client_close(pClient);
+
+        if (result == REQUEST_Cancelled) {
+            pClient->cancelledCount++;
+            ESP_LOGI(pClient->tag, "Request cancelled (%u so far).", pClient->cancelledCount);
+            return false;
+        }
+        if (result == REQUEST_TimedOut) {
+            pClient->timedOutCount++;
+            ESP_LOGE(pClient->tag, "Request timed out (%u so far).", pClient->timedOutCount);
+            return false;
+        }
+
+        if ((result != REQUEST_StaleConnection) || !bReused) {
+            ESP_LOGE(pClient->tag, "Request failed.");
+            return false;
+        }
+    }
+
+    return false;
+}
+
+bool https_client_get_header(const HttpsResponse& response, const char* name, char* pValue, size_t valueSize) {
+    if (response.pHeaders == NULL) {
+        return false;
+    }
+
+    size_t      nameLen = strlen(name);
+    const char* pLine   = strstr(response.pHeaders, "\r\n"); // Skip the status line
+    while ((pLine != NULL) && (pLine[2] != '\0')) {
+        pLine += 2;
+
+        const char* pLineEnd = strstr(pLine, "\r\n");
+        if (pLineEnd == NULL) {
+            break;
+        }
+
+        if ((strncasecmp(pLine, name, nameLen) == 0) && (pLine[nameLen] == ':')) {
+            const char* pStart = pLine + nameLen + 1;
+            while ((*pStart == ' ') || (*pStart == '\t')) {
+                pStart++;
+            }
+
+            size_t len = pLineEnd - pStart;
+            if (len >= valueSize) {
+                len = valueSize - 1;
+            }
+            memcpy(pValue, pStart, len);
+            pValue[len] = '\0';
+            return true;
+        }
+
+        pLine = pLineEnd;
+    }
+
+    return false;
+}
+
+//
+void https_body_buffer_init(HttpsBodyBuffer* pBuffer, char* pData, size_t capacity) {
+    pBuffer->pData    = pData;
+    pBuffer->capacity = capacity;
+    pBuffer->length   = 0;
+    pData[0]          = '\0';
+}
+
+bool https_body_buffer_append(const char* data, size_t len, void* pContext) {
+    HttpsBodyBuffer* pBuffer = (HttpsBodyBuffer*)pContext;
+    if ((pBuffer->length + len) >= pBuffer->capacity) {
+        // Not enough room for the body and its terminator
+        return false;
+    }
+
+    memcpy(pBuffer->pData + pBuffer->length, data, len);
+    pBuffer->length += len;
+    pBuffer->pData[pBuffer->length] = '\0';
+    return true;
+}
@@ -0,0 +1,101 @@
+#ifndef __HTTPS_CLIENT__H__
+#define __HTTPS_CLIENT__H__
+
+#include "esp_tls.h"
+
+
+// Called with each piece of the (de-chunked) response body as it arrives. Return false to abort the request.
+typedef bool (*HttpsBodyCallback)(const char* data, size_t len, void* pContext);
+
+// Polled while waiting on the server. Return true to abandon the request; its connection is closed.
+typedef bool (*HttpsCancelCallback)(void* pContext);
+
+// Accumulates a response body into a caller-supplied, null terminated buffer
+struct HttpsBodyBuffer {
+    char*  pData;
+    size_t capacity;
+    size_t length;
+};
+
+struct HttpsResponse {
+    int         statusCode;
+    const char* pHeaders; // Null terminated header block, valid until the next request on the same client
+};
+
+// Where the time went in the last request. All 0 when it failed before sending.
+struct HttpsTimings {
+    int64_t connectUs;  // 0 when the connection was reused
+    int64_t responseUs; // Request written until the first byte of the response
+    int64_t bodyUs;     // First byte until the whole response was read
+};
+
+// The byte stream a client talks HTTP over. The default is esp_tls; test/test_https_client supplies
+// plain sockets to a mock server instead, so the HTTP handling can be tested on the host.
+struct HttpsTransport {
+    // Returns the new connection, or NULL. cfg.timeout_ms bounds the connect.
+    void* (*connect)(const char* web_url, const esp_tls_cfg_t& cfg);
+    void (*close)(void* pConnection);
+
+    // Return the number of bytes written or read, 0 when the peer closed (read only), < 0 on error
+    int (*write)(void* pConnection, const char* data, size_t len);
+    int (*read)(void* pConnection, char* pBuffer, size_t len);
+
+    // Waits up to waitUs for something to read. Returns false if there is still nothing.
+    bool (*wait_readable)(void* pConnection, int64_t waitUs);
+
+    // Bounds each blocking read from now on, 0 for no limit. Set before every request.
+    void (*set_timeout)(void* pConnection, int timeoutMs);
+};
+
+extern const HttpsTransport HttpsTlsTransport;
+
+// A single keep-alive HTTP/1.1 connection to one host
+struct HttpsClient {
+    const char*           tag;
+    esp_tls_cfg_t         cfg;
+    const HttpsTransport* pTransport;
+    void*                 pConnection;
+    int64_t               lastUsedTime;
+
+    HttpsCancelCallback cancelCallback;
+    void*               pCancelContext;
+    int64_t             deadline; // esp_timer_get_time() the current request must finish by, 0 for none
+
+    HttpsTimings lastTimings;
+
+    // Stats
+    uint32_t handshakeCount;
+    uint32_t reusedCount;
+    uint32_t cancelledCount;
+    uint32_t timedOutCount;
+
+    char headerBuffer[1024];
+};
+
+//
+void https_client_init(HttpsClient* pClient, const char* tag, const esp_tls_cfg_t& cfg);
+void https_client_close(HttpsClient* pClient);
+
+// Replaces the esp_tls transport. Closes the current connection.
+void https_client_set_transport(HttpsClient* pClient, const HttpsTransport* pTransport);
+
+// Without one, reads block until the server answers or the connection fails
+void https_client_set_cancel(HttpsClient* pClient, HttpsCancelCallback cancelCallback, void* pContext);
+
+// Applies to the connect and to every read of the following requests. Each connect and request is
+// bounded by whichever is sooner of this and cfg.timeout_ms. 0 for no deadline.
+void https_client_set_deadline(HttpsClient* pClient, int64_t deadline);
+
+// Sends the fully formatted request over the pooled connection (connecting or reconnecting as needed)
+// and streams the response body to bodyCallback.
+bool https_client_request(HttpsClient* pClient, const char* web_url, const char* request,
+                          HttpsResponse* pResponse, HttpsBodyCallback bodyCallback, void* pContext);
+
+// Copies the value of a response header (case insensitive name) into pValue. Returns false if not present.
+bool https_client_get_header(const HttpsResponse& response, const char* name, char* pValue, size_t valueSize);
+
+//
+void https_body_buffer_init(HttpsBodyBuffer* pBuffer, char* pData, size_t capacity);
+bool https_body_buffer_append(const char* data, size_t len, void* pContext);
+
+#endif //__HTTPS_CLIENT__H__
@@ -16,6 +16,7 @@
 #include "esp_event_loop.h"
 #include "esp_task_wdt.h"
 #include "esp_log.h"
+#include <esp_timer.h>
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -30,8 +31,10 @@
 
 #include "utils.h"
 
+#include "https_client.h"
 #include "is_vhs_open_http_thread.h"
 #include "main_thread.h"
+#include "message_bus.h"
 
 
 #define TAG "IS_VHS_OPEN"
@@ -52,8 +55,10 @@ extern const uint8_t is_vhs_open_root_cert_pem_end[] asm("_binary_src_is_vhs_ope
 #define WEB_PORT "443"
 #define WEB_URL_STATUS "https://isvhsopen.com/api/status/"
 
-static const char* REQUEST_STATUS = "GET " WEB_URL_STATUS " HTTP/1.0\r\n"
+static const char* REQUEST_STATUS = "GET " WEB_URL_STATUS " HTTP/1.1\r\n"
                                     "Host: " WEB_SERVER "\r\n"
+                                    "Connection: keep-alive\r\n"
+                                    "%s" // Conditional request headers
                                     "User-Agent: esp-idf/1.0 esp32\r\n"
                                     "Content-Type: text/json\r\n"
                                     "Content-Length: %d\r\n"
@@ -61,65 +66,33 @@ static const char* REQUEST_STATUS = "GET " WEB_URL_STATUS " HTTP/1.0\r\n"
                                     "%s";
 
 
+static HttpsClient                httpsClient;
 static char                       requestBuff[512];
 static char                       readBuffer[1 * 1024];
 static StaticJsonBuffer<2 * 1024> jsonBuffer; // NOTE: It was observed in NomosHttpThread that the jsonBuffer had to be larger than the readBuffer, otherwise it would sometimes fail to parse
 
-static bool send_request(struct esp_tls* tls, const char* header, const char* body) {
-    sprintf(requestBuff, header, (body == NULL) ? 0 : strlen(body), (body == NULL) ? "" : body);
-    assert(strlen(requestBuff) < ARRAY_COUNT(requestBuff));
-
-    size_t written_bytes = 0;
-    do {
-        int ret = esp_tls_conn_write(tls,
-                                     requestBuff + written_bytes,
-                                     strlen(requestBuff) - written_bytes);
-        if (ret > 0) {
-            written_bytes += ret;
-        } else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-            ESP_LOGE(TAG, "esp_tls_conn_write  returned 0x%x", ret);
-            return false;
-        }
-    } while (written_bytes < strlen(requestBuff));
-
-    return true;
-}
-
-static bool read_response(struct esp_tls* tls, bool* pResult) {
-    bzero(readBuffer, ARRAY_COUNT(readBuffer));
+// Validators from the last 200 response, sent back so an unchanged status costs a 304 with no body
+static char etag[64]         = {};
+static char lastModified[64] = {};
 
-    int ret;
-    int len = 0;
-    // int chunks = 0;
-
-    do {
-        int maxLen = (ARRAY_COUNT(readBuffer) - len) - 1;
-        ret        = esp_tls_conn_read(tls, (char*)readBuffer + len, maxLen);
-
-        if (ret == MBEDTLS_ERR_SSL_WANT_WRITE || ret == MBEDTLS_ERR_SSL_WANT_READ)
-            continue;
-
-        if (ret < 0) {
-            ESP_LOGE(TAG, "esp_tls_conn_read  returned -0x%x", -ret);
-            return false;
-        }
+// Seqlock protected snapshot. Only the poller writes it; readers retry if they raced a write.
+static volatile uint32_t statusSequence = 0;
+static IsVHSOpenStatus   statusSnapshot = {};
 
-        len += ret;
-    } while (ret != 0);
+static void set_status(bool bOpen, int64_t fetchTime) {
+    statusSequence++;
+    __sync_synchronize();
 
-    assert(len < ARRAY_COUNT(readBuffer));
-    readBuffer[len] = '\0';
+    statusSnapshot.bValid    = true;
+    statusSnapshot.bOpen     = bOpen;
+    statusSnapshot.fetchTime = fetchTime;
 
-    char* statusEnd       = strchr(readBuffer, '\r');
-    bool  successResponse = strncmp(readBuffer, "HTTP/1.1 200 OK", statusEnd - readBuffer) == 0;
-    if (!successResponse) {
-        *statusEnd = '\0';
-        ESP_LOGE(TAG, "Status code not 200 OK.");
-        return false;
-    }
+    __sync_synchronize();
+    statusSequence++;
+}
 
-    const char* headerTerminator = "\r\n\r\n";
-    char*       pBodyStart       = strstr(readBuffer, headerTerminator) + strlen(headerTerminator);
+static bool parse_response(char* pBodyStart, bool* pResult) {
+    jsonBuffer.clear();
 
     JsonObject& root = jsonBuffer.parseObject(pBodyStart);
     if (root.success()) {
@@ -145,31 +118,72 @@ static bool read_response(struct esp_tls* tls, bool* pResult) {
     return true;
 }
 
-static bool https_request(esp_tls_cfg_t* pCfg, const char* web_url, const char* header, const char* body, bool* pResult) {
-    *pResult = false;
+static bool poll_status() {
+    char conditionalHeaders[160] = {};
+    if (etag[0] != '\0') {
+        snprintf(conditionalHeaders, sizeof(conditionalHeaders), "If-None-Match: %s\r\n", etag);
+    } else if (lastModified[0] != '\0') {
+        snprintf(conditionalHeaders, sizeof(conditionalHeaders), "If-Modified-Since: %s\r\n", lastModified);
+    }
+
+    sprintf(requestBuff, REQUEST_STATUS, conditionalHeaders, 0, "");
+    assert(strlen(requestBuff) < ARRAY_COUNT(requestBuff));
+
+    HttpsBodyBuffer bodyBuffer;
+    https_body_buffer_init(&bodyBuffer, readBuffer, ARRAY_COUNT(readBuffer));
+
+    https_client_set_deadline(&httpsClient, esp_timer_get_time() + (IS_VHS_OPEN_HTTP_TIMEOUT_MS * 1000LL));
 
-    struct esp_tls* tls = esp_tls_conn_http_new(web_url, pCfg);
-    if (tls == NULL) {
-        ESP_LOGE(TAG, "Connection failed.");
-        esp_tls_conn_delete(tls);
+    HttpsResponse response;
+    if (!https_client_request(&httpsClient, WEB_URL_STATUS, requestBuff, &response, &https_body_buffer_append, &bodyBuffer)) {
+        ESP_LOGE(TAG, "Request failed.");
         return false;
     }
 
-    if (!send_request(tls, header, body)) {
-        ESP_LOGE(TAG, "Request send failed.");
-        esp_tls_conn_delete(tls);
+    IsVHSOpenStatus status;
+    is_vhs_open_get_status(&status);
+
+    if ((response.statusCode == 304) && status.bValid) {
+        // Unchanged since the last poll
+        set_status(status.bOpen, esp_timer_get_time());
+        return true;
+    }
+
+    if (response.statusCode != 200) {
+        ESP_LOGE(TAG, "Status code %d not 200 OK.", response.statusCode);
         return false;
     }
-    if (!read_response(tls, pResult)) {
+
+    bool bOpen = false;
+    if (!parse_response(readBuffer, &bOpen)) {
         ESP_LOGE(TAG, "Request read failed.");
-        esp_tls_conn_delete(tls);
         return false;
     }
 
-    esp_tls_conn_delete(tls);
+    if (!https_client_get_header(response, "ETag", etag, sizeof(etag))) {
+        etag[0] = '\0';
+    }
+    if (!https_client_get_header(response, "Last-Modified", lastModified, sizeof(lastModified))) {
+        lastModified[0] = '\0';
+    }
+
+    if (!status.bValid || (status.bOpen != bOpen)) {
+        ESP_LOGI(TAG, "VHS is now %s.", bOpen ? "open" : "closed");
+    }
+    set_status(bOpen, esp_timer_get_time());
+
     return true;
 }
 
+// +/- 10% so the door doesn't poll in lock-step with anything else
+static TickType_t jittered_delay(uint32_t delay_ms) {
+    uint32_t jitter_ms = delay_ms / 10;
+    if (jitter_ms > 0) {
+        delay_ms = (delay_ms - jitter_ms) + (esp_random() % (2 * jitter_ms));
+    }
+    return delay_ms / portTICK_PERIOD_MS;
+}
+
 static void is_vhs_open_http_task(void* pvParameters) {
     esp_tls_cfg_t cfg = {
         .alpn_protos            = NULL,
@@ -182,26 +196,60 @@ static void is_vhs_open_http_task(void* pvParameters) {
         .clientkey_password     = NULL,
         .clientkey_password_len = 0,
         .non_block              = false,
-        .timeout_ms             = 0,
+        .timeout_ms             = IS_VHS_OPEN_HTTP_TIMEOUT_MS,
         .use_global_ca_store    = false
     };
+    https_client_init(&httpsClient, TAG, cfg);
+
+    TickType_t pollDelay     = 0; // Poll right away on boot
+    int        failedPolls   = 0;
+    uint32_t   retryDelay_ms = IS_VHS_OPEN_POLL_RETRY_MS;
 
     while (1) {
-        IsVHSOpenHttpNotification httpNotification = IS_VHS_OPEN_HTTP_NOTIFICATION_None;
-        if (xTaskNotifyWait(0, 0, (uint32_t*)&httpNotification, 1000 / portTICK_PERIOD_MS) == pdPASS) {
-            MainNotificationArgs mainNotificationArgs;
-            bzero(&mainNotificationArgs, sizeof(MainNotificationArgs));
+        // Wake up for the next scheduled poll, or early if the main thread needs a fresh status right now
+        BusMessage request;
+        bool       bRequested = bus_receive(BUS_TOPIC_IsVHSOpen, &request, pollDelay);
+
+        IsVHSOpenHttpNotification httpNotification = bRequested ? request.isVHSOpen : IS_VHS_OPEN_HTTP_NOTIFICATION_None;
+
+        bool bSuccess = false;
+        if (!bRequested || (httpNotification == IS_VHS_OPEN_HTTP_NOTIFICATION_Status)) {
+            bSuccess = poll_status();
+
+            if (bSuccess) {
+                failedPolls   = 0;
+                retryDelay_ms = IS_VHS_OPEN_POLL_RETRY_MS;
+                pollDelay     = jittered_delay(IS_VHS_OPEN_POLL_INTERVAL_MS);
+            } else {
+                failedPolls++;
+                pollDelay     = jittered_delay(retryDelay_ms);
+                retryDelay_ms = (2 * retryDelay_ms < IS_VHS_OPEN_POLL_INTERVAL_MS) ? 2 * retryDelay_ms : IS_VHS_OPEN_POLL_INTERVAL_MS;
+
+                ESP_LOGE(TAG, "Poll failed %d time(s), retrying in %u ms.", failedPolls, pollDelay * portTICK_PERIOD_MS);
+            }
+        }
+
+        if (bRequested) {
+            BusMessage reply;
+            bzero(&reply, sizeof(BusMessage));
+            reply.requestId = request.requestId;
+
+            MainNotificationArgs& mainNotificationArgs                       = reply.main;
             mainNotificationArgs.notification                                = MAIN_NOTIFICATION_IsVHSOpenHttpRequestResultReady;
             mainNotificationArgs.IsVHSOpenHttpRequestResult.httpNotification = httpNotification;
 
             if (httpNotification == IS_VHS_OPEN_HTTP_NOTIFICATION_Status) {
-                mainNotificationArgs.IsVHSOpenHttpRequestResult.success = https_request(&cfg, WEB_URL_STATUS, REQUEST_STATUS, NULL, &mainNotificationArgs.IsVHSOpenHttpRequestResult.open);
+                IsVHSOpenStatus status;
+                is_vhs_open_get_status(&status);
+
+                mainNotificationArgs.IsVHSOpenHttpRequestResult.success = bSuccess;
+                mainNotificationArgs.IsVHSOpenHttpRequestResult.open    = bSuccess && status.bOpen;
             } else {
                 mainNotificationArgs.IsVHSOpenHttpRequestResult.success = false;
                 ESP_LOGE(TAG, "Unknown IsVHSOpenHttpNotification: %d", (int)httpNotification);
             }
 
-            if (xQueueSendToBack(MAIN_queueHandle, &mainNotificationArgs, 100 / portTICK_PERIOD_MS) != pdTRUE) {
+            if (!bus_publish(BUS_TOPIC_Main, reply, BUS_PRIORITY_High, 100 / portTICK_PERIOD_MS)) {
                 // Erk. Did not add to the queue. Oh well? User can just try again when they realize...
             }
         }
@@ -209,6 +257,31 @@ static void is_vhs_open_http_task(void* pvParameters) {
 }
 
 //
+void is_vhs_open_get_status(IsVHSOpenStatus* pStatus) {
+    uint32_t sequence;
+    do {
+        sequence = statusSequence;
+        __sync_synchronize();
+
+        *pStatus = statusSnapshot;
+
+        __sync_synchronize();
+    } while ((sequence & 1) || (sequence != statusSequence));
+}
+
+uint32_t is_vhs_open_request_status() {
+    BusMessage request;
+    bzero(&request, sizeof(BusMessage));
+    request.requestId = bus_next_request_id();
+    request.isVHSOpen = IS_VHS_OPEN_HTTP_NOTIFICATION_Status;
+
+    if (!bus_publish(BUS_TOPIC_IsVHSOpen, request, BUS_PRIORITY_High, 0)) {
+        return 0;
+    }
+
+    return request.requestId;
+}
+
 void is_vhs_open_http_thread_create() {
     xTaskCreate(&is_vhs_open_http_task, "is_vhs_open_http_task", 6 * 1024, NULL, 5, &IsVHSOpenHttpTaskHandle);
 }
@@ -8,9 +8,37 @@ enum IsVHSOpenHttpNotification {
     IS_VHS_OPEN_HTTP_NOTIFICATION_COUNT
 };
 
+// How often isvhsopen.com is polled in the background. Override via build_flags.
+#ifndef IS_VHS_OPEN_POLL_INTERVAL_MS
+#define IS_VHS_OPEN_POLL_INTERVAL_MS (60 * 1000)
+#endif
+
+// First retry delay after a failed poll, doubled on each further failure up to the poll interval
+#ifndef IS_VHS_OPEN_POLL_RETRY_MS
+#define IS_VHS_OPEN_POLL_RETRY_MS (5 * 1000)
+#endif
+
+// Hard limit on one poll, connect included
+#ifndef IS_VHS_OPEN_HTTP_TIMEOUT_MS
+#define IS_VHS_OPEN_HTTP_TIMEOUT_MS (10 * 1000)
+#endif
+
+// Last known open/closed status of VHS, as kept up to date by the poller
+struct IsVHSOpenStatus {
+    bool    bValid; // False until the first successful poll
+    bool    bOpen;
+    int64_t fetchTime; // esp_timer_get_time() of the last successful poll
+};
+
 //
 extern TaskHandle_t IsVHSOpenHttpTaskHandle;
 
+// Lock-free, can be called from any task
+void is_vhs_open_get_status(IsVHSOpenStatus* pStatus);
+
+// Asks for a poll right away. Returns the request ID its reply will carry, or 0 if one couldn't be queued.
+uint32_t is_vhs_open_request_status();
+
 //
 void is_vhs_open_http_thread_create();
 
@@ -39,6 +39,7 @@ extern "C" {
 
 #include "utils.h"
 
+#include "message_bus.h"
 #include "main_thread.h"
 #include "uart_thread.h"
 #include "nomos_http_thread.h"
@@ -215,6 +216,7 @@ void app_main(void) {
     init_time();
 
     //
+    bus_init();
     uart_init();
 
     //
@@ -24,9 +24,14 @@
 #include "main_state_machine.h"
 
 
+// How soon a timeout that couldn't be delivered is raised again
+#define MAIN_STATE_TIMEOUT_RETRY_US 10000
+
+
 static const char* StateNames[MainStateMachine::STATE_COUNT] = {
     "Idle",
     "ValidatingRFID",
+    "IsVHSOpen",
     "WaitingForPIN",
     "ValidatingPIN",
     "AccessGranted"
@@ -40,41 +45,60 @@ const char* MainStateMachine::GetStateName(State_e state) {
 MainStateMachine::MainStateMachine()
     : currentState(STATE_Idle)
     , stateChangeCallback(NULL)
-    , stateTime(0) {
+    , stateTimeoutCallback(NULL)
+    , timeoutTimer(NULL)
+    , stateId(0) {
 }
 
-void MainStateMachine::init(StateChangeCallback callback) {
-    currentState        = STATE_Idle;
-    stateChangeCallback = callback;
-    stateTime           = esp_timer_get_time();
+void MainStateMachine::init(StateChangeCallback callback, StateTimeoutCallback timeoutCallback) {
+    currentState         = STATE_Idle;
+    stateChangeCallback  = callback;
+    stateTimeoutCallback = timeoutCallback;
+
+    esp_timer_create_args_t timerArgs = {
+        .callback        = &MainStateMachine::onTimer,
+        .arg             = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "main_state_timeout"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timerArgs, &timeoutTimer));
 }
 
 void MainStateMachine::SetState(State_e newState) {
     State_e oldState = currentState;
     currentState     = newState;
 
-    stateTime = esp_timer_get_time();
+    stateId = stateId + 1;
+
+    // A one-shot per state, rather than checking the time in state every so often
+    esp_timer_stop(timeoutTimer);
+    if (newState != STATE_Idle) {
+        esp_timer_start_once(timeoutTimer, MAIN_STATE_TIMEOUT_MS * 1000LL);
+    }
 
     if (stateChangeCallback != NULL) {
         stateChangeCallback(oldState, newState);
     }
 }
 
-void MainStateMachine::Update() {
-    if (currentState != STATE_Idle) {
-        int64_t currentTime    = esp_timer_get_time();
-        int64_t timeInState_uS = currentTime - stateTime;
-        if (timeInState_uS > SECONDS_IN_US(15)) {
-            SetState(STATE_Idle);
-            return;
-        }
+void MainStateMachine::OnTimeout(uint32_t timedOutStateId) {
+    if ((timedOutStateId == stateId) && (currentState != STATE_Idle)) {
+        SetState(STATE_Idle);
     }
+}
 
+void MainStateMachine::OnDoorOpened() {
     if (currentState == STATE_AccessGranted) {
-        // TODO: If the door sensor says the door is open, re-lock immediately so when the door closes it latches locked
-        bool doorIsOpen = false;
-        if (doorIsOpen) {
-            SetState(STATE_Idle);
-        }
+        SetState(STATE_Idle);
+    }
+}
+
+// esp_timer task
+void MainStateMachine::onTimer(void* pArg) {
+    MainStateMachine* pMachine = (MainStateMachine*)pArg;
+
+    if ((pMachine->stateTimeoutCallback != NULL) && !pMachine->stateTimeoutCallback(pMachine->stateId)) {
+        // Leaving the door unlocked because a queue was full isn't an option
+        esp_timer_start_once(pMachine->timeoutTimer, MAIN_STATE_TIMEOUT_RETRY_US);
     }
 }
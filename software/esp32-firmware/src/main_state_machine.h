@@ -1,6 +1,12 @@
 #ifndef __STATE_MACHINE_H__
 #define __STATE_MACHINE_H__
 
+#include <esp_timer.h>
+
+// How long any state other than Idle lasts before the machine gives up and returns to Idle. Override via build_flags.
+#ifndef MAIN_STATE_TIMEOUT_MS
+#define MAIN_STATE_TIMEOUT_MS 15000
+#endif
 
 struct MainStateMachine {
     enum State_e {
@@ -16,24 +22,36 @@ struct MainStateMachine {
 
     typedef void (*StateChangeCallback)(State_e oldState, State_e newState);
 
+    // Called from the esp_timer task when the current state times out. Pass stateId to OnTimeout()
+    // from the task that owns the machine. Return false to have the callback retried shortly.
+    typedef bool (*StateTimeoutCallback)(uint32_t stateId);
+
 public:
     static const char* GetStateName(State_e state);
 
 public:
     MainStateMachine();
 
-    void init(StateChangeCallback callback);
+    void init(StateChangeCallback callback, StateTimeoutCallback timeoutCallback);
 
     void    SetState(State_e newState);
     State_e GetState() const { return currentState; }
 
-    void Update();
+    // Returns to Idle, unless the state has changed since the timeout was raised
+    void OnTimeout(uint32_t timedOutStateId);
+
+    // Relocks as the door opens, so it latches locked behind whoever went through
+    void OnDoorOpened();
 
 private:
-    State_e             currentState;
-    StateChangeCallback stateChangeCallback;
+    static void onTimer(void* pArg);
+
+    State_e              currentState;
+    StateChangeCallback  stateChangeCallback;
+    StateTimeoutCallback stateTimeoutCallback;
+    esp_timer_handle_t   timeoutTimer;
 
-    int64_t stateTime;
+    volatile uint32_t stateId; // Changes with every SetState
 };
 
 
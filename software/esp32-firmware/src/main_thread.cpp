@@ -18,45 +18,215 @@
 #include "esp_event_loop.h"
 #include "esp_task_wdt.h"
 #include "esp_log.h"
+#include <esp_timer.h>
 
 #include "utils.h"
 
 #include "nomos_http_thread.h"
 #include "uart_thread.h"
 #include "main_thread.h"
+#include "message_bus.h"
 
 #include "main_state_machine.h"
+#include "rfid_cache.h"
+#include "member_db.h"
+#include "access_metrics.h"
 
 #define TAG "MAIN"
 
-TaskHandle_t  MAIN_taskHandle  = NULL;
-QueueHandle_t MAIN_queueHandle = NULL;
-
-static StaticQueue_t        MAIN_queueStructure;
-static MainNotificationArgs MAIN_queueStorage[8] = {};
+TaskHandle_t MAIN_taskHandle = NULL;
 
 static MainStateMachine mainStateMachine;
 
+// The card currently being checked with Nomos, so its reply can be cached. A reply is only ever
+// stored if it names this card, so a late reply can't be cached under the next card's UID.
+static uint8_t  pendingRfid[RFID_CACHE_ID_LENGTH]             = {};
+static char     pendingRfidBody[NOMOS_HTTP_REQUEST_BODY_SIZE] = {};
+static uint32_t rfidRequestId                                 = 0; // Replies to any other request are for a card that's gone
+// Set when the access decision was already made from the cache and the Nomos request is only a revalidation
+static bool bRfidDecidedFromCache = false;
+
+// The PIN currently being checked with Nomos, so its reply can be stored in the member db
+static uint32_t pendingPin                                   = 0;
+static char     pendingPinBody[NOMOS_HTTP_REQUEST_BODY_SIZE] = {};
+static uint32_t pinRequestId                                 = 0;
+// Set when the PIN was already accepted from the member db and the Nomos request is only a revalidation
+static bool bPinDecidedLocally = false;
+
+// When the strike was last energized, to see how long the door stays unlocked
+static int64_t unlockTime = 0;
+
+// When the access metrics and runtime stats are next due
+static int64_t runtimeStatsTime = 0;
+
+// The tap being decided. The decision must be made by accessDeadline, or it is made offline.
+static int64_t  attemptStartTime = 0;
+static int64_t  accessDeadline   = 0;
+static uint32_t accessBudgetMs   = ACCESS_BUDGET_MS;
+
+// A polled open/closed status younger than this is trusted without asking isvhsopen.com again
+#define IS_VHS_OPEN_FRESH_US (2 * SECONDS_IN_US(IS_VHS_OPEN_POLL_INTERVAL_MS / 1000))
+
+// The ID of a refresh of a stale open/closed status requested from the poller, 0 if none is pending
+static uint32_t isVHSOpenRequestId = 0;
+
+static bool getFreshIsVHSOpenStatus(bool* pOpen) {
+    IsVHSOpenStatus status;
+    is_vhs_open_get_status(&status);
+
+    if (!status.bValid || ((esp_timer_get_time() - status.fetchTime) > IS_VHS_OPEN_FRESH_US)) {
+        return false;
+    }
+
+    *pOpen = status.bOpen;
+    return true;
+}
+
+// See ACCESS_BUDGET_MS. The percentiles are bucket bounds, so this errs long.
+static uint32_t getAccessBudgetMs() {
+    AccessStageStats connect;
+    AccessStageStats response;
+    access_metrics_get_stage(ACCESS_STAGE_Connect, &connect);
+    access_metrics_get_stage(ACCESS_STAGE_Response, &response);
+    if (connect.count < ACCESS_BUDGET_MIN_SAMPLES) {
+        return ACCESS_BUDGET_MS;
+    }
+
+    uint32_t budgetMs = (access_metrics_percentile(connect, 95) + access_metrics_percentile(response, 95) + 999) / 1000;
+    if (budgetMs < ACCESS_BUDGET_MIN_MS) {
+        return ACCESS_BUDGET_MIN_MS;
+    }
+    if (budgetMs > NOMOS_HTTP_TIMEOUT_MS) {
+        return NOMOS_HTTP_TIMEOUT_MS;
+    }
+    return budgetMs;
+}
+
+//
+static void processIsVHSOpenResult(bool bOpen) {
+    if (bOpen) {
+        // VHS is open - let the member in
+        ESP_LOGI(TAG, "VHS is open. Access granted.");
+
+        mainStateMachine.SetState(MainStateMachine::STATE_AccessGranted);
+
+        if (!uart_thread_notify(UART_NOTIFICATION_PlaySmb, 0)) {
+            // Erk. Did not add to the queue. Oh well? It's just a sfx
+        }
+        if (!uart_thread_notify(UART_NOTIFICATION_PlayBuzzer01, 10 / portTICK_PERIOD_MS)) {
+            // Erk. Did not add to the queue. Oh well? It's just a sfx
+        }
+    } else {
+        // VHS is closed - require a keyholder to enter their pin to open the door
+        ESP_LOGI(TAG, "VHS is closed, PIN required.");
+
+        mainStateMachine.SetState(MainStateMachine::STATE_WaitingForPIN);
+
+        //
+        if (!uart_thread_notify(UART_NOTIFICATION_PlaySuccess, 0)) {
+            // Erk. Did not add to the queue. Oh well? It's just a sfx
+        }
+    }
+}
+
+//
+static void processRfidResult(const NomosHttpResponseResult& result) {
+    if ((result.userId > 0) && result.bValidUser) {
+        if (result.bHasDoorAccess && result.bHasBeenVetted) {
+            // Magical RFID card. Such power. Much access. So fast. Wow.
+            ESP_LOGI(TAG, "RFID-only access granted.");
+
+            mainStateMachine.SetState(MainStateMachine::STATE_AccessGranted);
+
+            if (!uart_thread_notify(UART_NOTIFICATION_PlaySmb, 0)) {
+                // Erk. Did not add to the queue. Oh well? It's just a sfx
+            }
+            if (!uart_thread_notify(UART_NOTIFICATION_PlayBuzzer01, 10 / portTICK_PERIOD_MS)) {
+                // Erk. Did not add to the queue. Oh well? It's just a sfx
+            }
+        } else {
+            // Check if VHS is open as that'll dictate if we just open the door or require further PIN authentication
+            bool bOpen = false;
+            if (getFreshIsVHSOpenStatus(&bOpen)) {
+                ESP_LOGI(TAG, "RFID validated, VHS open status already known.");
+
+                processIsVHSOpenResult(bOpen);
+                return;
+            }
+
+            ESP_LOGI(TAG, "RFID validated, waiting to hear if VHS is open.");
+
+            if (isVHSOpenRequestId == 0) {
+                isVHSOpenRequestId = is_vhs_open_request_status();
+            }
+
+            mainStateMachine.SetState(MainStateMachine::STATE_IsVHSOpen);
+
+            // Don't play the SFX here, as we're not ready for the PIN until we've checked if VHS is currently open or not.
+            // if (!uart_thread_notify(UART_NOTIFICATION_PlaySuccess, 0)) {
+            //     // Erk. Did not add to the queue. Oh well? It's just a sfx
+            // }
+        }
+    } else {
+        // No such user
+        ESP_LOGI(TAG, "Invalid RFID card.");
+
+        mainStateMachine.SetState(MainStateMachine::STATE_Idle);
+
+        if (!uart_thread_notify(UART_NOTIFICATION_PlayFailure, 10 / portTICK_PERIOD_MS)) {
+            // Erk. Did not add to the queue. Oh well? It's just a sfx
+        }
+    }
+}
+
 //
 static void processRfidReadyNotification(const MainNotificationArgs& notificationArgs) {
-    if (notificationArgs.rfid.idLength == 7) {
+    if (notificationArgs.rfid.idLength == RFID_CACHE_ID_LENGTH) {
+        attemptStartTime = notificationArgs.rfid.receivedTime;
+        accessBudgetMs   = getAccessBudgetMs();
+        accessDeadline   = attemptStartTime + (accessBudgetMs * 1000LL);
+        access_metrics_record(ACCESS_STAGE_UartToMain, esp_timer_get_time() - attemptStartTime);
+
         const uint8_t* id = notificationArgs.rfid.id;
-        sprintf(nomosHttpRequestBody, "{ \"rfid\": \"%02X:%02X:%02X:%02X:%02X:%02X:%02X\" }", id[0], id[1], id[2], id[3], id[4], id[5], id[6]);
+        char           body[NOMOS_HTTP_REQUEST_BODY_SIZE];
+        sprintf(body, "{ \"rfid\": \"%02X:%02X:%02X:%02X:%02X:%02X:%02X\" }", id[0], id[1], id[2], id[3], id[4], id[5], id[6]);
 
-        xTaskNotify(NomosHttpTaskHandle, NOMOS_HTTP_NOTIFICATION_RequestRfid, eSetValueWithOverwrite);
+        // Always ask Nomos - on a cache hit this refreshes the entry in the background
+        rfidRequestId = nomos_http_request(NOMOS_HTTP_NOTIFICATION_RequestRfid, body);
+        if (rfidRequestId == 0) {
+            ESP_LOGE(TAG, "Nomos request queue full, RFID not checked.");
+        }
+
+        // If the polled open/closed status has gone stale, refresh it at the same time in case this member isn't vetted
+        bool bOpen = false;
+        if (!getFreshIsVHSOpenStatus(&bOpen) && (isVHSOpenRequestId == 0)) {
+            isVHSOpenRequestId = is_vhs_open_request_status();
+        }
+
+        memcpy(pendingRfid, id, RFID_CACHE_ID_LENGTH);
+        strcpy(pendingRfidBody, body);
+
+        int64_t                 lookupStart = esp_timer_get_time();
+        NomosHttpResponseResult cachedResult;
+        bRfidDecidedFromCache = rfid_cache_lookup(id, &cachedResult) || member_db_find_rfid(id, &cachedResult);
+        access_metrics_record(ACCESS_STAGE_LocalLookup, esp_timer_get_time() - lookupStart);
+        if (bRfidDecidedFromCache) {
+            ESP_LOGI(TAG, "RFID known locally, revalidating in the background.");
+
+            processRfidResult(cachedResult);
+            return;
+        }
 
         mainStateMachine.SetState(MainStateMachine::STATE_ValidatingRFID);
 
         //
-        UartNotification notification = UART_NOTIFICATION_PlayBeepShortHigh;
-        if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
+        if (!uart_thread_notify(UART_NOTIFICATION_PlayBeepShortHigh, 0)) {
             // Erk. Did not add to the queue. Oh well? It's just a sfx
         }
     } else {
         ESP_LOGE(TAG, "Unexpected RFID card ID length: %d", (int)notificationArgs.rfid.idLength);
 
-        UartNotification notification = UART_NOTIFICATION_PlayFailure;
-        if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
+        if (!uart_thread_notify(UART_NOTIFICATION_PlayFailure, 0)) {
             // Erk. Did not add to the queue. Oh well? It's just a sfx
         }
     }
@@ -67,88 +237,147 @@ static void processPinReadyNotification(const MainNotificationArgs& notification
     if (mainStateMachine.GetState() != MainStateMachine::STATE_WaitingForPIN) {
         ESP_LOGE(TAG, "Unexpected state when PIN entered: %d", (int)mainStateMachine.GetState());
 
-        UartNotification notification = UART_NOTIFICATION_PlayFailure;
-        if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
+        if (!uart_thread_notify(UART_NOTIFICATION_PlayFailure, 0)) {
             // Erk. Did not add to the queue. Oh well? It's just a sfx
         }
 
         return;
     }
 
-    sprintf(nomosHttpRequestBody, "{ \"pin\": \"%08d\" }", notificationArgs.pin.code);
+    attemptStartTime = notificationArgs.pin.receivedTime;
+    accessBudgetMs   = getAccessBudgetMs();
+    accessDeadline   = attemptStartTime + (accessBudgetMs * 1000LL);
+    access_metrics_record(ACCESS_STAGE_UartToMain, esp_timer_get_time() - attemptStartTime);
+
+    char body[NOMOS_HTTP_REQUEST_BODY_SIZE];
+    sprintf(body, "{ \"pin\": \"%08d\" }", notificationArgs.pin.code);
+
+    pinRequestId = nomos_http_request(NOMOS_HTTP_NOTIFICATION_RequestPin, body);
+    if (pinRequestId == 0) {
+        ESP_LOGE(TAG, "Nomos request queue full, PIN not checked.");
+    }
+
+    pendingPin = notificationArgs.pin.code;
+    strcpy(pendingPinBody, body);
+
+    // Only a known good PIN is decided locally; anything else waits for Nomos
+    int64_t                 lookupStart = esp_timer_get_time();
+    NomosHttpResponseResult localResult;
+    bPinDecidedLocally = member_db_find_pin(pendingPin, &localResult) && localResult.bValidUser && localResult.bHasDoorAccess && localResult.bHasBeenVetted;
+    access_metrics_record(ACCESS_STAGE_LocalLookup, esp_timer_get_time() - lookupStart);
+    if (bPinDecidedLocally) {
+        ESP_LOGI(TAG, "PIN known locally. Access granted, revalidating in the background.");
 
-    xTaskNotify(NomosHttpTaskHandle, NOMOS_HTTP_NOTIFICATION_RequestPin, eSetValueWithOverwrite);
+        mainStateMachine.SetState(MainStateMachine::STATE_AccessGranted);
+
+        if (!uart_thread_notify(UART_NOTIFICATION_PlaySuccess, 0)) {
+            // Erk. Did not add to the queue. Oh well? It's just a sfx
+        }
+        if (!uart_thread_notify(UART_NOTIFICATION_PlayBuzzer01, 10 / portTICK_PERIOD_MS)) {
+            // Erk. Did not add to the queue. Oh well? It's just a sfx
+        }
+        return;
+    }
 
     mainStateMachine.SetState(MainStateMachine::STATE_ValidatingPIN);
 
     //
-    UartNotification notification = UART_NOTIFICATION_PlayBeepShortHigh;
-    if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
+    if (!uart_thread_notify(UART_NOTIFICATION_PlayBeepShortHigh, 0)) {
         // Erk. Did not add to the queue. Oh well? It's just a sfx
     }
 }
 
 //
-static void processNomosHttpRequestResultReadyNotification(const MainNotificationArgs& notificationArgs) {
+static void recordNomosStageTimes(const NomosHttpStageTimes& stageTimes) {
+    access_metrics_record(ACCESS_STAGE_NomosQueue, stageTimes.queueUs);
+    if (stageTimes.connectUs != 0) {
+        access_metrics_record(ACCESS_STAGE_Connect, stageTimes.connectUs);
+    }
+    if (stageTimes.responseUs != 0) {
+        access_metrics_record(ACCESS_STAGE_Response, stageTimes.responseUs);
+        access_metrics_record(ACCESS_STAGE_Body, stageTimes.bodyUs);
+        access_metrics_record(ACCESS_STAGE_Parse, stageTimes.parseUs);
+    }
+}
+
+//
+static void processNomosHttpRequestResultReadyNotification(const BusMessage& message) {
+    const MainNotificationArgs& notificationArgs = message.main;
+
+    if (notificationArgs.NomosHttpRequestResult.httpNotification != NOMOS_HTTP_NOTIFICATION_RequestValidate) {
+        recordNomosStageTimes(notificationArgs.NomosHttpRequestResult.stageTimes);
+    }
+
     if (notificationArgs.NomosHttpRequestResult.httpNotification == NOMOS_HTTP_NOTIFICATION_RequestValidate) {
         // Unused at this time
         if (notificationArgs.NomosHttpRequestResult.success) {
         }
     } else if (notificationArgs.NomosHttpRequestResult.httpNotification == NOMOS_HTTP_NOTIFICATION_RequestRfid) {
+        if ((message.requestId == 0) || (message.requestId != rfidRequestId)) {
+            ESP_LOGI(TAG, "Ignoring reply to superseded RFID request %u.", message.requestId);
+            return;
+        }
+        if (strcmp(notificationArgs.NomosHttpRequestResult.body, pendingRfidBody) != 0) {
+            ESP_LOGE(TAG, "Ignoring RFID reply for a different card.");
+            return;
+        }
+        rfidRequestId = 0;
+
+        bool bRevalidation    = bRfidDecidedFromCache;
+        bRfidDecidedFromCache = false;
+
         if (notificationArgs.NomosHttpRequestResult.success) {
-            const NomosHttpResponseResult& result = notificationArgs.NomosHttpRequestResult.result;
-            if ((result.userId > 0) && result.bValidUser) {
-                if (result.bHasDoorAccess && result.bHasBeenVetted) {
-                    // Magical RFID card. Such power. Much access. So fast. Wow.
-                    ESP_LOGI(TAG, "RFID-only access granted.");
-
-                    mainStateMachine.SetState(MainStateMachine::STATE_AccessGranted);
-
-                    UartNotification notification = UART_NOTIFICATION_PlaySmb;
-                    if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
-                        // Erk. Did not add to the queue. Oh well? It's just a sfx
-                    }
-                    notification = UART_NOTIFICATION_PlayBuzzer01;
-                    if (xQueueSendToBack(UART_queueHandle, &notification, 10 / portTICK_PERIOD_MS) != pdTRUE) {
-                        // Erk. Did not add to the queue. Oh well? It's just a sfx
-                    }
-                } else {
-                    // Check if VHS is open as that'll dictate if we just open the door or require further PIN authentication
-                    ESP_LOGI(TAG, "RFID validated, checking if VHS is open.");
-
-                    xTaskNotify(IsVHSOpenHttpTaskHandle, IS_VHS_OPEN_HTTP_NOTIFICATION_Status, eSetValueWithOverwrite);
-
-                    mainStateMachine.SetState(MainStateMachine::STATE_IsVHSOpen);
-
-                    // Don't play the SFX here, as we're not ready for the PIN until we've checked if VHS is currently open or not.
-                    // UartNotification notification = UART_NOTIFICATION_PlaySuccess;
-                    // if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
-                    //     // Erk. Did not add to the queue. Oh well? It's just a sfx
-                    // }
-                }
-            } else {
-                // No such user
-                ESP_LOGI(TAG, "Invalid RFID card.");
+            rfid_cache_store(pendingRfid, notificationArgs.NomosHttpRequestResult.result);
+            member_db_store_rfid(pendingRfid, notificationArgs.NomosHttpRequestResult.result);
+        } else if (notificationArgs.NomosHttpRequestResult.bAnswered) {
+            // Nomos answered, just not with a grant. Don't keep letting the card in on an old one.
+            rfid_cache_forget(pendingRfid);
+            member_db_forget_rfid(pendingRfid);
+        }
 
-                mainStateMachine.SetState(MainStateMachine::STATE_Idle);
+        if (bRevalidation) {
+            // The door already acted on the cached reply; the fresh one is used on the next tap
+            ESP_LOGI(TAG, "RFID cache entry revalidated.");
+            return;
+        }
 
-                UartNotification notification = UART_NOTIFICATION_PlayFailure;
-                if (xQueueSendToBack(UART_queueHandle, &notification, 10 / portTICK_PERIOD_MS) != pdTRUE) {
-                    // Erk. Did not add to the queue. Oh well? It's just a sfx
-                }
-            }
+        if (notificationArgs.NomosHttpRequestResult.success) {
+            processRfidResult(notificationArgs.NomosHttpRequestResult.result);
         } else {
             // Request failed, likely due to missing fields in the results because the user doesn't have access or is invalid
             ESP_LOGI(TAG, "RFID request failed.");
 
             mainStateMachine.SetState(MainStateMachine::STATE_Idle);
 
-            UartNotification notification = UART_NOTIFICATION_PlayFailure;
-            if (xQueueSendToBack(UART_queueHandle, &notification, 10 / portTICK_PERIOD_MS) != pdTRUE) {
+            if (!uart_thread_notify(UART_NOTIFICATION_PlayFailure, 10 / portTICK_PERIOD_MS)) {
                 // Erk. Did not add to the queue. Oh well? It's just a sfx
             }
         }
     } else if (notificationArgs.NomosHttpRequestResult.httpNotification == NOMOS_HTTP_NOTIFICATION_RequestPin) {
+        if ((message.requestId == 0) || (message.requestId != pinRequestId)) {
+            ESP_LOGI(TAG, "Ignoring reply to superseded PIN request %u.", message.requestId);
+            return;
+        }
+        if (strcmp(notificationArgs.NomosHttpRequestResult.body, pendingPinBody) != 0) {
+            ESP_LOGE(TAG, "Ignoring PIN reply for a different PIN.");
+            return;
+        }
+        pinRequestId = 0;
+
+        bool bRevalidation = bPinDecidedLocally;
+        bPinDecidedLocally = false;
+
+        if (notificationArgs.NomosHttpRequestResult.success) {
+            member_db_store_pin(pendingPin, notificationArgs.NomosHttpRequestResult.result);
+        } else if (notificationArgs.NomosHttpRequestResult.bAnswered) {
+            member_db_forget_pin(pendingPin);
+        }
+
+        if (bRevalidation) {
+            ESP_LOGI(TAG, "Member db PIN revalidated.");
+            return;
+        }
+
         if (notificationArgs.NomosHttpRequestResult.success) {
             const NomosHttpResponseResult& result = notificationArgs.NomosHttpRequestResult.result;
             if ((result.userId > 0) && result.bValidUser && result.bHasDoorAccess && result.bHasBeenVetted) {
@@ -157,12 +386,10 @@ static void processNomosHttpRequestResultReadyNotification(const MainNotificatio
 
                 mainStateMachine.SetState(MainStateMachine::STATE_AccessGranted);
 
-                UartNotification notification = UART_NOTIFICATION_PlaySuccess;
-                if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
+                if (!uart_thread_notify(UART_NOTIFICATION_PlaySuccess, 0)) {
                     // Erk. Did not add to the queue. Oh well? It's just a sfx
                 }
-                notification = UART_NOTIFICATION_PlayBuzzer01;
-                if (xQueueSendToBack(UART_queueHandle, &notification, 10 / portTICK_PERIOD_MS) != pdTRUE) {
+                if (!uart_thread_notify(UART_NOTIFICATION_PlayBuzzer01, 10 / portTICK_PERIOD_MS)) {
                     // Erk. Did not add to the queue. Oh well? It's just a sfx
                 }
             } else {
@@ -171,8 +398,7 @@ static void processNomosHttpRequestResultReadyNotification(const MainNotificatio
 
                 mainStateMachine.SetState(MainStateMachine::STATE_WaitingForPIN);
 
-                UartNotification notification = UART_NOTIFICATION_PlayFailure;
-                if (xQueueSendToBack(UART_queueHandle, &notification, 10 / portTICK_PERIOD_MS) != pdTRUE) {
+                if (!uart_thread_notify(UART_NOTIFICATION_PlayFailure, 10 / portTICK_PERIOD_MS)) {
                     // Erk. Did not add to the queue. Oh well? It's just a sfx
                 }
             }
@@ -182,8 +408,7 @@ static void processNomosHttpRequestResultReadyNotification(const MainNotificatio
 
             mainStateMachine.SetState(MainStateMachine::STATE_WaitingForPIN);
 
-            UartNotification notification = UART_NOTIFICATION_PlayFailure;
-            if (xQueueSendToBack(UART_queueHandle, &notification, 10 / portTICK_PERIOD_MS) != pdTRUE) {
+            if (!uart_thread_notify(UART_NOTIFICATION_PlayFailure, 10 / portTICK_PERIOD_MS)) {
                 // Erk. Did not add to the queue. Oh well? It's just a sfx
             }
         }
@@ -196,34 +421,18 @@ static void processNomosHttpRequestResultReadyNotification(const MainNotificatio
 }
 
 //
-static void processIsVHSOpenHttpRequestResultReadyNotification(const MainNotificationArgs& notificationArgs) {
-    if (notificationArgs.IsVHSOpenHttpRequestResult.httpNotification == IS_VHS_OPEN_HTTP_NOTIFICATION_Status) {
-        if (notificationArgs.IsVHSOpenHttpRequestResult.success &&
-            notificationArgs.IsVHSOpenHttpRequestResult.open) {
-            // VHS is open - let the member in
-            ESP_LOGI(TAG, "VHS is open. Access granted.");
-
-            mainStateMachine.SetState(MainStateMachine::STATE_AccessGranted);
-
-            UartNotification notification = UART_NOTIFICATION_PlaySmb;
-            if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
-                // Erk. Did not add to the queue. Oh well? It's just a sfx
-            }
-            notification = UART_NOTIFICATION_PlayBuzzer01;
-            if (xQueueSendToBack(UART_queueHandle, &notification, 10 / portTICK_PERIOD_MS) != pdTRUE) {
-                // Erk. Did not add to the queue. Oh well? It's just a sfx
-            }
-        } else {
-            // VHS is closed - require a keyholder to enter their pin to open the door
-            ESP_LOGI(TAG, "VHS is closed, PIN required.");
+static void processIsVHSOpenHttpRequestResultReadyNotification(const BusMessage& message) {
+    const MainNotificationArgs& notificationArgs = message.main;
 
-            mainStateMachine.SetState(MainStateMachine::STATE_WaitingForPIN);
+    if (notificationArgs.IsVHSOpenHttpRequestResult.httpNotification == IS_VHS_OPEN_HTTP_NOTIFICATION_Status) {
+        if (message.requestId != isVHSOpenRequestId) {
+            return;
+        }
+        isVHSOpenRequestId = 0;
 
-            //
-            UartNotification notification = UART_NOTIFICATION_PlaySuccess;
-            if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
-                // Erk. Did not add to the queue. Oh well? It's just a sfx
-            }
+        // Otherwise this was a speculative refresh, and the poller's snapshot will be used when the RFID reply arrives
+        if (mainStateMachine.GetState() == MainStateMachine::STATE_IsVHSOpen) {
+            processIsVHSOpenResult(notificationArgs.IsVHSOpenHttpRequestResult.success && notificationArgs.IsVHSOpenHttpRequestResult.open);
         }
     } else {
         // Error
@@ -234,64 +443,238 @@ static void processIsVHSOpenHttpRequestResultReadyNotification(const MainNotific
 }
 
 
+// The tap has run out of time waiting on Nomos, so decide with what's known locally. Nothing was
+// found locally when the tap arrived, or it would already have been decided, so a card or PIN is
+// refused. Its request carries on and fills the local copies, and a retry while it's out joins it.
+static void processAccessDeadline() {
+    if ((accessDeadline == 0) || (esp_timer_get_time() < accessDeadline)) {
+        return;
+    }
+    accessDeadline = 0;
+
+    MainStateMachine::State_e state = mainStateMachine.GetState();
+    if (state == MainStateMachine::STATE_ValidatingRFID) {
+        // Not known locally either. This isn't an invalid card, so tell them to try again rather than play the failure.
+        ESP_LOGI(TAG, "Nomos didn't answer within %u ms and the RFID isn't known locally, try again.", accessBudgetMs);
+        access_metrics_budget_expired();
+        access_metrics_refused_at_deadline();
+
+        // The reply still refreshes the local copies when it arrives
+        bRfidDecidedFromCache = true;
+
+        mainStateMachine.SetState(MainStateMachine::STATE_Idle);
+
+        if (!uart_thread_notify(UART_NOTIFICATION_PlayBeepLongLow, 10 / portTICK_PERIOD_MS)) {
+            // Erk. Did not add to the queue. Oh well? It's just a sfx
+        }
+    } else if (state == MainStateMachine::STATE_ValidatingPIN) {
+        ESP_LOGI(TAG, "Nomos didn't answer within %u ms and the PIN isn't known locally, try again.", accessBudgetMs);
+        access_metrics_budget_expired();
+        access_metrics_refused_at_deadline();
+
+        bPinDecidedLocally = true;
+
+        mainStateMachine.SetState(MainStateMachine::STATE_WaitingForPIN);
+
+        if (!uart_thread_notify(UART_NOTIFICATION_PlayBeepLongLow, 10 / portTICK_PERIOD_MS)) {
+            // Erk. Did not add to the queue. Oh well? It's just a sfx
+        }
+    } else if (state == MainStateMachine::STATE_IsVHSOpen) {
+        // Only a recent poll can let a member in without a PIN. An old one may predate the last person
+        // leaving, so anything else counts as closed.
+        bool bOpen  = false;
+        bool bFresh = getFreshIsVHSOpenStatus(&bOpen);
+
+        ESP_LOGI(TAG, "No reply from isvhsopen.com within %u ms, %s.", accessBudgetMs, bFresh ? "using the last poll" : "treating VHS as closed");
+        access_metrics_budget_expired();
+
+        processIsVHSOpenResult(bFresh && bOpen);
+    }
+}
+
+// Until the access deadline or the next runtime stats, whichever is sooner. State timeouts arrive
+// as notifications, so there's no need to wake up just to check on the state machine.
+static TickType_t nextWaitTicks() {
+    int64_t deadline = runtimeStatsTime;
+    if ((accessDeadline != 0) && (accessDeadline < deadline)) {
+        deadline = accessDeadline;
+    }
+
+    int64_t remaining = deadline - esp_timer_get_time();
+    if (remaining <= 0) {
+        return 0;
+    }
+
+    int64_t ticks = (remaining / 1000 / portTICK_PERIOD_MS) + 1;
+    return (ticks < portMAX_DELAY) ? (TickType_t)ticks : portMAX_DELAY;
+}
+
+//
+static bool isAwaitingDecision(MainStateMachine::State_e state) {
+    return (state == MainStateMachine::STATE_ValidatingRFID) || (state == MainStateMachine::STATE_ValidatingPIN) || (state == MainStateMachine::STATE_IsVHSOpen);
+}
+
 //
 static void onStateChange(MainStateMachine::State_e oldState, MainStateMachine::State_e newState) {
-    time_t    now      = 0;
-    struct tm timeinfo = {};
-    //
-    time(&now);
-    localtime_r(&now, &timeinfo);
-    //
-    char dateTimeStr[64];
-    strftime(dateTimeStr, sizeof(dateTimeStr), "%c", &timeinfo);
+    // This is on the path to the strike, so no wall clock formatting here. The log line has its own timestamp.
+    int64_t now = esp_timer_get_time();
 
-    ESP_LOGI(TAG, "State change: %s -> %s at %s",
+    ESP_LOGI(TAG, "State change: %s -> %s",
              MainStateMachine::GetStateName(oldState),
-             MainStateMachine::GetStateName(newState),
-             dateTimeStr);
+             MainStateMachine::GetStateName(newState));
+
+    int64_t tapTime = 0;
+    if (!isAwaitingDecision(newState)) {
+        accessDeadline   = 0;
+        tapTime          = attemptStartTime;
+        attemptStartTime = 0;
+    }
+
+    // A refresh whose reply never arrived (the poller couldn't publish it) mustn't block every later one
+    if ((oldState == MainStateMachine::STATE_IsVHSOpen) || (newState == MainStateMachine::STATE_Idle)) {
+        isVHSOpenRequestId = 0;
+    }
+
+    if (newState == MainStateMachine::STATE_Idle) {
+        // Timed out or gave up, so stop waiting on Nomos. Background revalidations are left to finish.
+        if ((rfidRequestId != 0) && !bRfidDecidedFromCache) {
+            nomos_http_cancel(NOMOS_HTTP_NOTIFICATION_RequestRfid, rfidRequestId);
+            rfidRequestId = 0;
+        }
+        if ((pinRequestId != 0) && !bPinDecidedLocally) {
+            nomos_http_cancel(NOMOS_HTTP_NOTIFICATION_RequestPin, pinRequestId);
+            pinRequestId = 0;
+        }
+    }
 
     if (newState == MainStateMachine::STATE_AccessGranted) {
+        unlockTime = now;
+
         // Energize the electronic strike to open the door
-        UartNotification notification = UART_NOTIFICATION_UnlockDoor;
-        if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
+        if (!uart_thread_notify(UART_NOTIFICATION_UnlockDoor, 0)) {
             // Erk. Did not add to the queue. This one is a problem - we failed to open the door!
+        } else if (tapTime != 0) {
+            access_metrics_record(ACCESS_STAGE_TapToUnlock, esp_timer_get_time() - tapTime);
         }
     } else {
         // De-energize the electronic strike to ensure the door is locked
-        UartNotification notification = UART_NOTIFICATION_LockDoor;
-        if (xQueueSendToBack(UART_queueHandle, &notification, 0) != pdTRUE) {
+        if (!uart_thread_notify(UART_NOTIFICATION_LockDoor, 0)) {
             // Erk. Did not add to the queue. This one is a BIG problem - we failed to lock the door!!!
         }
     }
+
+    // Recorded last so the timings above aren't held up by them
+    if (tapTime != 0) {
+        access_metrics_record(ACCESS_STAGE_Decision, now - tapTime);
+        ESP_LOGI(TAG, "Tap decided in %u ms.", (uint32_t)((now - tapTime) / 1000));
+    }
+}
+
+// Words of stack never used, so how close each task has come to overflowing
+static void logTaskStack(const char* name, TaskHandle_t taskHandle) {
+    if (taskHandle != NULL) {
+        ESP_LOGI(TAG, "%-22s stack high water %u", name, (uint32_t)uxTaskGetStackHighWaterMark(taskHandle));
+    }
+}
+
+// Latency, throughput and the headroom left in queues, stacks and heap under the recent load
+static void logRuntimeStats() {
+    static int64_t  lastLogTime       = 0;
+    static uint32_t lastLogCount      = 0;
+    static uint32_t lastDecisionCount = 0;
+
+    int64_t now = esp_timer_get_time();
+    if (now < runtimeStatsTime) {
+        return;
+    }
+    runtimeStatsTime = now + (ACCESS_METRICS_LOG_PERIOD_MS * 1000LL);
+
+    // Only when there's been a tap since the last time
+    AccessMetrics metrics;
+    access_metrics_get(&metrics);
+    if (metrics.stages[ACCESS_STAGE_UartToMain].count == lastLogCount) {
+        return;
+    }
+    lastLogCount = metrics.stages[ACCESS_STAGE_UartToMain].count;
+
+    int64_t periodUs = now - lastLogTime;
+    lastLogTime      = now;
+
+    uint32_t decisions = metrics.stages[ACCESS_STAGE_Decision].count - lastDecisionCount;
+    lastDecisionCount  = metrics.stages[ACCESS_STAGE_Decision].count;
+    ESP_LOGI(TAG, "%u decisions in the last %u s.", decisions, (uint32_t)(periodUs / 1000000));
+
+    access_metrics_log();
+    bus_log_stats();
+
+    logTaskStack("main", MAIN_taskHandle);
+    logTaskStack("uart_task", UART_taskHandle);
+    logTaskStack("nomos_https_task", NomosHttpTaskHandle);
+    logTaskStack("is_vhs_open_http_task", IsVHSOpenHttpTaskHandle);
+    ESP_LOGI(TAG, "Free heap %u, lowest ever %u", esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+}
+
+// esp_timer task. Hands the timeout to the main task, ahead of any waiting input.
+static bool onStateTimeout(uint32_t stateId) {
+    BusMessage message;
+    bzero(&message, sizeof(BusMessage));
+    message.main.notification         = MAIN_NOTIFICATION_StateTimeout;
+    message.main.stateTimeout.stateId = stateId;
+    return bus_publish(BUS_TOPIC_Main, message, BUS_PRIORITY_High, 0);
+}
+
+//
+static void processDoorSensorNotification(const MainNotificationArgs& notificationArgs) {
+    if (!notificationArgs.door.bOpen) {
+        ESP_LOGI(TAG, "Door closed.");
+        return;
+    }
+
+    if (mainStateMachine.GetState() == MainStateMachine::STATE_AccessGranted) {
+        ESP_LOGI(TAG, "Door opened %u ms after unlocking, relocking.", (uint32_t)((esp_timer_get_time() - unlockTime) / 1000));
+    } else {
+        ESP_LOGI(TAG, "Door opened.");
+    }
+    mainStateMachine.OnDoorOpened();
 }
 
 //
 void main_thread_init() {
-    mainStateMachine.init(&onStateChange);
+    mainStateMachine.init(&onStateChange, &onStateTimeout);
+    runtimeStatsTime = esp_timer_get_time() + (ACCESS_METRICS_LOG_PERIOD_MS * 1000LL);
 
-    MAIN_taskHandle = xTaskGetCurrentTaskHandle();
+    rfid_cache_init();
+    member_db_init();
 
-    MAIN_queueHandle = xQueueCreateStatic(ARRAY_COUNT(MAIN_queueStorage), sizeof(MainNotificationArgs), (uint8_t*)MAIN_queueStorage, &MAIN_queueStructure);
+    MAIN_taskHandle = xTaskGetCurrentTaskHandle();
 }
 
 void main_thread_run() {
     while (1) {
-        mainStateMachine.Update();
+        processAccessDeadline();
+
+        BusMessage message;
+        if (bus_receive(BUS_TOPIC_Main, &message, nextWaitTicks())) {
+            const MainNotificationArgs& notificationArgs = message.main;
 
-        //
-        MainNotificationArgs notificationArgs;
-        if (xQueueReceive(MAIN_queueHandle, &notificationArgs, 1000 / portTICK_PERIOD_MS) == pdTRUE) {
             if (notificationArgs.notification == MAIN_NOTIFICATION_RfidReady) {
                 processRfidReadyNotification(notificationArgs);
             } else if (notificationArgs.notification == MAIN_NOTIFICATION_PinReady) {
                 processPinReadyNotification(notificationArgs);
             } else if (notificationArgs.notification == MAIN_NOTIFICATION_NomosHttpRequestResultReady) {
-                processNomosHttpRequestResultReadyNotification(notificationArgs);
+                processNomosHttpRequestResultReadyNotification(message);
             } else if (notificationArgs.notification == MAIN_NOTIFICATION_IsVHSOpenHttpRequestResultReady) {
-                processIsVHSOpenHttpRequestResultReadyNotification(notificationArgs);
+                processIsVHSOpenHttpRequestResultReadyNotification(message);
+            } else if (notificationArgs.notification == MAIN_NOTIFICATION_DoorSensor) {
+                processDoorSensorNotification(notificationArgs);
+            } else if (notificationArgs.notification == MAIN_NOTIFICATION_StateTimeout) {
+                mainStateMachine.OnTimeout(notificationArgs.stateTimeout.stateId);
             } else {
                 ESP_LOGE(TAG, "Unknown MainNotification: %d", (int)notificationArgs.notification);
             }
         }
+
+        bus_log_overflows();
+        logRuntimeStats();
     }
 }
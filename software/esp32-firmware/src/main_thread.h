@@ -11,10 +11,36 @@ enum MainNotification {
     MAIN_NOTIFICATION_PinReady,
     MAIN_NOTIFICATION_NomosHttpRequestResultReady,
     MAIN_NOTIFICATION_IsVHSOpenHttpRequestResultReady,
+    MAIN_NOTIFICATION_DoorSensor,
+    MAIN_NOTIFICATION_StateTimeout,
 
     MAIN_NOTIFICATION_COUNT
 };
 
+// How long a tap may wait on Nomos before the door decides from what it knows locally. A card or PIN
+// that isn't known locally is refused at the deadline with a "try again" beep, even if Nomos would have
+// accepted it. The request carries on in the background and its reply refreshes the local copies; a
+// retry while it is still out waits on that same request rather than starting a new handshake.
+//
+// Once ACCESS_BUDGET_MIN_SAMPLES new connections have been timed, the budget is the p95 of the
+// connect plus the p95 of the response, kept between ACCESS_BUDGET_MIN_MS and NOMOS_HTTP_TIMEOUT_MS.
+// Until then it is ACCESS_BUDGET_MS, which allows for a cold TLS handshake. Override via build_flags.
+#ifndef ACCESS_BUDGET_MS
+#define ACCESS_BUDGET_MS (3 * 1000)
+#endif
+#ifndef ACCESS_BUDGET_MIN_MS
+#define ACCESS_BUDGET_MIN_MS 800
+#endif
+#ifndef ACCESS_BUDGET_MIN_SAMPLES
+#define ACCESS_BUDGET_MIN_SAMPLES 5
+#endif
+
+// How often the access latency histograms, queue, stack and heap stats are dumped to the console, when there
+// have been taps. Override via build_flags.
+#ifndef ACCESS_METRICS_LOG_PERIOD_MS
+#define ACCESS_METRICS_LOG_PERIOD_MS (15 * 60 * 1000)
+#endif
+
 struct MainNotificationArgs {
     MainNotification notification;
 
@@ -22,26 +48,36 @@ struct MainNotificationArgs {
         struct {
             uint8_t id[7];
             uint8_t idLength;
+            int64_t receivedTime; // When the UART task got the frame
         } rfid;
         struct {
             uint32_t code;
+            int64_t  receivedTime;
         } pin;
         struct {
             NomosHttpResponseResult result;
 
             NomosHttpNotification httpNotification;
             bool                  success;
+            bool                  bAnswered; // Nomos replied 200 OK, even if the body wasn't a usable result
+            NomosHttpStageTimes   stageTimes;
+            char                  body[NOMOS_HTTP_REQUEST_BODY_SIZE]; // Of the request answered, naming its card or PIN
         } NomosHttpRequestResult;
         struct {
             IsVHSOpenHttpNotification httpNotification;
             bool                      open;
             bool                      success;
         } IsVHSOpenHttpRequestResult;
+        struct {
+            bool bOpen;
+        } door;
+        struct {
+            uint32_t stateId; // For MainStateMachine::OnTimeout
+        } stateTimeout;
     };
 };
 
-extern TaskHandle_t  MAIN_taskHandle;
-extern QueueHandle_t MAIN_queueHandle;
+extern TaskHandle_t MAIN_taskHandle;
 
 //
 void main_thread_init();
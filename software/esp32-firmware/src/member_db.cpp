@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include <esp_types.h>
+
+#include "esp_system.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "bootloader_random.h"
+
+#include "mbedtls/md.h"
+
+#include "utils.h"
+
+#include "member_db.h"
+
+
+#define TAG "MEMBER_DB"
+
+
+#define MEMBER_DB_NVS_NAMESPACE "member_db"
+
+// The device's PIN hashing key lives apart from the records, so erasing the db doesn't change it
+#define MEMBER_DB_KEY_NVS_NAMESPACE "member_key"
+#define MEMBER_DB_KEY_NVS_KEY "pin_key"
+#define MEMBER_DB_PIN_KEY_LENGTH 32
+
+// Open-addressed with linear probing; kept at most half full so probe chains stay short
+#define MEMBER_DB_INDEX_SIZE (2 * MEMBER_DB_MAX_MEMBERS)
+
+// Re-confirming an unchanged member only rewrites its record this often, to spare the flash
+#define MEMBER_DB_CONFIRM_WRITE_INTERVAL_S (24 * 60 * 60)
+
+enum MemberFlags {
+    MEMBER_FLAG_HasRfid     = (1 << 0),
+    MEMBER_FLAG_HasPin      = (1 << 1),
+    MEMBER_FLAG_ValidUser   = (1 << 2),
+    MEMBER_FLAG_DoorAccess  = (1 << 3),
+    MEMBER_FLAG_BeenVetted  = (1 << 4),
+    MEMBER_FLAG_Credentials = (MEMBER_FLAG_HasRfid | MEMBER_FLAG_HasPin),
+};
+
+// Stored as-is in NVS, one blob per slot
+struct MemberRecord {
+    uint32_t userId;        // 0 if the slot is free
+    uint32_t confirmedTime; // time() when Nomos last confirmed this record
+    uint8_t  flags;
+    uint8_t  rfid[MEMBER_DB_RFID_LENGTH];
+    uint8_t  pinHash[MEMBER_DB_PIN_HASH_LENGTH];
+};
+
+static MemberRecord members[MEMBER_DB_MAX_MEMBERS] = {};
+static int16_t      rfidIndex[MEMBER_DB_INDEX_SIZE] = {};
+static int16_t      pinIndex[MEMBER_DB_INDEX_SIZE]  = {};
+
+static nvs_handle memberDbNvs = 0;
+static bool       bNvsOpen    = false;
+
+static uint8_t pinKey[MEMBER_DB_PIN_KEY_LENGTH] = {};
+static bool    bPinKeyValid                     = false;
+
+
+// FNV-1a
+static uint32_t hash_key(const uint8_t* key, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// HMAC-SHA256 under the device's own key. There are only 10^8 PINs, so a plain hash could be reversed
+// by anyone who read the flash; without the key, the stored values can't be checked against any PIN.
+static bool hash_pin(uint32_t pinCode, uint8_t* pPinHash) {
+    if (!bPinKeyValid) {
+        return false;
+    }
+
+    // Formatted the same way as the PIN sent to Nomos
+    char pinStr[16];
+    int  len = snprintf(pinStr, sizeof(pinStr), "%08u", pinCode);
+
+    uint8_t digest[32];
+    if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), pinKey, sizeof(pinKey), (const unsigned char*)pinStr, len, digest) != 0) {
+        return false;
+    }
+    memcpy(pPinHash, digest, MEMBER_DB_PIN_HASH_LENGTH);
+    return true;
+}
+
+// Loads the PIN key, or makes one on first boot. Returns true if it was just made, in which case
+// no stored PIN hash can match any more.
+static bool load_pin_key() {
+    nvs_handle keyNvs;
+    esp_err_t  err = nvs_open(MEMBER_DB_KEY_NVS_NAMESPACE, NVS_READWRITE, &keyNvs);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open PIN key NVS: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    size_t size = sizeof(pinKey);
+    err         = nvs_get_blob(keyNvs, MEMBER_DB_KEY_NVS_KEY, pinKey, &size);
+    if ((err == ESP_OK) && (size == sizeof(pinKey))) {
+        bPinKeyValid = true;
+        nvs_close(keyNvs);
+        return false;
+    }
+
+    // The hardware RNG is only truly random with an entropy source running. The WiFi radio isn't used on
+    // this board, so use the bootloader's one.
+    bootloader_random_enable();
+    for (size_t i = 0; i < sizeof(pinKey); i += sizeof(uint32_t)) {
+        uint32_t random = esp_random();
+        memcpy(&pinKey[i], &random, sizeof(uint32_t));
+    }
+    bootloader_random_disable();
+
+    err = nvs_set_blob(keyNvs, MEMBER_DB_KEY_NVS_KEY, pinKey, sizeof(pinKey));
+    if (err == ESP_OK) {
+        err = nvs_commit(keyNvs);
+    }
+    nvs_close(keyNvs);
+
+    if (err != ESP_OK) {
+        // A key that won't survive a reboot would orphan every PIN stored with it
+        ESP_LOGE(TAG, "Failed to store PIN key, PINs won't be stored: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Created a new PIN key.");
+    bPinKeyValid = true;
+    return true;
+}
+
+static const uint8_t* record_key(const MemberRecord& record, uint8_t keyFlag) {
+    return (keyFlag == MEMBER_FLAG_HasRfid) ? record.rfid : record.pinHash;
+}
+
+static size_t key_length(uint8_t keyFlag) {
+    return (keyFlag == MEMBER_FLAG_HasRfid) ? MEMBER_DB_RFID_LENGTH : MEMBER_DB_PIN_HASH_LENGTH;
+}
+
+static int16_t* key_index(uint8_t keyFlag) {
+    return (keyFlag == MEMBER_FLAG_HasRfid) ? rfidIndex : pinIndex;
+}
+
+static void index_insert(int16_t* pIndex, uint32_t hash, int16_t slot) {
+    uint32_t i = hash % MEMBER_DB_INDEX_SIZE;
+    while (pIndex[i] >= 0) {
+        i = (i + 1) % MEMBER_DB_INDEX_SIZE;
+    }
+    pIndex[i] = slot;
+}
+
+static void rebuild_indexes() {
+    memset(rfidIndex, 0xFF, sizeof(rfidIndex));
+    memset(pinIndex, 0xFF, sizeof(pinIndex));
+
+    for (int slot = 0; slot < MEMBER_DB_MAX_MEMBERS; slot++) {
+        const MemberRecord& record = members[slot];
+        if (record.userId == 0) {
+            continue;
+        }
+        if (record.flags & MEMBER_FLAG_HasRfid) {
+            index_insert(rfidIndex, hash_key(record.rfid, MEMBER_DB_RFID_LENGTH), slot);
+        }
+        if (record.flags & MEMBER_FLAG_HasPin) {
+            index_insert(pinIndex, hash_key(record.pinHash, MEMBER_DB_PIN_HASH_LENGTH), slot);
+        }
+    }
+}
+
+// Returns the slot holding the credential, or -1
+static int find_slot(const uint8_t* key, uint8_t keyFlag) {
+    const int16_t* pIndex = key_index(keyFlag);
+    size_t         len    = key_length(keyFlag);
+
+    uint32_t i = hash_key(key, len) % MEMBER_DB_INDEX_SIZE;
+    while (pIndex[i] >= 0) {
+        const MemberRecord& record = members[pIndex[i]];
+        if ((record.flags & keyFlag) && (memcmp(record_key(record, keyFlag), key, len) == 0)) {
+            return pIndex[i];
+        }
+        i = (i + 1) % MEMBER_DB_INDEX_SIZE;
+    }
+
+    return -1;
+}
+
+static int find_user_slot(uint32_t userId) {
+    for (int slot = 0; slot < MEMBER_DB_MAX_MEMBERS; slot++) {
+        if (members[slot].userId == userId) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// A free slot, or the one Nomos confirmed longest ago
+static int allocate_slot() {
+    int oldest = 0;
+    for (int slot = 0; slot < MEMBER_DB_MAX_MEMBERS; slot++) {
+        if (members[slot].userId == 0) {
+            return slot;
+        }
+        if (members[slot].confirmedTime < members[oldest].confirmedTime) {
+            oldest = slot;
+        }
+    }
+
+    ESP_LOGI(TAG, "Full, evicting user %u.", members[oldest].userId);
+    return oldest;
+}
+
+static void persist_slot(int slot) {
+    if (!bNvsOpen) {
+        return;
+    }
+
+    char key[8];
+    sprintf(key, "m%d", slot);
+
+    esp_err_t err;
+    if (members[slot].userId == 0) {
+        err = nvs_erase_key(memberDbNvs, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    } else {
+        err = nvs_set_blob(memberDbNvs, key, &members[slot], sizeof(MemberRecord));
+    }
+
+    if (err == ESP_OK) {
+        err = nvs_commit(memberDbNvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write member %s: %s", key, esp_err_to_name(err));
+    }
+}
+
+static bool find(const uint8_t* key, uint8_t keyFlag, NomosHttpResponseResult* pResult) {
+    int slot = find_slot(key, keyFlag);
+    if (slot < 0) {
+        return false;
+    }
+
+    const MemberRecord& record = members[slot];
+    if ((time(NULL) - (time_t)record.confirmedTime) > MEMBER_DB_MAX_AGE_S) {
+        return false;
+    }
+
+    bzero(pResult, sizeof(NomosHttpResponseResult));
+    pResult->userId         = record.userId;
+    pResult->bValidUser     = (record.flags & MEMBER_FLAG_ValidUser) != 0;
+    pResult->bHasDoorAccess = (record.flags & MEMBER_FLAG_DoorAccess) != 0;
+    pResult->bHasBeenVetted = (record.flags & MEMBER_FLAG_BeenVetted) != 0;
+    return true;
+}
+
+static void forget_credential(int slot, uint8_t keyFlag) {
+    MemberRecord& record = members[slot];
+    record.flags &= ~keyFlag;
+    if ((record.flags & MEMBER_FLAG_Credentials) == 0) {
+        bzero(&record, sizeof(MemberRecord));
+    }
+
+    persist_slot(slot);
+    rebuild_indexes();
+}
+
+static void store(const uint8_t* key, uint8_t keyFlag, const NomosHttpResponseResult& result) {
+    size_t len          = key_length(keyFlag);
+    int    existingSlot = find_slot(key, keyFlag);
+
+    if ((result.userId == 0) || !result.bValidUser) {
+        // Nomos no longer recognizes this credential
+        if (existingSlot >= 0) {
+            ESP_LOGI(TAG, "Forgetting credential for user %u.", members[existingSlot].userId);
+            forget_credential(existingSlot, keyFlag);
+        }
+        return;
+    }
+
+    if ((existingSlot >= 0) && (members[existingSlot].userId != result.userId)) {
+        // The credential now belongs to someone else
+        forget_credential(existingSlot, keyFlag);
+        existingSlot = -1;
+    }
+
+    int slot = find_user_slot(result.userId);
+    if (slot < 0) {
+        slot = allocate_slot();
+        bzero(&members[slot], sizeof(MemberRecord));
+        members[slot].userId = result.userId;
+    }
+
+    MemberRecord& record = members[slot];
+
+    uint8_t flags = (record.flags & MEMBER_FLAG_Credentials) | keyFlag | MEMBER_FLAG_ValidUser;
+    if (result.bHasDoorAccess) {
+        flags |= MEMBER_FLAG_DoorAccess;
+    }
+    if (result.bHasBeenVetted) {
+        flags |= MEMBER_FLAG_BeenVetted;
+    }
+
+    uint8_t* pRecordKey = (keyFlag == MEMBER_FLAG_HasRfid) ? record.rfid : record.pinHash;
+    bool     bKeyChanged = (existingSlot != slot);
+    bool     bChanged    = bKeyChanged || (record.flags != flags);
+
+    time_t now = time(NULL);
+    if (!bChanged && ((now - (time_t)record.confirmedTime) < MEMBER_DB_CONFIRM_WRITE_INTERVAL_S)) {
+        return;
+    }
+
+    memcpy(pRecordKey, key, len);
+    record.flags         = flags;
+    record.confirmedTime = (uint32_t)now;
+
+    persist_slot(slot);
+    if (bKeyChanged) {
+        rebuild_indexes();
+    }
+}
+
+//
+void member_db_init() {
+    bzero(members, sizeof(members));
+
+    bool bNewPinKey = load_pin_key();
+
+    esp_err_t err = nvs_open(MEMBER_DB_NVS_NAMESPACE, NVS_READWRITE, &memberDbNvs);
+    bNvsOpen      = (err == ESP_OK);
+    if (!bNvsOpen) {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+    }
+
+    int count = 0;
+    for (int slot = 0; bNvsOpen && (slot < MEMBER_DB_MAX_MEMBERS); slot++) {
+        char key[8];
+        sprintf(key, "m%d", slot);
+
+        size_t size = sizeof(MemberRecord);
+        if ((nvs_get_blob(memberDbNvs, key, &members[slot], &size) != ESP_OK) || (size != sizeof(MemberRecord))) {
+            bzero(&members[slot], sizeof(MemberRecord));
+        }
+
+        if (bNewPinKey && (members[slot].flags & MEMBER_FLAG_HasPin)) {
+            // Hashed under a previous key (or none), so it can never match again
+            bzero(members[slot].pinHash, sizeof(members[slot].pinHash));
+            forget_credential(slot, MEMBER_FLAG_HasPin);
+        }
+
+        if (members[slot].userId != 0) {
+            count++;
+        }
+    }
+
+    rebuild_indexes();
+
+    ESP_LOGI(TAG, "Loaded %d members.", count);
+}
+
+bool member_db_find_rfid(const uint8_t* id, NomosHttpResponseResult* pResult) {
+    return find(id, MEMBER_FLAG_HasRfid, pResult);
+}
+
+bool member_db_find_pin(uint32_t pinCode, NomosHttpResponseResult* pResult) {
+    uint8_t pinHash[MEMBER_DB_PIN_HASH_LENGTH];
+    if (!hash_pin(pinCode, pinHash)) {
+        return false;
+    }
+
+    return find(pinHash, MEMBER_FLAG_HasPin, pResult);
+}
+
+void member_db_store_rfid(const uint8_t* id, const NomosHttpResponseResult& result) {
+    store(id, MEMBER_FLAG_HasRfid, result);
+}
+
+void member_db_store_pin(uint32_t pinCode, const NomosHttpResponseResult& result) {
+    uint8_t pinHash[MEMBER_DB_PIN_HASH_LENGTH];
+    if (!hash_pin(pinCode, pinHash)) {
+        return;
+    }
+
+    store(pinHash, MEMBER_FLAG_HasPin, result);
+}
+
+void member_db_forget_rfid(const uint8_t* id) {
+    int slot = find_slot(id, MEMBER_FLAG_HasRfid);
+    if (slot >= 0) {
+        ESP_LOGI(TAG, "Forgetting card for user %u.", members[slot].userId);
+        forget_credential(slot, MEMBER_FLAG_HasRfid);
+    }
+}
+
+void member_db_forget_pin(uint32_t pinCode) {
+    uint8_t pinHash[MEMBER_DB_PIN_HASH_LENGTH];
+    if (!hash_pin(pinCode, pinHash)) {
+        return;
+    }
+
+    int slot = find_slot(pinHash, MEMBER_FLAG_HasPin);
+    if (slot >= 0) {
+        ESP_LOGI(TAG, "Forgetting PIN for user %u.", members[slot].userId);
+        forget_credential(slot, MEMBER_FLAG_HasPin);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef __MEMBER_DB__H__
+#define __MEMBER_DB__H__
+
+#include "nomos_http_thread.h"
+
+
+#define MEMBER_DB_RFID_LENGTH 7
+#define MEMBER_DB_PIN_HASH_LENGTH 16
+
+// Each member takes one NVS blob, so this is bounded by the size of the nvs partition
+#define MEMBER_DB_MAX_MEMBERS 128
+
+// A member that Nomos hasn't confirmed for this long is no longer trusted offline. A credential is
+// forgotten at once when Nomos answers for it with anything but a usable result; only no answer at
+// all (timeouts, connection failures, non-200 statuses) leaves it in place.
+#define MEMBER_DB_MAX_AGE_S (7 * 24 * 60 * 60)
+
+
+// Offline copy of the members that have used the door, persisted to NVS. It is filled in
+// write-through from Nomos replies, so a member who has been seen before can be authorized
+// locally while the request to Nomos is still in flight, or when it can't be reached at all.
+//
+// PINs are only stored as an HMAC under a random key made on first boot and kept in NVS. To keep
+// that key off a flash dump, build with flash encryption and CONFIG_NVS_ENCRYPTION enabled.
+//
+// NOTE: Only ever touched from the main thread, so it is not locked.
+
+//
+void member_db_init();
+
+// Constant time lookups through a hashed index. Return false on a miss or an expired member.
+bool member_db_find_rfid(const uint8_t* id, NomosHttpResponseResult* pResult);
+bool member_db_find_pin(uint32_t pinCode, NomosHttpResponseResult* pResult);
+
+// Record an authoritative Nomos reply for a card or PIN. Only writes to flash when something changed.
+void member_db_store_rfid(const uint8_t* id, const NomosHttpResponseResult& result);
+void member_db_store_pin(uint32_t pinCode, const NomosHttpResponseResult& result);
+
+// Drop a card or PIN that Nomos answered for without a usable result
+void member_db_forget_rfid(const uint8_t* id);
+void member_db_forget_pin(uint32_t pinCode);
+
+#endif //__MEMBER_DB__H__
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include <esp_types.h>
+
+#include "esp_log.h"
+
+#include "utils.h"
+
+#include "message_bus.h"
+
+
+#define TAG "BUS"
+
+
+// Lane sizes. Indexed by BusTopic, then BusPriority.
+static constexpr UBaseType_t laneSizes[BUS_TOPIC_COUNT][BUS_PRIORITY_COUNT] = {
+    { 4, 8 }, // BUS_TOPIC_Main: HTTP replies, RFID and PIN entry
+    { 4, 8 }, // BUS_TOPIC_Uart: door commands, sfx
+    { 2, 2 }, // BUS_TOPIC_Nomos: RFID and PIN checks, card validation
+    { 1, 2 }, // BUS_TOPIC_IsVHSOpen
+};
+
+// Sum of laneSizes from index on, counting lanes across all topics
+static constexpr UBaseType_t lane_size_sum(int index) {
+    return (index >= (BUS_TOPIC_COUNT * BUS_PRIORITY_COUNT)) ? 0 : (laneSizes[index / BUS_PRIORITY_COUNT][index % BUS_PRIORITY_COUNT] + lane_size_sum(index + 1));
+}
+
+#define BUS_STORAGE_COUNT lane_size_sum(0)
+
+struct BusTopicState {
+    QueueHandle_t     lanes[BUS_PRIORITY_COUNT];
+    StaticQueue_t     laneStructures[BUS_PRIORITY_COUNT];
+    SemaphoreHandle_t pending; // Counts messages across all lanes, so one handle wakes the consumer
+    StaticSemaphore_t pendingStructure;
+    BusTopicStats     stats;
+};
+
+static BusTopicState busTopics[BUS_TOPIC_COUNT];
+static BusMessage    busStorage[BUS_STORAGE_COUNT];
+
+static portMUX_TYPE busStatsMux       = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t     lastRequestId     = 0;
+static uint32_t     loggedOverflowSum = 0;
+
+
+//
+void bus_init() {
+    BusMessage* pStorage = busStorage;
+
+    for (int topic = 0; topic < BUS_TOPIC_COUNT; topic++) {
+        BusTopicState& state = busTopics[topic];
+        bzero(&state.stats, sizeof(BusTopicStats));
+
+        for (int lane = 0; lane < BUS_PRIORITY_COUNT; lane++) {
+            UBaseType_t size = laneSizes[topic][lane];
+            assert((pStorage + size) <= (busStorage + ARRAY_COUNT(busStorage)));
+
+            state.lanes[lane] = xQueueCreateStatic(size, sizeof(BusMessage), (uint8_t*)pStorage, &state.laneStructures[lane]);
+            pStorage += size;
+        }
+
+        state.pending = xSemaphoreCreateCountingStatic(bus_capacity((BusTopic)topic), 0, &state.pendingStructure);
+    }
+    assert(pStorage == (busStorage + ARRAY_COUNT(busStorage)));
+}
+
+//
+bool bus_publish(BusTopic topic, const BusMessage& message, BusPriority priority, TickType_t ticksToWait) {
+    BusTopicState& state = busTopics[topic];
+
+    bool bSent = xQueueSendToBack(state.lanes[priority], &message, ticksToWait) == pdTRUE;
+    if (bSent) {
+        xSemaphoreGive(state.pending);
+    }
+
+    UBaseType_t waiting = uxQueueMessagesWaiting(state.lanes[priority]);
+
+    portENTER_CRITICAL(&busStatsMux);
+    if (bSent) {
+        state.stats.published[priority]++;
+    } else {
+        state.stats.overflows[priority]++;
+    }
+    if (waiting > state.stats.highWater[priority]) {
+        state.stats.highWater[priority] = waiting;
+    }
+    portEXIT_CRITICAL(&busStatsMux);
+
+    return bSent;
+}
+
+//
+bool bus_receive(BusTopic topic, BusMessage* pMessage, TickType_t ticksToWait) {
+    BusTopicState& state = busTopics[topic];
+
+    if (xSemaphoreTake(state.pending, ticksToWait) != pdTRUE) {
+        return false;
+    }
+
+    // Every give follows a send, so one of the lanes has a message for this take
+    for (int lane = 0; lane < BUS_PRIORITY_COUNT; lane++) {
+        if (xQueueReceive(state.lanes[lane], pMessage, 0) == pdTRUE) {
+            return true;
+        }
+    }
+
+    ESP_LOGE(TAG, "Topic %d signalled with no message waiting.", (int)topic);
+    return false;
+}
+
+//
+QueueSetMemberHandle_t bus_wait_handle(BusTopic topic) {
+    return busTopics[topic].pending;
+}
+
+UBaseType_t bus_capacity(BusTopic topic) {
+    UBaseType_t capacity = 0;
+    for (int lane = 0; lane < BUS_PRIORITY_COUNT; lane++) {
+        capacity += laneSizes[topic][lane];
+    }
+    return capacity;
+}
+
+//
+uint32_t bus_next_request_id() {
+    portENTER_CRITICAL(&busStatsMux);
+    uint32_t requestId = ++lastRequestId;
+    if (requestId == 0) {
+        requestId = ++lastRequestId;
+    }
+    portEXIT_CRITICAL(&busStatsMux);
+
+    return requestId;
+}
+
+//
+void bus_get_stats(BusTopic topic, BusTopicStats* pStats) {
+    portENTER_CRITICAL(&busStatsMux);
+    *pStats = busTopics[topic].stats;
+    portEXIT_CRITICAL(&busStatsMux);
+}
+
+void bus_log_overflows() {
+    uint32_t overflowSum = 0;
+
+    BusTopicStats stats[BUS_TOPIC_COUNT];
+    for (int topic = 0; topic < BUS_TOPIC_COUNT; topic++) {
+        bus_get_stats((BusTopic)topic, &stats[topic]);
+        for (int lane = 0; lane < BUS_PRIORITY_COUNT; lane++) {
+            overflowSum += stats[topic].overflows[lane];
+        }
+    }
+
+    if (overflowSum == loggedOverflowSum) {
+        return;
+    }
+    loggedOverflowSum = overflowSum;
+
+    for (int topic = 0; topic < BUS_TOPIC_COUNT; topic++) {
+        const BusTopicStats& topicStats = stats[topic];
+        if ((topicStats.overflows[BUS_PRIORITY_High] + topicStats.overflows[BUS_PRIORITY_Normal]) > 0) {
+            ESP_LOGE(TAG, "Topic %d overflows: %u high (peak %u/%u), %u normal (peak %u/%u)", topic,
+                     topicStats.overflows[BUS_PRIORITY_High], topicStats.highWater[BUS_PRIORITY_High], laneSizes[topic][BUS_PRIORITY_High],
+                     topicStats.overflows[BUS_PRIORITY_Normal], topicStats.highWater[BUS_PRIORITY_Normal], laneSizes[topic][BUS_PRIORITY_Normal]);
+        }
+    }
+}
+
+//
+void bus_log_stats() {
+    for (int topic = 0; topic < BUS_TOPIC_COUNT; topic++) {
+        BusTopicStats topicStats;
+        bus_get_stats((BusTopic)topic, &topicStats);
+
+        ESP_LOGI(TAG, "Topic %d: %u high (peak %u/%u, %u lost), %u normal (peak %u/%u, %u lost)", topic,
+                 topicStats.published[BUS_PRIORITY_High], topicStats.highWater[BUS_PRIORITY_High], laneSizes[topic][BUS_PRIORITY_High], topicStats.overflows[BUS_PRIORITY_High],
+                 topicStats.published[BUS_PRIORITY_Normal], topicStats.highWater[BUS_PRIORITY_Normal], laneSizes[topic][BUS_PRIORITY_Normal], topicStats.overflows[BUS_PRIORITY_Normal]);
+    }
+}
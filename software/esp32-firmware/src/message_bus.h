@@ -0,0 +1,79 @@
+#ifndef __MESSAGE_BUS__H__
+#define __MESSAGE_BUS__H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include "main_thread.h"
+#include "uart_thread.h"
+#include "nomos_http_thread.h"
+#include "is_vhs_open_http_thread.h"
+
+// Statically allocated messaging between tasks. Each topic is consumed by one task and has a
+// bounded queue per priority lane; the consumer always drains the high lane first. Publishing
+// to a full lane fails after ticksToWait and is counted as an overflow.
+
+enum BusTopic {
+    BUS_TOPIC_Main,      // MainNotificationArgs, consumed by main_thread_run
+    BUS_TOPIC_Uart,      // UartNotification and when it was queued, consumed by the UART task
+    BUS_TOPIC_Nomos,     // NomosHttpRequest, consumed by the Nomos HTTP task
+    BUS_TOPIC_IsVHSOpen, // IsVHSOpenHttpNotification, consumed by the isvhsopen.com poller
+
+    BUS_TOPIC_COUNT
+};
+
+enum BusPriority {
+    BUS_PRIORITY_High,
+    BUS_PRIORITY_Normal,
+
+    BUS_PRIORITY_COUNT
+};
+
+struct BusMessage {
+    // From bus_next_request_id() on requests, and copied into their reply. 0 otherwise.
+    uint32_t requestId;
+
+    union {
+        MainNotificationArgs      main;
+        struct {
+            UartNotification notification;
+            int64_t          queuedTime;
+        } uart;
+        NomosHttpRequest          nomos;
+        IsVHSOpenHttpNotification isVHSOpen;
+    };
+};
+
+struct BusTopicStats {
+    uint32_t published[BUS_PRIORITY_COUNT];
+    uint32_t overflows[BUS_PRIORITY_COUNT];
+    uint32_t highWater[BUS_PRIORITY_COUNT]; // Most messages ever waiting in the lane
+};
+
+//
+void bus_init();
+
+// Never blocks longer than ticksToWait. Returns false, and counts an overflow, if the lane stayed full.
+bool bus_publish(BusTopic topic, const BusMessage& message, BusPriority priority, TickType_t ticksToWait);
+
+// Only the topic's consumer may call this
+bool bus_receive(BusTopic topic, BusMessage* pMessage, TickType_t ticksToWait);
+
+// For a consumer that also waits on other queues: add this to its queue set, sized with
+// bus_capacity(), and call bus_receive(topic, ..., 0) when it is selected.
+QueueSetMemberHandle_t bus_wait_handle(BusTopic topic);
+UBaseType_t            bus_capacity(BusTopic topic);
+
+// Monotonically increasing, never 0
+uint32_t bus_next_request_id();
+
+//
+void bus_get_stats(BusTopic topic, BusTopicStats* pStats);
+
+// Logs overflow counts when they've changed since the last call
+void bus_log_overflows();
+
+// Logs what has been published on every lane and how close each came to full
+void bus_log_stats();
+
+#endif //__MESSAGE_BUS__H__
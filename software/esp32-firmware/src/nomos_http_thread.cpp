@@ -16,6 +16,7 @@
 #include "esp_event_loop.h"
 #include "esp_task_wdt.h"
 #include "esp_log.h"
+#include <esp_timer.h>
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -25,13 +26,13 @@
 
 #include "esp_tls.h"
 
-#define ARDUINOJSON_EMBEDDED_MODE 1
-#include <ArduinoJson.h>
-
 #include "utils.h"
 
+#include "https_client.h"
 #include "nomos_http_thread.h"
+#include "nomos_json.h"
 #include "main_thread.h"
+#include "message_bus.h"
 
 
 #define TAG "NOMOS"
@@ -39,8 +40,6 @@
 
 TaskHandle_t NomosHttpTaskHandle = NULL;
 
-char nomosHttpRequestBody[64] = {};
-
 
 #include "nomos_cert.h"
 #include "nomos_api_key.h"
@@ -53,8 +52,9 @@ char nomosHttpRequestBody[64] = {};
 #define WEB_URL_CHECK_PIN "https://membership.vanhack.ca/services/web/AuthService1.svc/CheckPin"
 #define WEB_URL_USER "https://membership.vanhack.ca/services/web/UserService1.svc/GetUser"
 
-static const char* REQUEST_VALIDATE = "POST " WEB_URL_VALIDATE " HTTP/1.0\r\n"
+static const char* REQUEST_VALIDATE = "POST " WEB_URL_VALIDATE " HTTP/1.1\r\n"
                                       "Host: " WEB_SERVER "\r\n"
+                                      "Connection: keep-alive\r\n"
                                       "X-Api-Key: " NOMOS_API_KEY "\r\n"
                                       "User-Agent: esp-idf/1.0 esp32\r\n"
                                       "Content-Type: text/json\r\n"
@@ -62,8 +62,9 @@ static const char* REQUEST_VALIDATE = "POST " WEB_URL_VALIDATE " HTTP/1.0\r\n"
                                       "\r\n"
                                       "%s";
 
-static const char* REQUEST_CHECK_RFID = "POST " WEB_URL_CHECK_RFID " HTTP/1.0\r\n"
+static const char* REQUEST_CHECK_RFID = "POST " WEB_URL_CHECK_RFID " HTTP/1.1\r\n"
                                         "Host: " WEB_SERVER "\r\n"
+                                        "Connection: keep-alive\r\n"
                                         "X-Api-Key: " NOMOS_API_KEY "\r\n"
                                         "User-Agent: esp-idf/1.0 esp32\r\n"
                                         "Content-Type: text/json\r\n"
@@ -71,8 +72,9 @@ static const char* REQUEST_CHECK_RFID = "POST " WEB_URL_CHECK_RFID " HTTP/1.0\r\
                                         "\r\n"
                                         "%s";
 
-static const char* REQUEST_CHECK_PIN = "POST " WEB_URL_CHECK_PIN " HTTP/1.0\r\n"
+static const char* REQUEST_CHECK_PIN = "POST " WEB_URL_CHECK_PIN " HTTP/1.1\r\n"
                                        "Host: " WEB_SERVER "\r\n"
+                                       "Connection: keep-alive\r\n"
                                        "X-Api-Key: " NOMOS_API_KEY "\r\n"
                                        "User-Agent: esp-idf/1.0 esp32\r\n"
                                        "Content-Type: text/json\r\n"
@@ -90,149 +92,64 @@ static const char* REQUEST_CHECK_PIN = "POST " WEB_URL_CHECK_PIN " HTTP/1.0\r\n"
 //     "\r\n"
 //     "%s";
 
-static char                       requestBuff[512];
-static char                       readBuffer[4 * 1024];
-static StaticJsonBuffer<8 * 1024> jsonBuffer; // NOTE: 4*1024 would sometimes not be enough, and the parsing would fail. Sometimes...
-
-static bool send_request(struct esp_tls* tls, const char* header, const char* body) {
-    sprintf(requestBuff, header, (body == NULL) ? 0 : strlen(body), (body == NULL) ? "" : body);
-    assert(strlen(requestBuff) < ARRAY_COUNT(requestBuff));
-
-    size_t written_bytes = 0;
-    do {
-        int ret = esp_tls_conn_write(tls,
-                                     requestBuff + written_bytes,
-                                     strlen(requestBuff) - written_bytes);
-        if (ret > 0) {
-            written_bytes += ret;
-        } else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-            ESP_LOGE(TAG, "esp_tls_conn_write  returned 0x%x", ret);
-            return false;
-        }
-    } while (written_bytes < strlen(requestBuff));
-
-    return true;
-}
-
-static bool read_response(struct esp_tls* tls, NomosHttpResponseType responseType, NomosHttpResponseResult* pResult) {
-    bzero(readBuffer, ARRAY_COUNT(readBuffer));
+static HttpsClient        httpsClient;
+static char               requestBuff[512];
+static NomosJsonExtractor jsonExtractor;
 
-    int ret;
-    int len = 0;
+// Requests with a lower ID than this are cancelled. Indexed by NomosHttpNotification, only written by the main task.
+static volatile uint32_t cancelledBelow[NOMOS_HTTP_NOTIFICATION_COUNT] = {};
 
-    do {
-        int maxLen = (ARRAY_COUNT(readBuffer) - len) - 1;
-        ret        = esp_tls_conn_read(tls, (char*)readBuffer + len, maxLen);
-
-        if (ret == MBEDTLS_ERR_SSL_WANT_WRITE || ret == MBEDTLS_ERR_SSL_WANT_READ)
-            continue;
-
-        if (ret < 0) {
-            ESP_LOGE(TAG, "esp_tls_conn_read  returned -0x%x", -ret);
-            return false;
-        }
+// The newest request of each kind and its body, so asking again for the same card or PIN joins it.
+// Indexed by NomosHttpNotification, only touched by the main task.
+static uint32_t latestRequestId[NOMOS_HTTP_NOTIFICATION_COUNT]                                 = {};
+static char     latestRequestBody[NOMOS_HTTP_NOTIFICATION_COUNT][NOMOS_HTTP_REQUEST_BODY_SIZE] = {};
 
-        len += ret;
-    } while (ret != 0);
+// The last request of each kind the task finished, set before its reply is published. Only written by the Nomos task.
+static volatile uint32_t completedRequestId[NOMOS_HTTP_NOTIFICATION_COUNT] = {};
 
-    assert(len < ARRAY_COUNT(readBuffer));
-    readBuffer[len] = '\0';
+// How long the last request took to check its parsed result, once the body had been read
+static int64_t lastParseUs = 0;
 
-    char* statusEnd       = strchr(readBuffer, '\r');
-    bool  successResponse = strncmp(readBuffer, "HTTP/1.1 200 OK", statusEnd - readBuffer) == 0;
-    if (!successResponse) {
-        *statusEnd = '\0';
-        ESP_LOGE(TAG, "Status code not 200 OK.");
+static bool is_request_cancelled(void* pContext) {
+    const BusMessage& request = *(const BusMessage*)pContext;
+    if (request.nomos.httpNotification >= NOMOS_HTTP_NOTIFICATION_COUNT) {
         return false;
     }
-
-    const char* headerTerminator = "\r\n\r\n";
-    char*       pBodyStart       = strstr(readBuffer, headerTerminator) + strlen(headerTerminator);
-
-    // int bodyLen = strlen(pBodyStart);
-    // ESP_LOGI(TAG, "Body length: %d bytes", bodyLen);
-    // printf("Raw body: @@@@");
-    // // Print response directly to stdout (don't require a large printf buffer)
-    // for (int i = 0; i < bodyLen; i++) {
-    //     putchar(pBodyStart[i]);
-    // }
-    // printf("@@@@\n\n\n");
-
-    if (responseType == NOMOS_RT_JSON) {
-        JsonObject& root = jsonBuffer.parseObject(pBodyStart);
-        if (root.success()) {
-            // https://arduinojson.org/v5/doc/decoding/
-            // https://arduinojson.org/v5/api/jsonobject/
-            // https://arduinojson.org/v5/api/jsonvariant/
-            // https://arduinojson.org/v5/api/jsonarray/
-            // https://arduinojson.org/v5/example/http-client/
-
-            if (root.containsKey("userId") && root.containsKey("username") &&
-                root.containsKey("valid") && root.containsKey("privileges")) {
-                pResult->userId     = root["userId"].as<uint32_t>();
-                pResult->bValidUser = root["valid"].as<bool>();
-
-                const JsonArray& privileges = root["privileges"].as<const JsonArray&>();
-                if (privileges != JsonArray::invalid()) {
-                    for (auto privilege : privileges) {
-                        if (strcmp(privilege["code"].as<const char*>(), "door") == 0) {
-                            if (privilege["enabled"].as<bool>() == true) {
-                                pResult->bHasDoorAccess = true;
-                            }
-                        } else if (strcmp(privilege["code"].as<const char*>(), "vetted") == 0) {
-                            if (privilege["enabled"].as<bool>() == true) {
-                                pResult->bHasBeenVetted = true;
-                            }
-                        }
-                    }
-                }
-
-                // const char *userName = root["username"];
-                // ESP_LOGI(TAG, "User %s %s door access and is %s.",
-                //               (userName == NULL) ? "(unknown)" : userName,
-                //               (hasDoorAccess) ? "has" : "does not have",
-                //               (isVetted) ? "vetted" : "not vetted");
-            } else {
-                ESP_LOGE(TAG, "JSON data missing expected fields.");
-
-                return false;
-            }
-        } else {
-            ESP_LOGE(TAG, "Unknown data format (not JSON).");
-
-            return false;
-        }
-    } else if (responseType == NOMOS_RT_BOOLEAN) {
-        bool bValue = strncmp(pBodyStart, "true", 4) == 0;
-
-        pResult->bValue = bValue;
-    }
-
-    return true;
+    return request.requestId < cancelledBelow[request.nomos.httpNotification];
 }
 
-static bool https_request(esp_tls_cfg_t* pCfg, NomosHttpResponseType responseType, const char* web_url, const char* header, const char* body, NomosHttpResponseResult* pResult) {
+// pbAnswered is set once Nomos has replied 200 OK, so a body that doesn't parse can be told apart from no reply at all
+static bool https_request(NomosHttpResponseType responseType, const char* web_url, const char* header, const char* body, NomosHttpResponseResult* pResult, bool* pbAnswered) {
     bzero(pResult, sizeof(NomosHttpResponseResult));
+    lastParseUs = 0;
+    *pbAnswered = false;
+
+    sprintf(requestBuff, header, (body == NULL) ? 0 : strlen(body), (body == NULL) ? "" : body);
+    assert(strlen(requestBuff) < ARRAY_COUNT(requestBuff));
 
-    struct esp_tls* tls = esp_tls_conn_http_new(web_url, pCfg);
-    if (tls == NULL) {
-        ESP_LOGE(TAG, "Connection failed.");
-        esp_tls_conn_delete(tls);
+    // The body is parsed as it arrives rather than buffered
+    nomos_json_init(&jsonExtractor, pResult);
+
+    HttpsResponse response;
+    if (!https_client_request(&httpsClient, web_url, requestBuff, &response, &nomos_json_feed, &jsonExtractor)) {
+        ESP_LOGE(TAG, "Request failed.");
         return false;
     }
 
-    if (!send_request(tls, header, body)) {
-        ESP_LOGE(TAG, "Request send failed.");
-        esp_tls_conn_delete(tls);
+    if (response.statusCode != 200) {
+        ESP_LOGE(TAG, "Status code %d not 200 OK.", response.statusCode);
         return false;
     }
-    if (!read_response(tls, responseType, pResult)) {
+    *pbAnswered = true;
+
+    int64_t parseStart = esp_timer_get_time();
+    bool    bParsed    = nomos_json_finish(&jsonExtractor, responseType);
+    lastParseUs        = esp_timer_get_time() - parseStart;
+    if (!bParsed) {
         ESP_LOGE(TAG, "Request read failed.");
-        esp_tls_conn_delete(tls);
         return false;
     }
 
-    esp_tls_conn_delete(tls);
     return true;
 }
 
@@ -248,30 +165,65 @@ static void nomos_https_task(void* pvParameters) {
         .clientkey_password     = NULL,
         .clientkey_password_len = 0,
         .non_block              = false,
-        .timeout_ms             = 0,
+        .timeout_ms             = NOMOS_HTTP_TIMEOUT_MS,
         .use_global_ca_store    = false
     };
+    https_client_init(&httpsClient, TAG, cfg);
+
+    BusMessage request;
+    https_client_set_cancel(&httpsClient, &is_request_cancelled, &request);
 
     while (1) {
-        NomosHttpNotification httpNotification = NOMOS_HTTP_NOTIFICATION_None;
-        if (xTaskNotifyWait(0, 0, (uint32_t*)&httpNotification, 1000 / portTICK_PERIOD_MS) == pdPASS) {
-            MainNotificationArgs mainNotificationArgs;
-            bzero(&mainNotificationArgs, sizeof(MainNotificationArgs));
+        if (bus_receive(BUS_TOPIC_Nomos, &request, 1000 / portTICK_PERIOD_MS)) {
+            NomosHttpNotification httpNotification = request.nomos.httpNotification;
+            const char*           body             = request.nomos.body;
+
+            if (is_request_cancelled(&request)) {
+                ESP_LOGI(TAG, "Skipping cancelled request %u.", request.requestId);
+                continue;
+            }
+
+            int64_t startTime = esp_timer_get_time();
+            https_client_set_deadline(&httpsClient, request.nomos.deadline);
+
+            BusMessage reply;
+            bzero(&reply, sizeof(BusMessage));
+            reply.requestId = request.requestId;
+
+            MainNotificationArgs& mainNotificationArgs                   = reply.main;
             mainNotificationArgs.notification                            = MAIN_NOTIFICATION_NomosHttpRequestResultReady;
             mainNotificationArgs.NomosHttpRequestResult.httpNotification = httpNotification;
+            strncpy(mainNotificationArgs.NomosHttpRequestResult.body, body, sizeof(mainNotificationArgs.NomosHttpRequestResult.body) - 1);
 
             if (httpNotification == NOMOS_HTTP_NOTIFICATION_RequestValidate) {
-                mainNotificationArgs.NomosHttpRequestResult.success = https_request(&cfg, NOMOS_RT_BOOLEAN, WEB_URL_VALIDATE, REQUEST_VALIDATE, nomosHttpRequestBody, &mainNotificationArgs.NomosHttpRequestResult.result);
+                mainNotificationArgs.NomosHttpRequestResult.success = https_request(NOMOS_RT_BOOLEAN, WEB_URL_VALIDATE, REQUEST_VALIDATE, body, &mainNotificationArgs.NomosHttpRequestResult.result, &mainNotificationArgs.NomosHttpRequestResult.bAnswered);
             } else if (httpNotification == NOMOS_HTTP_NOTIFICATION_RequestRfid) {
-                mainNotificationArgs.NomosHttpRequestResult.success = https_request(&cfg, NOMOS_RT_JSON, WEB_URL_CHECK_RFID, REQUEST_CHECK_RFID, nomosHttpRequestBody, &mainNotificationArgs.NomosHttpRequestResult.result);
+                mainNotificationArgs.NomosHttpRequestResult.success = https_request(NOMOS_RT_JSON, WEB_URL_CHECK_RFID, REQUEST_CHECK_RFID, body, &mainNotificationArgs.NomosHttpRequestResult.result, &mainNotificationArgs.NomosHttpRequestResult.bAnswered);
             } else if (httpNotification == NOMOS_HTTP_NOTIFICATION_RequestPin) {
-                mainNotificationArgs.NomosHttpRequestResult.success = https_request(&cfg, NOMOS_RT_JSON, WEB_URL_CHECK_PIN, REQUEST_CHECK_PIN, nomosHttpRequestBody, &mainNotificationArgs.NomosHttpRequestResult.result);
+                mainNotificationArgs.NomosHttpRequestResult.success = https_request(NOMOS_RT_JSON, WEB_URL_CHECK_PIN, REQUEST_CHECK_PIN, body, &mainNotificationArgs.NomosHttpRequestResult.result, &mainNotificationArgs.NomosHttpRequestResult.bAnswered);
             } else {
                 mainNotificationArgs.NomosHttpRequestResult.success = false;
                 ESP_LOGE(TAG, "Unknown NomosHttpNotification: %d", (int)httpNotification);
             }
 
-            if (xQueueSendToBack(MAIN_queueHandle, &mainNotificationArgs, 100 / portTICK_PERIOD_MS) != pdTRUE) {
+            if (httpNotification < NOMOS_HTTP_NOTIFICATION_COUNT) {
+                completedRequestId[httpNotification] = request.requestId;
+            }
+
+            if (is_request_cancelled(&request)) {
+                // Nobody is waiting for this any more
+                continue;
+            }
+
+            NomosHttpStageTimes& stageTimes = mainNotificationArgs.NomosHttpRequestResult.stageTimes;
+            stageTimes.queueUs              = (uint32_t)(startTime - request.nomos.queuedTime);
+            stageTimes.connectUs            = (uint32_t)httpsClient.lastTimings.connectUs;
+            stageTimes.responseUs           = (uint32_t)httpsClient.lastTimings.responseUs;
+            stageTimes.bodyUs               = (uint32_t)httpsClient.lastTimings.bodyUs;
+            stageTimes.parseUs              = (uint32_t)lastParseUs;
+
+            // Replies go ahead of new input, so a decision isn't held up behind more taps
+            if (!bus_publish(BUS_TOPIC_Main, reply, BUS_PRIORITY_High, 100 / portTICK_PERIOD_MS)) {
                 // Erk. Did not add to the queue. Oh well? User can just try again when they realize...
             }
         }
@@ -282,3 +234,45 @@ static void nomos_https_task(void* pvParameters) {
 void nomos_http_thread_create() {
     xTaskCreate(&nomos_https_task, "nomos_https_task", 6 * 1024, NULL, 5, &NomosHttpTaskHandle);
 }
+
+//
+uint32_t nomos_http_request(NomosHttpNotification httpNotification, const char* body) {
+    // A card tapped again while its request is still out waits for that one, rather than throwing away
+    // a half done TLS handshake and starting over
+    uint32_t latestId = latestRequestId[httpNotification];
+    if ((latestId != 0) && (latestId > completedRequestId[httpNotification]) && (latestId >= cancelledBelow[httpNotification]) &&
+        (strncmp(latestRequestBody[httpNotification], body, NOMOS_HTTP_REQUEST_BODY_SIZE - 1) == 0)) {
+        return latestId;
+    }
+
+    BusMessage request;
+    bzero(&request, sizeof(BusMessage));
+    request.requestId              = bus_next_request_id();
+    request.nomos.httpNotification = httpNotification;
+    request.nomos.queuedTime       = esp_timer_get_time();
+    request.nomos.deadline         = request.nomos.queuedTime + (NOMOS_HTTP_TIMEOUT_MS * 1000LL);
+    strncpy(request.nomos.body, body, sizeof(request.nomos.body) - 1);
+
+    // A member waiting at the door goes ahead of background card validation
+    BusPriority priority = (httpNotification == NOMOS_HTTP_NOTIFICATION_RequestValidate) ? BUS_PRIORITY_Normal : BUS_PRIORITY_High;
+    if (!bus_publish(BUS_TOPIC_Nomos, request, priority, 0)) {
+        // Nothing replaced the earlier request, so leave it running
+        return 0;
+    }
+
+    // Frees the task from a request for a different card or PIN, whose reply would be ignored
+    if (request.requestId > cancelledBelow[httpNotification]) {
+        cancelledBelow[httpNotification] = request.requestId;
+    }
+
+    latestRequestId[httpNotification] = request.requestId;
+    strncpy(latestRequestBody[httpNotification], body, NOMOS_HTTP_REQUEST_BODY_SIZE - 1);
+
+    return request.requestId;
+}
+
+void nomos_http_cancel(NomosHttpNotification httpNotification, uint32_t requestId) {
+    if ((requestId != 0) && (requestId >= cancelledBelow[httpNotification])) {
+        cancelledBelow[httpNotification] = requestId + 1;
+    }
+}
@@ -15,6 +15,11 @@ enum NomosHttpResponseType {
     NOMOS_RT_BOOLEAN
 };
 
+// Hard limit on one Nomos request, connect included. Override via build_flags.
+#ifndef NOMOS_HTTP_TIMEOUT_MS
+#define NOMOS_HTTP_TIMEOUT_MS (5 * 1000)
+#endif
+
 struct NomosHttpResponseResult {
     // NOMOS_RT_JSON
     uint32_t userId;
@@ -26,11 +31,37 @@ struct NomosHttpResponseResult {
     bool bValue;
 };
 
+#define NOMOS_HTTP_REQUEST_BODY_SIZE 64
+
+// Each request carries its own body, so a new one can't change a request already queued
+struct NomosHttpRequest {
+    NomosHttpNotification httpNotification;
+    char                  body[NOMOS_HTTP_REQUEST_BODY_SIZE];
+    int64_t               queuedTime;
+    int64_t               deadline; // Given up on after this esp_timer_get_time()
+};
+
+// Where a request's time went, in microseconds. Returned with each reply.
+struct NomosHttpStageTimes {
+    uint32_t queueUs;
+    uint32_t connectUs; // 0 on a reused connection
+    uint32_t responseUs;
+    uint32_t bodyUs;
+    uint32_t parseUs;
+};
+
 //
 extern TaskHandle_t NomosHttpTaskHandle;
-extern char         nomosHttpRequestBody[64];
 
 //
 void nomos_http_thread_create();
 
+// Returns the request ID its reply will carry, or 0 if the request queue is full. Asking again with
+// the same body while that request is still queued or in flight returns its ID, and the one reply
+// answers both. Otherwise any earlier request of the same kind is cancelled, as its reply would be ignored.
+uint32_t nomos_http_request(NomosHttpNotification httpNotification, const char* body);
+
+// Abandons the request if it's still queued or in flight. It then gets no reply.
+void nomos_http_cancel(NomosHttpNotification httpNotification, uint32_t requestId);
+
 #endif //__NOMOS_HTTP_THREAD__H__
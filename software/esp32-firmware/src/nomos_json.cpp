@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <esp_types.h>
+
+#include "esp_system.h"
+#include "esp_log.h"
+
+#include "utils.h"
+
+#include "nomos_json.h"
+
+
+#define TAG "NOMOS_JSON"
+
+
+enum LexState {
+    LEX_Structure,
+    LEX_String,
+    LEX_StringEscape,
+    LEX_Scalar,
+};
+
+enum Key {
+    KEY_Other,
+    // Root object
+    KEY_UserId,
+    KEY_Username,
+    KEY_Valid,
+    KEY_Privileges,
+    // Privilege objects
+    KEY_Code,
+    KEY_Enabled,
+};
+
+enum PrivilegeCode {
+    PRIVILEGE_Other,
+    PRIVILEGE_Door,
+    PRIVILEGE_Vetted,
+};
+
+enum SeenFields {
+    SEEN_UserId     = (1 << 0),
+    SEEN_Username   = (1 << 1),
+    SEEN_Valid      = (1 << 2),
+    SEEN_Privileges = (1 << 3),
+    SEEN_Value      = (1 << 4),
+    SEEN_JsonFields = (SEEN_UserId | SEEN_Username | SEEN_Valid | SEEN_Privileges),
+};
+
+struct KeyName {
+    const char* name;
+    Key         key;
+};
+
+static const KeyName rootKeys[] = {
+    { "userId", KEY_UserId },
+    { "username", KEY_Username },
+    { "valid", KEY_Valid },
+    { "privileges", KEY_Privileges },
+};
+
+static const KeyName privilegeKeys[] = {
+    { "code", KEY_Code },
+    { "enabled", KEY_Enabled },
+};
+
+
+static uint8_t lookup_key(const char* token, const KeyName* pKeys, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(token, pKeys[i].name) == 0) {
+            return pKeys[i].key;
+        }
+    }
+    return KEY_Other;
+}
+
+static bool is_array(const NomosJsonExtractor* pExtractor, uint8_t depth) {
+    return (depth > 0) && ((pExtractor->arrayDepths >> (depth - 1)) & 1);
+}
+
+// True while inside the "privileges" array of the root object
+static bool in_privileges(const NomosJsonExtractor* pExtractor) {
+    return (pExtractor->depth >= 2) && (pExtractor->rootKey == KEY_Privileges) &&
+           !is_array(pExtractor, 1) && is_array(pExtractor, 2);
+}
+
+static bool token_is_true(const NomosJsonExtractor* pExtractor) {
+    return strcmp(pExtractor->token, "true") == 0;
+}
+
+static void token_append(NomosJsonExtractor* pExtractor, char c) {
+    if (pExtractor->tokenLength < NOMOS_JSON_TOKEN_LENGTH) {
+        pExtractor->token[pExtractor->tokenLength++] = c;
+    }
+}
+
+static void process_value(NomosJsonExtractor* pExtractor, bool bString) {
+    NomosHttpResponseResult* pResult = pExtractor->pResult;
+
+    if (pExtractor->depth == 0) {
+        // Bare true/false reply
+        pResult->bValue = !bString && token_is_true(pExtractor);
+        pExtractor->seenFields |= SEEN_Value;
+    } else if ((pExtractor->depth == 1) && !is_array(pExtractor, 1)) {
+        switch (pExtractor->rootKey) {
+            case KEY_UserId:
+                // A quoted ID isn't the reply we know, so it leaves the field missing rather than reading as user 0
+                if (!bString) {
+                    pResult->userId = strtoul(pExtractor->token, NULL, 10);
+                    pExtractor->seenFields |= SEEN_UserId;
+                }
+                break;
+            case KEY_Username:
+                pExtractor->seenFields |= SEEN_Username;
+                break;
+            case KEY_Valid:
+                pResult->bValidUser = !bString && token_is_true(pExtractor);
+                pExtractor->seenFields |= SEEN_Valid;
+                break;
+            default:
+                break;
+        }
+    } else if ((pExtractor->depth == 3) && in_privileges(pExtractor) && !is_array(pExtractor, 3)) {
+        if (pExtractor->privilegeKey == KEY_Code) {
+            if (bString && (strcmp(pExtractor->token, "door") == 0)) {
+                pExtractor->privilegeCode = PRIVILEGE_Door;
+            } else if (bString && (strcmp(pExtractor->token, "vetted") == 0)) {
+                pExtractor->privilegeCode = PRIVILEGE_Vetted;
+            }
+        } else if (pExtractor->privilegeKey == KEY_Enabled) {
+            pExtractor->bPrivilegeEnabled = !bString && token_is_true(pExtractor);
+        }
+    }
+}
+
+static void end_token(NomosJsonExtractor* pExtractor, bool bString) {
+    pExtractor->token[pExtractor->tokenLength] = '\0';
+    pExtractor->lexState                       = LEX_Structure;
+
+    if (bString && pExtractor->bExpectKey) {
+        if (pExtractor->depth == 1) {
+            pExtractor->rootKey = lookup_key(pExtractor->token, rootKeys, ARRAY_COUNT(rootKeys));
+        } else if ((pExtractor->depth == 3) && in_privileges(pExtractor)) {
+            pExtractor->privilegeKey = lookup_key(pExtractor->token, privilegeKeys, ARRAY_COUNT(privilegeKeys));
+        }
+        pExtractor->bExpectKey = false;
+    } else {
+        process_value(pExtractor, bString);
+    }
+
+    pExtractor->tokenLength = 0;
+}
+
+static void open_container(NomosJsonExtractor* pExtractor, bool bArray) {
+    if (pExtractor->depth >= NOMOS_JSON_MAX_DEPTH) {
+        pExtractor->bError = true;
+        return;
+    }
+
+    if ((pExtractor->depth == 1) && (pExtractor->rootKey == KEY_Privileges) && bArray) {
+        pExtractor->seenFields |= SEEN_Privileges;
+    } else if ((pExtractor->depth == 2) && in_privileges(pExtractor) && !bArray) {
+        // Start of a privilege object
+        pExtractor->privilegeKey      = KEY_Other;
+        pExtractor->privilegeCode     = PRIVILEGE_Other;
+        pExtractor->bPrivilegeEnabled = false;
+    }
+
+    if (bArray) {
+        pExtractor->arrayDepths |= (1u << pExtractor->depth);
+    } else {
+        pExtractor->arrayDepths &= ~(1u << pExtractor->depth);
+    }
+    pExtractor->depth++;
+    pExtractor->bExpectKey = !bArray;
+}
+
+static void close_container(NomosJsonExtractor* pExtractor, bool bArray) {
+    if ((pExtractor->depth == 0) || (is_array(pExtractor, pExtractor->depth) != bArray)) {
+        pExtractor->bError = true;
+        return;
+    }
+
+    if ((pExtractor->depth == 3) && in_privileges(pExtractor) && !bArray && pExtractor->bPrivilegeEnabled) {
+        if (pExtractor->privilegeCode == PRIVILEGE_Door) {
+            pExtractor->pResult->bHasDoorAccess = true;
+        } else if (pExtractor->privilegeCode == PRIVILEGE_Vetted) {
+            pExtractor->pResult->bHasBeenVetted = true;
+        }
+    }
+
+    pExtractor->depth--;
+    pExtractor->bExpectKey = false;
+}
+
+static void process_structure(NomosJsonExtractor* pExtractor, char c) {
+    switch (c) {
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            break;
+        case '"':
+            pExtractor->lexState = LEX_String;
+            break;
+        case '{':
+            open_container(pExtractor, false);
+            break;
+        case '[':
+            open_container(pExtractor, true);
+            break;
+        case '}':
+            close_container(pExtractor, false);
+            break;
+        case ']':
+            close_container(pExtractor, true);
+            break;
+        case ':':
+            if ((pExtractor->depth == 0) || is_array(pExtractor, pExtractor->depth)) {
+                pExtractor->bError = true;
+            }
+            break;
+        case ',':
+            pExtractor->bExpectKey = !is_array(pExtractor, pExtractor->depth);
+            break;
+        default:
+            // Number, true, false or null
+            pExtractor->lexState = LEX_Scalar;
+            token_append(pExtractor, c);
+            break;
+    }
+}
+
+//
+void nomos_json_init(NomosJsonExtractor* pExtractor, NomosHttpResponseResult* pResult) {
+    bzero(pExtractor, sizeof(NomosJsonExtractor));
+    pExtractor->pResult  = pResult;
+    pExtractor->lexState = LEX_Structure;
+}
+
+bool nomos_json_feed(const char* data, size_t len, void* pContext) {
+    NomosJsonExtractor* pExtractor = (NomosJsonExtractor*)pContext;
+
+    for (size_t i = 0; (i < len) && !pExtractor->bError; i++) {
+        char c = data[i];
+
+        switch (pExtractor->lexState) {
+            case LEX_String:
+                if (c == '\\') {
+                    pExtractor->lexState = LEX_StringEscape;
+                } else if (c == '"') {
+                    end_token(pExtractor, true);
+                } else {
+                    token_append(pExtractor, c);
+                }
+                break;
+            case LEX_StringEscape:
+                // Escapes never appear in the values we match on, so keep the raw character
+                token_append(pExtractor, c);
+                pExtractor->lexState = LEX_String;
+                break;
+            case LEX_Scalar:
+                if ((c == ',') || (c == '}') || (c == ']') || (c == ':') ||
+                    (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n')) {
+                    end_token(pExtractor, false);
+                    process_structure(pExtractor, c);
+                } else {
+                    token_append(pExtractor, c);
+                }
+                break;
+            default:
+                process_structure(pExtractor, c);
+                break;
+        }
+    }
+
+    return !pExtractor->bError;
+}
+
+bool nomos_json_finish(NomosJsonExtractor* pExtractor, NomosHttpResponseType responseType) {
+    if (pExtractor->lexState == LEX_Scalar) {
+        // A bare scalar body has no delimiter after it
+        end_token(pExtractor, false);
+    }
+
+    if (pExtractor->bError || (pExtractor->depth != 0) || (pExtractor->lexState != LEX_Structure)) {
+        ESP_LOGE(TAG, "Malformed JSON.");
+        return false;
+    }
+
+    if (responseType == NOMOS_RT_JSON) {
+        if ((pExtractor->seenFields & SEEN_JsonFields) != SEEN_JsonFields) {
+            ESP_LOGE(TAG, "JSON data missing expected fields.");
+            return false;
+        }
+    } else if (responseType == NOMOS_RT_BOOLEAN) {
+        if ((pExtractor->seenFields & SEEN_Value) == 0) {
+            ESP_LOGE(TAG, "Expected a boolean.");
+            return false;
+        }
+    }
+
+    return true;
+}
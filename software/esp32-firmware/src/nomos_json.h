@@ -0,0 +1,45 @@
+#ifndef __NOMOS_JSON__H__
+#define __NOMOS_JSON__H__
+
+#include "nomos_http_thread.h"
+
+
+// Longest string value that is kept for matching (privilege codes); longer ones are truncated
+#define NOMOS_JSON_TOKEN_LENGTH 16
+// Deepest nesting supported. Nomos replies only go 3 deep.
+#define NOMOS_JSON_MAX_DEPTH 32
+
+// Incremental extractor for Nomos replies. Consumes the body a piece at a time as it comes off
+// the TLS connection and fills NomosHttpResponseResult directly, so memory use doesn't depend on
+// the size of the reply. Only userId, username, valid and the door/vetted privileges are looked
+// at - everything else is skipped over.
+struct NomosJsonExtractor {
+    NomosHttpResponseResult* pResult;
+
+    uint8_t  lexState;
+    uint8_t  depth;
+    uint32_t arrayDepths; // Bit (depth - 1) set if the container at that depth is an array
+    bool     bExpectKey;
+    bool     bError;
+
+    uint8_t rootKey;      // Current key of the root object
+    uint8_t privilegeKey; // Current key of the privilege object being read
+    uint8_t privilegeCode;
+    bool    bPrivilegeEnabled;
+
+    uint8_t seenFields;
+
+    char    token[NOMOS_JSON_TOKEN_LENGTH + 1];
+    uint8_t tokenLength;
+};
+
+//
+void nomos_json_init(NomosJsonExtractor* pExtractor, NomosHttpResponseResult* pResult);
+
+// HttpsBodyCallback compatible. Returns false once the body is known to be malformed.
+bool nomos_json_feed(const char* data, size_t len, void* pContext);
+
+// Returns true if the whole body was well formed and had the fields needed for responseType
+bool nomos_json_finish(NomosJsonExtractor* pExtractor, NomosHttpResponseType responseType);
+
+#endif //__NOMOS_JSON__H__
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include <esp_types.h>
+
+#include "esp_system.h"
+#include "esp_log.h"
+#include <esp_timer.h>
+
+#include "utils.h"
+
+#include "rfid_cache.h"
+
+
+#define TAG "RFID_CACHE"
+
+
+struct RfidCacheEntry {
+    uint8_t                 id[RFID_CACHE_ID_LENGTH];
+    bool                    bUsed;
+    int64_t                 storeTime;
+    NomosHttpResponseResult result;
+};
+
+static RfidCacheEntry rfidCacheEntries[32] = {};
+
+
+static RfidCacheEntry* find_entry(const uint8_t* id) {
+    for (int i = 0; i < (int)ARRAY_COUNT(rfidCacheEntries); i++) {
+        RfidCacheEntry& entry = rfidCacheEntries[i];
+        if (entry.bUsed && (memcmp(entry.id, id, RFID_CACHE_ID_LENGTH) == 0)) {
+            return &entry;
+        }
+    }
+
+    return NULL;
+}
+
+//
+void rfid_cache_init() {
+    bzero(rfidCacheEntries, sizeof(rfidCacheEntries));
+}
+
+bool rfid_cache_lookup(const uint8_t* id, NomosHttpResponseResult* pResult) {
+    RfidCacheEntry* pEntry = find_entry(id);
+    if (pEntry == NULL) {
+        return false;
+    }
+
+    int64_t age_uS = esp_timer_get_time() - pEntry->storeTime;
+    if (age_uS > RFID_CACHE_TTL_US) {
+        pEntry->bUsed = false;
+        return false;
+    }
+
+    *pResult = pEntry->result;
+    return true;
+}
+
+void rfid_cache_store(const uint8_t* id, const NomosHttpResponseResult& result) {
+    RfidCacheEntry* pEntry = find_entry(id);
+    if (pEntry == NULL) {
+        // Take a free slot, or evict whichever card was refreshed longest ago
+        pEntry = &rfidCacheEntries[0];
+        for (int i = 0; i < (int)ARRAY_COUNT(rfidCacheEntries); i++) {
+            RfidCacheEntry& entry = rfidCacheEntries[i];
+            if (!entry.bUsed) {
+                pEntry = &entry;
+                break;
+            }
+            if (entry.storeTime < pEntry->storeTime) {
+                pEntry = &entry;
+            }
+        }
+
+        memcpy(pEntry->id, id, RFID_CACHE_ID_LENGTH);
+        pEntry->bUsed = true;
+    }
+
+    pEntry->storeTime = esp_timer_get_time();
+    pEntry->result    = result;
+}
+
+void rfid_cache_forget(const uint8_t* id) {
+    RfidCacheEntry* pEntry = find_entry(id);
+    if (pEntry != NULL) {
+        pEntry->bUsed = false;
+    }
+}
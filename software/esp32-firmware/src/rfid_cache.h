@@ -0,0 +1,29 @@
+#ifndef __RFID_CACHE__H__
+#define __RFID_CACHE__H__
+
+#include "nomos_http_thread.h"
+
+
+#define RFID_CACHE_ID_LENGTH 7
+
+// How long a Nomos reply for a card is trusted without being revalidated. Nomos answering with anything
+// but a usable result (e.g. a revoked member's reply missing the privilege fields) evicts the card at
+// once. Only no answer at all - timeouts, connection failures, non-200 statuses - leaves it cached.
+#define RFID_CACHE_TTL_US SECONDS_IN_US(60 * 60)
+
+
+// NOTE: The cache is only ever touched from the main thread, so it is not locked.
+
+//
+void rfid_cache_init();
+
+// Returns true and fills pResult if the card has a cached reply that hasn't expired
+bool rfid_cache_lookup(const uint8_t* id, NomosHttpResponseResult* pResult);
+
+// Insert or refresh the cached reply for a card
+void rfid_cache_store(const uint8_t* id, const NomosHttpResponseResult& result);
+
+// Drop the card's cached reply, if any
+void rfid_cache_forget(const uint8_t* id);
+
+#endif //__RFID_CACHE__H__
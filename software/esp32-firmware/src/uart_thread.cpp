@@ -17,24 +17,30 @@
 #include "esp_event_loop.h"
 #include "esp_task_wdt.h"
 #include "esp_log.h"
+#include <esp_timer.h>
 
 #include "driver/uart.h"
 #include "rom/uart.h"
 
 #include "utils.h"
 
+#include <DoorLink.h>
+
 #include "uart_thread.h"
 #include "main_thread.h"
+#include "message_bus.h"
+#include "access_metrics.h"
 
 
 #define TAG "UART"
 
 
-TaskHandle_t  UART_taskHandle  = NULL;
-QueueHandle_t UART_queueHandle = NULL;
+TaskHandle_t UART_taskHandle = NULL;
 
-static StaticQueue_t    UART_queueStructure;
-static UartNotification UART_queueStorage[8] = {};
+// Driver events from the STM32 UART, and a set so the task wakes on either these or the bus
+#define UART_EVENT_QUEUE_SIZE 16
+static QueueHandle_t    UART_eventQueueHandle = NULL;
+static QueueSetHandle_t UART_queueSetHandle   = NULL;
 
 
 #define UART_FLUSH() while (uart_rx_one_char(&ch) == ESP_OK)
@@ -48,113 +54,359 @@ static UartNotification UART_queueStorage[8] = {};
 #define STM32_UART_CTS (UART_PIN_NO_CHANGE)
 
 #define STM32_UART_BUFFER_SIZE 1024
-static char stm32UartBuffer[STM32_UART_BUFFER_SIZE] = {};
 
+// A partial frame with no more data for this long will never complete
+#define STM32_UART_IDLE_US (20 * 1000)
+static uint8_t stm32UartBuffer[DOORLINK_STREAM_SIZE] = {};
+
+
+// How each UartNotification goes out over the link. Indexed by UartNotification.
+struct UartCommand {
+    uint8_t opcode;
+    uint8_t sound;
+};
+
+static const UartCommand uartCommands[UART_NOTIFICATION_COUNT] = {
+    { DL_OP_Nop, 0 },                              // UART_NOTIFICATION_None
+    { DL_OP_PlaySound, DL_SOUND_BeepShortMedium }, // UART_NOTIFICATION_PlayBeepShortMedium
+    { DL_OP_PlaySound, DL_SOUND_BeepShortLow },    // UART_NOTIFICATION_PlayBeepShortLow
+    { DL_OP_PlaySound, DL_SOUND_BeepLongMedium },  // UART_NOTIFICATION_PlayBeepLongMedium
+    { DL_OP_PlaySound, DL_SOUND_BeepLongLow },     // UART_NOTIFICATION_PlayBeepLongLow
+    { DL_OP_PlaySound, DL_SOUND_BeepShortHigh },   // UART_NOTIFICATION_PlayBeepShortHigh
+    { DL_OP_PlaySound, DL_SOUND_BeepLongHigh },    // UART_NOTIFICATION_PlayBeepLongHigh
+    { DL_OP_PlaySound, DL_SOUND_Buzzer01 },        // UART_NOTIFICATION_PlayBuzzer01
+    { DL_OP_PlaySound, DL_SOUND_Buzzer02 },        // UART_NOTIFICATION_PlayBuzzer02
+    { DL_OP_PlaySound, DL_SOUND_Success },         // UART_NOTIFICATION_PlaySuccess
+    { DL_OP_PlaySound, DL_SOUND_Failure },         // UART_NOTIFICATION_PlayFailure
+    { DL_OP_PlaySound, DL_SOUND_Smb },             // UART_NOTIFICATION_PlaySmb
+    { DL_OP_LockDoor, 0 },                         // UART_NOTIFICATION_LockDoor
+    { DL_OP_UnlockDoor, 0 },                       // UART_NOTIFICATION_UnlockDoor
+};
+
+static DoorLinkStream stm32Stream;
+static uint8_t        txSeq = 0;
+static uint8_t        txFrame[DOORLINK_MAX_FRAME_SIZE];
+
+// Frames that were received fine but couldn't be passed on to the main thread
+static uint32_t droppedFrameCount = 0;
+// Error total as of the last time they were logged
+static uint32_t loggedErrorCount = 0;
+// When to give up on a partial frame left in the stream, or 0
+static int64_t partialFrameDeadline = 0;
+// Last door sensor state passed on to the main thread, or -1 until the STM32 first reports one
+static int doorSensorOpen = -1;
+
+// The latest lock/unlock, resent until the STM32 ACKs it. A newer door command replaces it.
+struct PendingDoorCommand {
+    bool    bPending;
+    uint8_t seq;
+    uint8_t opcode;
+    uint8_t retransmits;
+    int64_t firstSentTime;
+    int64_t sentTime;
+    size_t  size;
+    uint8_t frame[DOORLINK_MAX_FRAME_SIZE];
+};
+
+static PendingDoorCommand pendingDoorCommand = {};
+
+
+static void send_frame(uint8_t opcode, const uint8_t* pPayload, uint8_t length) {
+    uint8_t seq = txSeq++;
+
+    if (doorlink_requires_ack(opcode)) {
+        pendingDoorCommand.bPending      = true;
+        pendingDoorCommand.seq           = seq;
+        pendingDoorCommand.opcode        = opcode;
+        pendingDoorCommand.retransmits   = 0;
+        pendingDoorCommand.firstSentTime = esp_timer_get_time();
+        pendingDoorCommand.sentTime      = pendingDoorCommand.firstSentTime;
+        pendingDoorCommand.size          = doorlink_encode(pendingDoorCommand.frame, seq, opcode, pPayload, length);
+
+        uart_write_bytes(UART_NUM_1, (const char*)pendingDoorCommand.frame, pendingDoorCommand.size);
+    } else {
+        size_t size = doorlink_encode(txFrame, seq, opcode, pPayload, length);
+
+        uart_write_bytes(UART_NUM_1, (const char*)txFrame, size);
+    }
+}
 
-static void uart_task(void* pvParameters) {
-    ESP_LOGI(TAG, "UART task running...");
+static void retransmit_door_command() {
+    if (!pendingDoorCommand.bPending) {
+        return;
+    }
 
-    const char* UART_cmd_ready          = "ESP32_READY\n";
-    const char* UART_cmd_play_beep_01   = "PLAY_BEEP_01\n";
-    const char* UART_cmd_play_beep_02   = "PLAY_BEEP_02\n";
-    const char* UART_cmd_play_beep_03   = "PLAY_BEEP_03\n";
-    const char* UART_cmd_play_beep_04   = "PLAY_BEEP_04\n";
-    const char* UART_cmd_play_beep_05   = "PLAY_BEEP_05\n";
-    const char* UART_cmd_play_beep_06   = "PLAY_BEEP_06\n";
-    const char* UART_cmd_play_buzzer_01 = "PLAY_BUZZER_01\n";
-    const char* UART_cmd_play_buzzer_02 = "PLAY_BUZZER_02\n";
-    const char* UART_cmd_play_success   = "PLAY_SUCCESS\n";
-    const char* UART_cmd_play_failure   = "PLAY_FAILURE\n";
-    const char* UART_cmd_play_smb       = "PLAY_SMB\n";
+    int64_t now = esp_timer_get_time();
+    if ((now - pendingDoorCommand.sentTime) < (DOORLINK_RETRANSMIT_MS * 1000)) {
+        return;
+    }
 
-    const char* UART_cmd_lock_door   = "LOCK_DOOR\n";
-    const char* UART_cmd_unlock_door = "UNLOCK_DOOR\n";
+    if (pendingDoorCommand.retransmits >= DOORLINK_MAX_RETRANSMITS) {
+        ESP_LOGE(TAG, "STM32 never acknowledged door command %d!", (int)pendingDoorCommand.opcode);
 
-    const char* rfid_cmd_prefix = "RFID:";
-    const char* pin_cmd_prefix  = "PIN:";
+        pendingDoorCommand.bPending = false;
+        return;
+    }
 
-    uart_write_bytes(UART_NUM_1, (const char*)UART_cmd_ready, strlen(UART_cmd_ready));
+    pendingDoorCommand.retransmits++;
+    pendingDoorCommand.sentTime = now;
 
-    while (1) {
-        // Check for any waiting notifications
-        UartNotification notification;
-        while (xQueueReceive(UART_queueHandle, &notification, 0) == pdTRUE) {
-            const char* message = NULL;
-            if (notification == UART_NOTIFICATION_PlayBeepShortMedium) {
-                message = UART_cmd_play_beep_01;
-            } else if (notification == UART_NOTIFICATION_PlayBeepShortLow) {
-                message = UART_cmd_play_beep_02;
-            } else if (notification == UART_NOTIFICATION_PlayBeepLongMedium) {
-                message = UART_cmd_play_beep_03;
-            } else if (notification == UART_NOTIFICATION_PlayBeepLongLow) {
-                message = UART_cmd_play_beep_04;
-            } else if (notification == UART_NOTIFICATION_PlayBeepShortHigh) {
-                message = UART_cmd_play_beep_05;
-            } else if (notification == UART_NOTIFICATION_PlayBeepLongHigh) {
-                message = UART_cmd_play_beep_06;
-            } else if (notification == UART_NOTIFICATION_PlayBuzzer01) {
-                message = UART_cmd_play_buzzer_01;
-            } else if (notification == UART_NOTIFICATION_PlayBuzzer02) {
-                message = UART_cmd_play_buzzer_02;
-            } else if (notification == UART_NOTIFICATION_PlaySuccess) {
-                message = UART_cmd_play_success;
-            } else if (notification == UART_NOTIFICATION_PlayFailure) {
-                message = UART_cmd_play_failure;
-            } else if (notification == UART_NOTIFICATION_PlaySmb) {
-                message = UART_cmd_play_smb;
-            } else if (notification == UART_NOTIFICATION_LockDoor) {
-                message = UART_cmd_lock_door;
-            } else if (notification == UART_NOTIFICATION_UnlockDoor) {
-                message = UART_cmd_unlock_door;
-            }
+    uart_write_bytes(UART_NUM_1, (const char*)pendingDoorCommand.frame, pendingDoorCommand.size);
+}
+
+//
+static void on_ready_frame(const DoorLinkFrameView& view) {
+    ESP_LOGI(TAG, "STM32 ready.");
+}
+
+static void on_ack_frame(const DoorLinkFrameView& view) {
+    if ((view.length >= 1) && pendingDoorCommand.bPending && (doorlink_view_byte(view, 0) == pendingDoorCommand.seq)) {
+        pendingDoorCommand.bPending = false;
+
+        int64_t ackUs = esp_timer_get_time() - pendingDoorCommand.firstSentTime;
+        access_metrics_record(ACCESS_STAGE_DoorAck, ackUs);
+
+        ESP_LOGI(TAG, "Door command %d acknowledged after %d us (%d retransmits).", (int)pendingDoorCommand.opcode,
+                 (int)ackUs, (int)pendingDoorCommand.retransmits);
+    }
+}
+
+static void on_rfid_frame(const DoorLinkFrameView& view) {
+    BusMessage message;
+    bzero(&message, sizeof(BusMessage));
+
+    MainNotificationArgs& mainNotificationArgs = message.main;
+    mainNotificationArgs.notification          = MAIN_NOTIFICATION_RfidReady;
+    mainNotificationArgs.rfid.idLength         = view.length; // Checked by the main thread
+    mainNotificationArgs.rfid.receivedTime     = esp_timer_get_time();
+    doorlink_view_copy(view, mainNotificationArgs.rfid.id, sizeof(mainNotificationArgs.rfid.id));
+    if (!bus_publish(BUS_TOPIC_Main, message, BUS_PRIORITY_Normal, 100 / portTICK_PERIOD_MS)) {
+        // Erk. Did not add to the queue. Oh well? User can just try again when they realize...
+        droppedFrameCount++;
+    }
+}
+
+static void on_pin_frame(const DoorLinkFrameView& view) {
+    char   pin[DOORLINK_MAX_PAYLOAD + 1];
+    size_t pinLength = doorlink_view_copy(view, (uint8_t*)pin, sizeof(pin) - 1);
+    pin[pinLength]   = '\0';
+
+    BusMessage message;
+    bzero(&message, sizeof(BusMessage));
+
+    MainNotificationArgs& mainNotificationArgs = message.main;
+    mainNotificationArgs.notification          = MAIN_NOTIFICATION_PinReady;
+    mainNotificationArgs.pin.code              = atol(pin);
+    mainNotificationArgs.pin.receivedTime      = esp_timer_get_time();
+    if (!bus_publish(BUS_TOPIC_Main, message, BUS_PRIORITY_Normal, 100 / portTICK_PERIOD_MS)) {
+        // Erk. Did not add to the queue. Oh well? User can just try again when they realize...
+        droppedFrameCount++;
+    }
+}
+
+static void on_rfid_stats_frame(const DoorLinkFrameView& view) {
+    if (view.length < (DL_RFID_STATS_COUNT * 2)) {
+        return;
+    }
+
+    uint16_t stats[DL_RFID_STATS_COUNT];
+    for (int i = 0; i < DL_RFID_STATS_COUNT; i++) {
+        stats[i] = (doorlink_view_byte(view, i * 2) << 8) | doorlink_view_byte(view, (i * 2) + 1);
+    }
+
+    uint32_t pollsPerMinute = (stats[DL_RFID_STATS_PeriodMs] == 0) ? 0 : (stats[DL_RFID_STATS_Polls] * 60000u) / stats[DL_RFID_STATS_PeriodMs];
+    ESP_LOGI(TAG, "RFID: %u polls/min (every %u ms), %u taps (%u repeats suppressed), detect-to-UART avg %u us, max %u us", pollsPerMinute,
+             stats[DL_RFID_STATS_IntervalMs], stats[DL_RFID_STATS_Taps], stats[DL_RFID_STATS_Repeats], stats[DL_RFID_STATS_AvgLatencyUs],
+             stats[DL_RFID_STATS_MaxLatencyUs]);
+
+    if (stats[DL_RFID_STATS_Coalesced] != 0) {
+        ESP_LOGI(TAG, "STM32 skipped %u repeated sounds", stats[DL_RFID_STATS_Coalesced]);
+    }
+    if ((stats[DL_RFID_STATS_CommandDrops] != 0) || (stats[DL_RFID_STATS_KeyDrops] != 0)) {
+        ESP_LOGE(TAG, "STM32 queues full: %u commands and %u key presses lost since boot", stats[DL_RFID_STATS_CommandDrops], stats[DL_RFID_STATS_KeyDrops]);
+    }
+
+    // A fitted sensor is reported at boot and ahead of every stats report
+    if (doorSensorOpen < 0) {
+        ESP_LOGW(TAG, "No door sensor on the STM32, the door won't relock as it opens");
+    }
+}
+
+static void on_door_sensor_frame(const DoorLinkFrameView& view) {
+    if (view.length < 1) {
+        return;
+    }
+
+    // The first report only says where the door is. It hasn't moved, so there is nothing to relock.
+    int bOpen = (doorlink_view_byte(view, 0) != 0) ? 1 : 0;
+    if (doorSensorOpen < 0) {
+        ESP_LOGI(TAG, "Door sensor fitted, door %s", bOpen ? "open" : "closed");
+        doorSensorOpen = bOpen;
+        return;
+    }
+
+    // Repeated with every stats report, but the main thread only needs to hear about changes
+    if (bOpen == doorSensorOpen) {
+        return;
+    }
+
+    BusMessage message;
+    bzero(&message, sizeof(BusMessage));
+
+    MainNotificationArgs& mainNotificationArgs = message.main;
+    mainNotificationArgs.notification          = MAIN_NOTIFICATION_DoorSensor;
+    mainNotificationArgs.door.bOpen            = bOpen;
+    // Ahead of taps, so the door relocks as soon as it opens
+    if (bus_publish(BUS_TOPIC_Main, message, BUS_PRIORITY_High, 100 / portTICK_PERIOD_MS)) {
+        doorSensorOpen = bOpen;
+    } else {
+        // Erk. Did not add to the queue. The next report will try again.
+        droppedFrameCount++;
+    }
+}
 
-            if (message != NULL) {
-                uart_write_bytes(UART_NUM_1, (const char*)message, strlen(message));
+// Indexed by DoorLinkOpcode
+static const DoorLinkViewHandler frameHandlers[DL_OP_COUNT] = {
+    NULL,                  // DL_OP_Nop
+    &on_ready_frame,       // DL_OP_Ready
+    &on_ack_frame,         // DL_OP_Ack
+    NULL,                  // DL_OP_PlaySound
+    NULL,                  // DL_OP_LockDoor
+    NULL,                  // DL_OP_UnlockDoor
+    &on_rfid_frame,        // DL_OP_Rfid
+    &on_pin_frame,         // DL_OP_Pin
+    &on_rfid_stats_frame,  // DL_OP_RfidStats
+    &on_door_sensor_frame, // DL_OP_DoorSensor
+};
+
+static void process_frames() {
+    DoorLinkFrameView view;
+    while (doorlink_stream_next(&stm32Stream, &view)) {
+        if (!doorlink_dispatch_view(frameHandlers, ARRAY_COUNT(frameHandlers), view)) {
+            ESP_LOGE(TAG, "Unexpected opcode from STM32: %d", (int)view.opcode);
+        }
+        doorlink_stream_consume(&stm32Stream, view);
+    }
+}
+
+static void log_link_errors() {
+    uint32_t errorCount = stm32Stream.droppedBytes + stm32Stream.oversizedCount + stm32Stream.malformedCount + droppedFrameCount;
+    if (errorCount != loggedErrorCount) {
+        ESP_LOGE(TAG, "STM32 link errors: %u dropped bytes, %u oversized, %u malformed, %u dropped frames (%u good frames)",
+                 stm32Stream.droppedBytes, stm32Stream.oversizedCount, stm32Stream.malformedCount, droppedFrameCount, stm32Stream.frameCount);
+        loggedErrorCount = errorCount;
+    }
+}
+
+// Blocks until the next retransmit or partial frame deadline, or forever if there's neither
+static TickType_t next_wait_ticks() {
+    int64_t deadline = 0;
+    if (pendingDoorCommand.bPending) {
+        deadline = pendingDoorCommand.sentTime + (DOORLINK_RETRANSMIT_MS * 1000);
+    }
+    if ((partialFrameDeadline != 0) && ((deadline == 0) || (partialFrameDeadline < deadline))) {
+        deadline = partialFrameDeadline;
+    }
+
+    if (deadline == 0) {
+        return portMAX_DELAY;
+    }
+
+    int64_t remaining = deadline - esp_timer_get_time();
+    if (remaining <= 0) {
+        return 0;
+    }
+    return (TickType_t)(remaining / 1000 / portTICK_PERIOD_MS) + 1;
+}
+
+static void process_notification() {
+    BusMessage message;
+    if (bus_receive(BUS_TOPIC_Uart, &message, 0)) {
+        UartNotification notification = message.uart.notification;
+        if ((notification > UART_NOTIFICATION_None) && (notification < UART_NOTIFICATION_COUNT)) {
+            const UartCommand& command = uartCommands[notification];
+            send_frame(command.opcode, &command.sound, (command.opcode == DL_OP_PlaySound) ? 1 : 0);
+
+            // How long a door command waited for the task to wake. Sounds can wait behind them, so aren't counted.
+            if (doorlink_requires_ack(command.opcode)) {
+                access_metrics_record(ACCESS_STAGE_UartQueue, esp_timer_get_time() - message.uart.queuedTime);
             }
         }
+    }
+}
+
+static void read_stm32_uart() {
+    // Reads can split or join frames; the stream reassembles them.
+    // Only read what fits - the rest stays in the driver's buffer for the next pass.
+    size_t buffered = 0;
+    while ((uart_get_buffered_data_len(UART_NUM_1, &buffered) == ESP_OK) && (buffered > 0)) {
+        size_t toRead = doorlink_stream_free(&stm32Stream);
+        if (toRead > buffered) {
+            toRead = buffered;
+        }
+
+        int len = uart_read_bytes(UART_NUM_1, stm32UartBuffer, toRead, 0);
+        if (len <= 0) {
+            break;
+        }
+
+        doorlink_stream_write(&stm32Stream, stm32UartBuffer, len);
+        process_frames();
+    }
+
+    partialFrameDeadline = (doorlink_stream_free(&stm32Stream) < DOORLINK_STREAM_SIZE) ? (esp_timer_get_time() + STM32_UART_IDLE_US) : 0;
+}
+
+static void process_uart_event() {
+    uart_event_t event;
+    if (xQueueReceive(UART_eventQueueHandle, &event, 0) == pdTRUE) {
+        switch (event.type) {
+            case UART_DATA:
+                read_stm32_uart();
+                break;
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                ESP_LOGE(TAG, "STM32 UART overflow, flushing.");
+                uart_flush_input(UART_NUM_1);
+                doorlink_stream_init(&stm32Stream);
+                partialFrameDeadline = 0;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void uart_task(void* pvParameters) {
+    ESP_LOGI(TAG, "UART task running...");
+
+    doorlink_stream_init(&stm32Stream);
+
+    send_frame(DL_OP_Ready, NULL, 0);
+
+    while (1) {
+        // Wakes as soon as there's something to send or something has been received.
+        // The set holds one entry per item, so take exactly one item from whichever member it returns.
+        QueueSetMemberHandle_t activeQueue = xQueueSelectFromSet(UART_queueSetHandle, next_wait_ticks());
+
+        if (activeQueue == bus_wait_handle(BUS_TOPIC_Uart)) {
+            process_notification();
+        } else if (activeQueue == UART_eventQueueHandle) {
+            process_uart_event();
+        }
+
+        retransmit_door_command();
 
-        // Read data from the UART
-        int len = uart_read_bytes(UART_NUM_1, (uint8_t*)stm32UartBuffer, STM32_UART_BUFFER_SIZE - 1, 20 / portTICK_RATE_MS);
-        if (len > 0) {
-            stm32UartBuffer[len] = '\0';
-
-            if (strstr(stm32UartBuffer, rfid_cmd_prefix) == stm32UartBuffer) {
-                for (int i = 0; i < len; i++) {
-                    if (stm32UartBuffer[i] == '\n') {
-                        stm32UartBuffer[i] = '\0';
-                    }
-                }
-
-                len            = strlen(stm32UartBuffer) - strlen(rfid_cmd_prefix);
-                const char* id = stm32UartBuffer + strlen(rfid_cmd_prefix);
-
-                MainNotificationArgs mainNotificationArgs;
-                bzero(&mainNotificationArgs, sizeof(MainNotificationArgs));
-                mainNotificationArgs.notification  = MAIN_NOTIFICATION_RfidReady;
-                mainNotificationArgs.rfid.idLength = len;
-                memcpy(mainNotificationArgs.rfid.id, id, len);
-                if (xQueueSendToBack(MAIN_queueHandle, &mainNotificationArgs, 100 / portTICK_PERIOD_MS) != pdTRUE) {
-                    // Erk. Did not add to the queue. Oh well? User can just try again when they realize...
-                }
-            } else if (strstr(stm32UartBuffer, pin_cmd_prefix) == stm32UartBuffer) {
-                for (int i = 0; i < len; i++) {
-                    if (stm32UartBuffer[i] == '\n') {
-                        stm32UartBuffer[i] = '\0';
-                    }
-                }
-
-                len             = strlen(stm32UartBuffer) - strlen(pin_cmd_prefix);
-                const char* pin = stm32UartBuffer + strlen(pin_cmd_prefix);
-
-                MainNotificationArgs mainNotificationArgs;
-                bzero(&mainNotificationArgs, sizeof(MainNotificationArgs));
-                mainNotificationArgs.notification = MAIN_NOTIFICATION_PinReady;
-                mainNotificationArgs.pin.code     = atol(pin);
-                if (xQueueSendToBack(MAIN_queueHandle, &mainNotificationArgs, 100 / portTICK_PERIOD_MS) != pdTRUE) {
-                    // Erk. Did not add to the queue. Oh well? User can just try again when they realize...
-                }
+        if ((partialFrameDeadline != 0) && (esp_timer_get_time() >= partialFrameDeadline)) {
+            // The line is idle, so anything left is a partial or corrupt frame that will never complete
+            while (doorlink_stream_free(&stm32Stream) < DOORLINK_STREAM_SIZE) {
+                doorlink_stream_resync(&stm32Stream);
+                process_frames();
             }
+            partialFrameDeadline = 0;
         }
+
+        log_link_errors();
     }
 }
 
@@ -162,8 +414,6 @@ static void uart_task(void* pvParameters) {
 void uart_init() {
     ESP_LOGI(TAG, "Initializing UART...");
 
-    UART_queueHandle = xQueueCreateStatic(ARRAY_COUNT(UART_queueStorage), sizeof(UartNotification), (uint8_t*)UART_queueStorage, &UART_queueStructure);
-
     uart_config_t uart_config = {
         .baud_rate           = 115200,
         .data_bits           = UART_DATA_8_BITS,
@@ -175,10 +425,26 @@ void uart_init() {
     };
     ESP_ERROR_CHECK(uart_param_config(UART_NUM_1, &uart_config));
     ESP_ERROR_CHECK(uart_set_pin(UART_NUM_1, STM32_UART_TXD, STM32_UART_RXD, STM32_UART_RTS, STM32_UART_CTS));
-    ESP_ERROR_CHECK(uart_driver_install(UART_NUM_1, STM32_UART_BUFFER_SIZE * 2, 0, 0, NULL, 0));
+    ESP_ERROR_CHECK(uart_driver_install(UART_NUM_1, STM32_UART_BUFFER_SIZE * 2, 0, UART_EVENT_QUEUE_SIZE, &UART_eventQueueHandle, 0));
+
+    UART_queueSetHandle = xQueueCreateSet(bus_capacity(BUS_TOPIC_Uart) + UART_EVENT_QUEUE_SIZE);
+    xQueueAddToSet(bus_wait_handle(BUS_TOPIC_Uart), UART_queueSetHandle);
+    xQueueAddToSet(UART_eventQueueHandle, UART_queueSetHandle);
 }
 
 //
 void uart_thread_create() {
     xTaskCreate(&uart_task, "uart_task", 4 * 1024, NULL, 10, &UART_taskHandle);
 }
+
+//
+bool uart_thread_notify(UartNotification notification, TickType_t ticksToWait) {
+    BusMessage message;
+    bzero(&message, sizeof(BusMessage));
+    message.uart.notification = notification;
+    message.uart.queuedTime   = esp_timer_get_time();
+
+    bool        bDoorCommand = (notification == UART_NOTIFICATION_LockDoor) || (notification == UART_NOTIFICATION_UnlockDoor);
+    BusPriority priority     = bDoorCommand ? BUS_PRIORITY_High : BUS_PRIORITY_Normal;
+    return bus_publish(BUS_TOPIC_Uart, message, priority, ticksToWait);
+}
@@ -23,12 +23,14 @@ enum UartNotification {
 };
 
 
-extern TaskHandle_t  UART_taskHandle;
-extern QueueHandle_t UART_queueHandle;
+extern TaskHandle_t UART_taskHandle;
 
 
 //
 void uart_init();
 void uart_thread_create();
 
+// Queues a command for the STM32. Lock and unlock jump ahead of any queued sfx.
+bool uart_thread_notify(UartNotification notification, TickType_t ticksToWait);
+
 #endif //__UART_THREAD__H__
@@ -4,7 +4,7 @@
 
 #define ARRAY_COUNT(arr) (sizeof(arr) / (sizeof((arr)[0])))
 
-#define SECONDS_IN_US(sec) ((sec)*1000000)
+#define SECONDS_IN_US(sec) ((sec)*1000000LL)
 
 
 #endif //__UTILS_H__
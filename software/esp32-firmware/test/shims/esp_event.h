@@ -0,0 +1,6 @@
+#ifndef __SHIM_ESP_EVENT__H__
+#define __SHIM_ESP_EVENT__H__
+
+// Nothing the native tests use
+
+#endif //__SHIM_ESP_EVENT__H__
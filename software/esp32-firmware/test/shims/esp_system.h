@@ -0,0 +1,28 @@
+#ifndef __SHIM_ESP_SYSTEM__H__
+#define __SHIM_ESP_SYSTEM__H__
+
+#include <stdint.h>
+#include <assert.h>
+
+typedef int32_t esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+
+#define ESP_ERROR_CHECK(x)        \
+    do {                          \
+        esp_err_t __rc = (x);     \
+        assert(__rc == ESP_OK);   \
+        (void)__rc;               \
+    } while (0)
+
+inline uint32_t esp_get_free_heap_size() {
+    return 0;
+}
+
+inline uint32_t esp_get_minimum_free_heap_size() {
+    return 0;
+}
+
+#endif //__SHIM_ESP_SYSTEM__H__
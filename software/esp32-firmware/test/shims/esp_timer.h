@@ -0,0 +1,120 @@
+#ifndef __SHIM_ESP_TIMER__H__
+#define __SHIM_ESP_TIMER__H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "esp_system.h"
+
+// The host's monotonic clock, or a simulated one a test moves by hand. One-shot timers only,
+// fired when the simulated clock is advanced past them.
+
+#define ESP_TIMER_SHIM_MAX_TIMERS 8
+
+typedef void (*esp_timer_cb_t)(void* arg);
+
+typedef enum {
+    ESP_TIMER_TASK,
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t       callback;
+    void*                arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char*          name;
+} esp_timer_create_args_t;
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void*          arg;
+    int64_t        dueTime; // 0 when stopped
+};
+
+typedef struct esp_timer* esp_timer_handle_t;
+
+struct EspTimerShim {
+    bool             bSimulated;
+    int64_t          now;
+    struct esp_timer timers[ESP_TIMER_SHIM_MAX_TIMERS];
+    int              timerCount;
+};
+
+inline EspTimerShim& esp_timer_shim() {
+    static EspTimerShim shim = {};
+    return shim;
+}
+
+// Microseconds since an arbitrary point, like the ESP32's since boot
+inline int64_t esp_timer_get_time() {
+    if (esp_timer_shim().bSimulated) {
+        return esp_timer_shim().now;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+inline esp_err_t esp_timer_create(const esp_timer_create_args_t* pArgs, esp_timer_handle_t* pHandle) {
+    EspTimerShim& shim = esp_timer_shim();
+    if (shim.timerCount == ESP_TIMER_SHIM_MAX_TIMERS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    struct esp_timer* pTimer = &shim.timers[shim.timerCount++];
+    pTimer->callback         = pArgs->callback;
+    pTimer->arg              = pArgs->arg;
+    pTimer->dueTime          = 0;
+    *pHandle                 = pTimer;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeoutUs) {
+    timer->dueTime = esp_timer_get_time() + (int64_t)timeoutUs;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    timer->dueTime = 0;
+    return ESP_OK;
+}
+
+// Switches to the simulated clock, starting at now
+inline void esp_timer_shim_simulate(int64_t now) {
+    esp_timer_shim().bSimulated = true;
+    esp_timer_shim().now        = now;
+}
+
+// When the next timer is due, or 0 if none is running
+inline int64_t esp_timer_shim_next_due() {
+    EspTimerShim& shim    = esp_timer_shim();
+    int64_t       nextDue = 0;
+    for (int i = 0; i < shim.timerCount; i++) {
+        int64_t dueTime = shim.timers[i].dueTime;
+        if ((dueTime != 0) && ((nextDue == 0) || (dueTime < nextDue))) {
+            nextDue = dueTime;
+        }
+    }
+    return nextDue;
+}
+
+// Moves the simulated clock on to now, firing each timer that comes due on the way at its due time
+inline void esp_timer_shim_advance(int64_t now) {
+    EspTimerShim& shim = esp_timer_shim();
+
+    int64_t nextDue;
+    while (((nextDue = esp_timer_shim_next_due()) != 0) && (nextDue <= now)) {
+        for (int i = 0; i < shim.timerCount; i++) {
+            struct esp_timer& timer = shim.timers[i];
+            if (timer.dueTime == nextDue) {
+                shim.now      = nextDue;
+                timer.dueTime = 0;
+                timer.callback(timer.arg);
+                break;
+            }
+        }
+    }
+    shim.now = now;
+}
+
+#endif //__SHIM_ESP_TIMER__H__
@@ -0,0 +1,53 @@
+#ifndef __SHIM_ESP_TLS__H__
+#define __SHIM_ESP_TLS__H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Just enough of esp_tls for https_client.cpp to build on the host. There is no TLS here: the
+// esp_tls transport always fails to connect, and tests supply their own HttpsTransport.
+
+#define MBEDTLS_ERR_SSL_WANT_READ -0x6900
+#define MBEDTLS_ERR_SSL_WANT_WRITE -0x6880
+#define MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY -0x7880
+
+typedef struct esp_tls_cfg {
+    const unsigned char** alpn_protos;
+    const unsigned char*  cacert_pem_buf;
+    unsigned int          cacert_pem_bytes;
+    const unsigned char*  clientcert_pem_buf;
+    unsigned int          clientcert_pem_bytes;
+    const unsigned char*  clientkey_pem_buf;
+    unsigned int          clientkey_pem_bytes;
+    const unsigned char*  clientkey_password;
+    unsigned int          clientkey_password_len;
+    bool                  non_block;
+    int                   timeout_ms;
+    bool                  use_global_ca_store;
+} esp_tls_cfg_t;
+
+struct esp_tls {
+    int sockfd;
+};
+
+static inline struct esp_tls* esp_tls_conn_http_new(const char* url, const esp_tls_cfg_t* cfg) {
+    return NULL;
+}
+
+static inline void esp_tls_conn_delete(struct esp_tls* tls) {
+}
+
+static inline ssize_t esp_tls_conn_write(struct esp_tls* tls, const void* data, size_t datalen) {
+    return -1;
+}
+
+static inline ssize_t esp_tls_conn_read(struct esp_tls* tls, void* data, size_t datalen) {
+    return -1;
+}
+
+static inline ssize_t esp_tls_get_bytes_avail(struct esp_tls* tls) {
+    return 0;
+}
+
+#endif //__SHIM_ESP_TLS__H__
@@ -0,0 +1,8 @@
+#ifndef __SHIM_ESP_TYPES__H__
+#define __SHIM_ESP_TYPES__H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#endif //__SHIM_ESP_TYPES__H__
@@ -0,0 +1,52 @@
+#ifndef __SHIM_FREERTOS__H__
+#define __SHIM_FREERTOS__H__
+
+// Host stand-in for the parts of FreeRTOS the native tests compile against. Only the test runs,
+// so critical sections are no-ops and a call that would block hands over to the block hook.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+typedef int          BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t     TickType_t;
+
+typedef void* TaskHandle_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define portTICK_PERIOD_MS 1
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+
+typedef struct {
+    int unused;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED \
+    {                                \
+        0                            \
+    }
+#define portENTER_CRITICAL(pMux) ((void)(pMux))
+#define portEXIT_CRITICAL(pMux) ((void)(pMux))
+
+// Called instead of blocking for up to ticksToWait. Returns once *pAvailable is non-zero or the
+// time is up, e.g. after running a simulation up to then. Without one, blocking calls fail at once.
+typedef void (*FreeRTOSShimBlockHook)(TickType_t ticksToWait, const UBaseType_t* pAvailable);
+
+inline FreeRTOSShimBlockHook& freertos_shim_block_hook() {
+    static FreeRTOSShimBlockHook hook = NULL;
+    return hook;
+}
+
+inline void freertos_shim_block(TickType_t ticksToWait, const UBaseType_t* pAvailable) {
+    if ((*pAvailable == 0) && (ticksToWait != 0) && (freertos_shim_block_hook() != NULL)) {
+        freertos_shim_block_hook()(ticksToWait, pAvailable);
+    }
+}
+
+#endif //__SHIM_FREERTOS__H__
@@ -0,0 +1,53 @@
+#ifndef __SHIM_FREERTOS_QUEUE__H__
+#define __SHIM_FREERTOS_QUEUE__H__
+
+#include "FreeRTOS.h"
+
+// Static queues only, as a ring over the caller's storage
+
+typedef struct {
+    uint8_t*    pStorage;
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    UBaseType_t head;
+    UBaseType_t waiting;
+} StaticQueue_t;
+
+typedef StaticQueue_t* QueueHandle_t;
+typedef void*          QueueSetMemberHandle_t;
+
+inline QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t itemSize, uint8_t* pStorage, StaticQueue_t* pQueue) {
+    bzero(pQueue, sizeof(StaticQueue_t));
+    pQueue->pStorage = pStorage;
+    pQueue->length   = length;
+    pQueue->itemSize = itemSize;
+    return pQueue;
+}
+
+// Nothing could make room while the caller waits, so a full queue fails at once
+inline BaseType_t xQueueSendToBack(QueueHandle_t queue, const void* pItem, TickType_t ticksToWait) {
+    if (queue->waiting == queue->length) {
+        return pdFALSE;
+    }
+    UBaseType_t tail = (queue->head + queue->waiting) % queue->length;
+    memcpy(queue->pStorage + (tail * queue->itemSize), pItem, queue->itemSize);
+    queue->waiting++;
+    return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t queue, void* pItem, TickType_t ticksToWait) {
+    freertos_shim_block(ticksToWait, &queue->waiting);
+    if (queue->waiting == 0) {
+        return pdFALSE;
+    }
+    memcpy(pItem, queue->pStorage + (queue->head * queue->itemSize), queue->itemSize);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->waiting--;
+    return pdTRUE;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    return queue->waiting;
+}
+
+#endif //__SHIM_FREERTOS_QUEUE__H__
@@ -0,0 +1,38 @@
+#ifndef __SHIM_FREERTOS_SEMPHR__H__
+#define __SHIM_FREERTOS_SEMPHR__H__
+
+#include "FreeRTOS.h"
+
+// Static counting semaphores only
+
+typedef struct {
+    UBaseType_t maxCount;
+    UBaseType_t count;
+} StaticSemaphore_t;
+
+typedef StaticSemaphore_t* SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateCountingStatic(UBaseType_t maxCount, UBaseType_t initialCount, StaticSemaphore_t* pSemaphore) {
+    pSemaphore->maxCount = maxCount;
+    pSemaphore->count    = initialCount;
+    return pSemaphore;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    if (semaphore->count == semaphore->maxCount) {
+        return pdFALSE;
+    }
+    semaphore->count++;
+    return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait) {
+    freertos_shim_block(ticksToWait, &semaphore->count);
+    if (semaphore->count == 0) {
+        return pdFALSE;
+    }
+    semaphore->count--;
+    return pdTRUE;
+}
+
+#endif //__SHIM_FREERTOS_SEMPHR__H__
@@ -0,0 +1,15 @@
+#ifndef __SHIM_FREERTOS_TASK__H__
+#define __SHIM_FREERTOS_TASK__H__
+
+#include "FreeRTOS.h"
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() {
+    static int mainTask;
+    return &mainTask;
+}
+
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    return 0;
+}
+
+#endif //__SHIM_FREERTOS_TASK__H__
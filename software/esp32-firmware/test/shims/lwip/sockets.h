@@ -0,0 +1,11 @@
+#ifndef __SHIM_LWIP_SOCKETS__H__
+#define __SHIM_LWIP_SOCKETS__H__
+
+// lwIP follows the BSD socket API, so the host's does instead
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#endif //__SHIM_LWIP_SOCKETS__H__
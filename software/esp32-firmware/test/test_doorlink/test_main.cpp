@@ -0,0 +1,227 @@
+#include <string.h>
+
+#include <unity.h>
+
+#include <DoorLink.h>
+
+// Replays DoorLink traffic into a DoorLinkStream in random chunks, the way the UART driver hands
+// it over, and checks every valid frame comes out once, in order, with the right counters.
+// Run with: pio test -e native
+
+#define FUZZ_ROUNDS 200
+#define FUZZ_FRAMES 64
+#define FUZZ_MAX_CHUNK 90 // Leaves room for a partial frame in the ring, so nothing is dropped
+
+enum FrameKind {
+    FRAME_Valid,
+    FRAME_Malformed, // A payload or CRC bit flipped
+    FRAME_Oversized, // A length byte beyond DOORLINK_MAX_PAYLOAD
+};
+
+struct ExpectedFrame {
+    uint8_t seq;
+    uint8_t opcode;
+    uint8_t length;
+    uint8_t payload[DOORLINK_MAX_PAYLOAD];
+};
+
+static uint32_t rngState = 1;
+
+// xorshift32, so a failing round can be replayed from its seed
+static uint32_t next_random() {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static uint8_t random_byte_not_sof() {
+    uint8_t value;
+    do {
+        value = (uint8_t)next_random();
+    } while (value == DOORLINK_SOF);
+    return value;
+}
+
+// Only the first byte of each frame is ever SOF, so the number of resyncs a bad frame causes is known
+static bool has_sof(const uint8_t* pData, size_t len) {
+    return memchr(pData, DOORLINK_SOF, len) != NULL;
+}
+
+// Builds a frame of the given kind at pBuffer and returns its size
+static size_t make_frame(uint8_t* pBuffer, FrameKind kind, ExpectedFrame* pExpected) {
+    size_t size = 0;
+    do {
+        pExpected->seq    = random_byte_not_sof();
+        pExpected->opcode = random_byte_not_sof();
+        pExpected->length = (uint8_t)(next_random() % (DOORLINK_MAX_PAYLOAD + 1));
+        for (int i = 0; i < pExpected->length; i++) {
+            pExpected->payload[i] = random_byte_not_sof();
+        }
+        size = doorlink_encode(pBuffer, pExpected->seq, pExpected->opcode, pExpected->payload, pExpected->length);
+    } while (has_sof(pBuffer + 1, size - 1));
+
+    if (kind == FRAME_Malformed) {
+        // Anything after the header; the length has to stay right for the frame to be seen as one
+        size_t  index = DOORLINK_HEADER_SIZE + (next_random() % (size - DOORLINK_HEADER_SIZE));
+        uint8_t flipped;
+        do {
+            flipped = pBuffer[index] ^ (uint8_t)(1 << (next_random() % 8));
+        } while (flipped == DOORLINK_SOF);
+        pBuffer[index] = flipped;
+    } else if (kind == FRAME_Oversized) {
+        pBuffer[1] = DOORLINK_MAX_PAYLOAD + 1 + (next_random() % 64);
+    }
+
+    return size;
+}
+
+static void check_view(const DoorLinkFrameView& view, const ExpectedFrame& expected) {
+    TEST_ASSERT_EQUAL_UINT8(expected.seq, view.seq);
+    TEST_ASSERT_EQUAL_UINT8(expected.opcode, view.opcode);
+    TEST_ASSERT_EQUAL_UINT8(expected.length, view.length);
+
+    uint8_t payload[DOORLINK_MAX_PAYLOAD];
+    TEST_ASSERT_EQUAL(expected.length, doorlink_view_copy(view, payload, sizeof(payload)));
+    if (expected.length > 0) {
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.payload, payload, expected.length);
+    }
+    for (int i = 0; i < expected.length; i++) {
+        TEST_ASSERT_EQUAL_UINT8(expected.payload[i], doorlink_view_byte(view, i));
+    }
+}
+
+//
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_random_chunking() {
+    static uint8_t       traffic[FUZZ_FRAMES * DOORLINK_MAX_FRAME_SIZE];
+    static ExpectedFrame expected[FUZZ_FRAMES];
+
+    for (uint32_t round = 0; round < FUZZ_ROUNDS; round++) {
+        rngState = round + 1;
+
+        // The last frame is always valid, so the bad ones before it are all resolved
+        size_t   trafficSize    = 0;
+        uint32_t validCount     = 0;
+        uint32_t malformedCount = 0;
+        uint32_t oversizedCount = 0;
+        for (int i = 0; i < FUZZ_FRAMES; i++) {
+            uint32_t  roll = next_random() % 8;
+            FrameKind kind = ((i == FUZZ_FRAMES - 1) || (roll > 1)) ? FRAME_Valid : ((roll == 0) ? FRAME_Malformed : FRAME_Oversized);
+
+            ExpectedFrame frame;
+            trafficSize += make_frame(traffic + trafficSize, kind, &frame);
+            if (kind == FRAME_Valid) {
+                expected[validCount++] = frame;
+            } else if (kind == FRAME_Malformed) {
+                malformedCount++;
+            } else {
+                oversizedCount++;
+            }
+        }
+
+        DoorLinkStream stream;
+        doorlink_stream_init(&stream);
+
+        // Chunks split frames and join several together
+        uint32_t delivered = 0;
+        size_t   offset    = 0;
+        while (offset < trafficSize) {
+            size_t chunk = 1 + (next_random() % FUZZ_MAX_CHUNK);
+            if (chunk > (trafficSize - offset)) {
+                chunk = trafficSize - offset;
+            }
+            TEST_ASSERT_EQUAL(chunk, doorlink_stream_write(&stream, traffic + offset, chunk));
+            offset += chunk;
+
+            DoorLinkFrameView view;
+            while (doorlink_stream_next(&stream, &view)) {
+                TEST_ASSERT_LESS_THAN_UINT32(validCount, delivered);
+                check_view(view, expected[delivered++]);
+                doorlink_stream_consume(&stream, view);
+            }
+        }
+
+        TEST_ASSERT_EQUAL_UINT32(validCount, delivered);
+        TEST_ASSERT_EQUAL_UINT32(validCount, stream.frameCount);
+        TEST_ASSERT_EQUAL_UINT32(malformedCount, stream.malformedCount);
+        TEST_ASSERT_EQUAL_UINT32(oversizedCount, stream.oversizedCount);
+        TEST_ASSERT_EQUAL_UINT32(0, stream.droppedBytes);
+        TEST_ASSERT_EQUAL(DOORLINK_STREAM_SIZE, doorlink_stream_free(&stream));
+    }
+}
+
+void test_overflow_is_dropped_and_counted() {
+    rngState = 0x5EED;
+
+    uint8_t       frame[DOORLINK_MAX_FRAME_SIZE];
+    ExpectedFrame expected;
+    size_t        size = make_frame(frame, FRAME_Valid, &expected);
+
+    DoorLinkStream stream;
+    doorlink_stream_init(&stream);
+
+    // Fill the ring without reading, then one more frame that doesn't fit
+    size_t written = 0;
+    while (doorlink_stream_free(&stream) >= size) {
+        written += doorlink_stream_write(&stream, frame, size);
+    }
+    size_t fits = doorlink_stream_free(&stream);
+    TEST_ASSERT_EQUAL(fits, doorlink_stream_write(&stream, frame, size));
+    TEST_ASSERT_EQUAL_UINT32(size - fits, stream.droppedBytes);
+
+    // Every whole frame is still intact
+    DoorLinkFrameView view;
+    for (size_t i = 0; i < (written / size); i++) {
+        TEST_ASSERT_TRUE(doorlink_stream_next(&stream, &view));
+        check_view(view, expected);
+        doorlink_stream_consume(&stream, view);
+    }
+    TEST_ASSERT_FALSE(doorlink_stream_next(&stream, &view));
+}
+
+void test_resync_drops_stalled_partial_frame() {
+    rngState = 0xD00D;
+
+    uint8_t       good[DOORLINK_MAX_FRAME_SIZE];
+    ExpectedFrame expected;
+    size_t        goodSize = make_frame(good, FRAME_Valid, &expected);
+
+    // A frame cut short by a reset on the other side
+    DoorLinkStream stream;
+    doorlink_stream_init(&stream);
+    doorlink_stream_write(&stream, good, goodSize / 2);
+
+    DoorLinkFrameView view;
+    TEST_ASSERT_FALSE(doorlink_stream_next(&stream, &view));
+
+    // The line goes idle, so the UART task resyncs until nothing is left
+    uint32_t resyncs = 0;
+    while (doorlink_stream_free(&stream) < DOORLINK_STREAM_SIZE) {
+        doorlink_stream_resync(&stream);
+        TEST_ASSERT_FALSE(doorlink_stream_next(&stream, &view));
+        resyncs++;
+    }
+    TEST_ASSERT_EQUAL_UINT32(1, resyncs); // The rest holds no SOF, so it is skipped in one go
+    TEST_ASSERT_EQUAL_UINT32(1, stream.malformedCount);
+
+    // The next whole frame comes through
+    doorlink_stream_write(&stream, good, goodSize);
+    TEST_ASSERT_TRUE(doorlink_stream_next(&stream, &view));
+    check_view(view, expected);
+    doorlink_stream_consume(&stream, view);
+    TEST_ASSERT_EQUAL_UINT32(1, stream.frameCount);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_random_chunking);
+    RUN_TEST(test_overflow_is_dropped_and_counted);
+    RUN_TEST(test_resync_drops_stalled_partial_frame);
+    return UNITY_END();
+}
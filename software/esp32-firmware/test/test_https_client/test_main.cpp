@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <thread>
+
+#include <unity.h>
+
+#include "freertos/FreeRTOS.h"
+#include <esp_timer.h>
+#include "lwip/sockets.h"
+
+#include "utils.h"
+
+#include "https_client.h"
+
+// Runs https_client over plain loopback sockets against a scripted mock server, through the
+// HttpsTransport seam, to check keep-alive and reconnects, chunked bodies, cancelling and deadlines.
+// Run with: pio test -e native
+
+#define MOCK_URL "http://127.0.0.1/"
+#define MOCK_REQUEST "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: keep-alive\r\n\r\n"
+#define MOCK_MAX_RESPONSES 8
+
+// What the mock server does with each request, in order
+struct MockResponse {
+    const char* text;
+    size_t      pieceSize;   // Written this many bytes at a time, 0 for all at once
+    bool        bCloseAfter; // Close the connection once written, without saying so in the headers
+    bool        bHang;       // Never answer, just wait for the client to hang up
+};
+
+struct MockServer {
+    int         listenFd;
+    uint16_t    port;
+    std::thread thread;
+
+    MockResponse      responses[MOCK_MAX_RESPONSES];
+    size_t            responseCount;
+    std::atomic<int>  accepted;
+    std::atomic<int>  answered;
+    std::atomic<bool> bPeerClosed; // The client hung up on a request left unanswered
+};
+
+static MockServer server;
+
+
+// Returns false once the client has hung up
+static bool mock_read_request(int fd, char* pBuffer, size_t* pLen, size_t capacity) {
+    while (strstr(pBuffer, "\r\n\r\n") == NULL) {
+        ssize_t ret = recv(fd, pBuffer + *pLen, capacity - *pLen - 1, 0);
+        if (ret <= 0) {
+            return false;
+        }
+        *pLen += ret;
+        pBuffer[*pLen] = '\0';
+    }
+
+    // Drop this request, keeping anything pipelined after it
+    char*  pEnd = strstr(pBuffer, "\r\n\r\n") + 4;
+    size_t used = pEnd - pBuffer;
+    memmove(pBuffer, pEnd, *pLen - used + 1);
+    *pLen -= used;
+    return true;
+}
+
+static void mock_write(int fd, const MockResponse& response) {
+    size_t length = strlen(response.text);
+    size_t piece  = (response.pieceSize == 0) ? length : response.pieceSize;
+    for (size_t offset = 0; offset < length; offset += piece) {
+        size_t len = ((length - offset) < piece) ? (length - offset) : piece;
+        send(fd, response.text + offset, len, MSG_NOSIGNAL);
+        if (piece < length) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200)); // So the client sees the pieces separately
+        }
+    }
+}
+
+static void mock_server_run() {
+    while (true) {
+        int fd = accept(server.listenFd, NULL, NULL);
+        if (fd < 0) {
+            return; // Shut down
+        }
+        server.accepted++;
+
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        char   request[1024] = {};
+        size_t len           = 0;
+        while (mock_read_request(fd, request, &len, sizeof(request))) {
+            size_t index = server.answered;
+            if (index >= server.responseCount) {
+                break;
+            }
+
+            const MockResponse& response = server.responses[index];
+            if (response.bHang) {
+                char ch;
+                while (recv(fd, &ch, 1, 0) > 0) {
+                }
+                server.answered++;
+                server.bPeerClosed = true;
+                break;
+            }
+
+            mock_write(fd, response);
+            server.answered++;
+            if (response.bCloseAfter) {
+                break;
+            }
+        }
+
+        close(fd);
+    }
+}
+
+static void mock_expect(const MockResponse& response) {
+    TEST_ASSERT_LESS_THAN_UINT32(MOCK_MAX_RESPONSES, server.responseCount);
+    server.responses[server.responseCount++] = response;
+}
+
+
+// A transport over plain TCP to the mock server. The URL is ignored.
+struct SocketConnection {
+    int fd;
+};
+
+static void* socket_connect(const char* web_url, const esp_tls_cfg_t& cfg) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(server.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    SocketConnection* pConnection = (SocketConnection*)malloc(sizeof(SocketConnection));
+    pConnection->fd               = fd;
+    return pConnection;
+}
+
+static void socket_close(void* pConnection) {
+    close(((SocketConnection*)pConnection)->fd);
+    free(pConnection);
+}
+
+static int socket_write(void* pConnection, const char* data, size_t len) {
+    return send(((SocketConnection*)pConnection)->fd, data, len, MSG_NOSIGNAL);
+}
+
+static int socket_read(void* pConnection, char* pBuffer, size_t len) {
+    return recv(((SocketConnection*)pConnection)->fd, pBuffer, len, 0);
+}
+
+static bool socket_wait_readable(void* pConnection, int64_t waitUs) {
+    int    fd = ((SocketConnection*)pConnection)->fd;
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(fd, &readSet);
+
+    struct timeval timeout = { (time_t)(waitUs / 1000000), (suseconds_t)(waitUs % 1000000) };
+    return select(fd + 1, &readSet, NULL, NULL, &timeout) != 0;
+}
+
+static void socket_set_timeout(void* pConnection, int timeoutMs) {
+    struct timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+    setsockopt(((SocketConnection*)pConnection)->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+static const HttpsTransport SocketTransport = {
+    socket_connect,
+    socket_close,
+    socket_write,
+    socket_read,
+    socket_wait_readable,
+    socket_set_timeout,
+};
+
+
+static HttpsClient client;
+
+static bool request(char* pBody, size_t capacity, HttpsResponse* pResponse) {
+    HttpsBodyBuffer buffer;
+    https_body_buffer_init(&buffer, pBody, capacity);
+    return https_client_request(&client, MOCK_URL, MOCK_REQUEST, pResponse, &https_body_buffer_append, &buffer);
+}
+
+// Cancels once the request has been waiting this long
+static int64_t cancelAfterTime = 0;
+
+static bool cancel_after(void* pContext) {
+    return (cancelAfterTime != 0) && (esp_timer_get_time() >= cancelAfterTime);
+}
+
+//
+void setUp() {
+    server.listenFd      = socket(AF_INET, SOCK_STREAM, 0);
+    server.responseCount = 0;
+    server.accepted      = 0;
+    server.answered      = 0;
+    server.bPeerClosed   = false;
+
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = 0;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL(0, bind(server.listenFd, (struct sockaddr*)&address, sizeof(address)));
+    TEST_ASSERT_EQUAL(0, listen(server.listenFd, 4));
+
+    socklen_t addressLength = sizeof(address);
+    getsockname(server.listenFd, (struct sockaddr*)&address, &addressLength);
+    server.port   = ntohs(address.sin_port);
+    server.thread = std::thread(mock_server_run);
+
+    esp_tls_cfg_t cfg;
+    bzero(&cfg, sizeof(cfg));
+    cfg.timeout_ms = 2000;
+    https_client_init(&client, "TEST", cfg);
+    https_client_set_transport(&client, &SocketTransport);
+    cancelAfterTime = 0;
+}
+
+void tearDown() {
+    https_client_close(&client);
+
+    shutdown(server.listenFd, SHUT_RDWR);
+    close(server.listenFd);
+    server.thread.join();
+}
+
+void test_keep_alive_reuses_connection() {
+    for (int i = 0; i < 3; i++) {
+        mock_expect({ "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\ntrue", 0, false, false });
+    }
+
+    char          body[64];
+    HttpsResponse response;
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_TRUE(request(body, sizeof(body), &response));
+        TEST_ASSERT_EQUAL(200, response.statusCode);
+        TEST_ASSERT_EQUAL(0, strcmp(body, "true"));
+    }
+
+    TEST_ASSERT_EQUAL(1, server.accepted);
+    TEST_ASSERT_EQUAL_UINT32(1, client.handshakeCount);
+    TEST_ASSERT_EQUAL_UINT32(2, client.reusedCount);
+}
+
+void test_connection_close_header_reconnects() {
+    mock_expect({ "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 2\r\n\r\nok", 0, true, false });
+    mock_expect({ "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok", 0, false, false });
+
+    char          body[64];
+    HttpsResponse response;
+    TEST_ASSERT_TRUE(request(body, sizeof(body), &response));
+    TEST_ASSERT_TRUE(client.pConnection == NULL);
+    TEST_ASSERT_TRUE(request(body, sizeof(body), &response));
+
+    TEST_ASSERT_EQUAL(2, server.accepted);
+    TEST_ASSERT_EQUAL_UINT32(2, client.handshakeCount);
+    TEST_ASSERT_EQUAL_UINT32(0, client.reusedCount);
+}
+
+void test_stale_connection_is_retried() {
+    // The server drops the connection after answering, as an idle keep-alive timeout would
+    mock_expect({ "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok", 0, true, false });
+    mock_expect({ "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nagain", 0, false, false });
+
+    char          body[64];
+    HttpsResponse response;
+    TEST_ASSERT_TRUE(request(body, sizeof(body), &response));
+    TEST_ASSERT_TRUE(client.pConnection != NULL);
+
+    // Let the close arrive before the next write
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    TEST_ASSERT_TRUE(request(body, sizeof(body), &response));
+    TEST_ASSERT_EQUAL(0, strcmp(body, "again"));
+    TEST_ASSERT_EQUAL(2, server.accepted);
+    TEST_ASSERT_EQUAL_UINT32(2, client.handshakeCount);
+}
+
+void test_chunked_body_in_pieces() {
+    // Split a byte at a time, with a chunk extension and a trailer, then a second response on the
+    // same connection to show the first was read to its end and no further
+    mock_expect({ "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                  "7\r\n{\"a\":\"b\r\n"
+                  "A;name=value\r\n\",\"c\":[1,2\r\n"
+                  "3\r\n]}\n\r\n"
+                  "0\r\nX-Trailer: yes\r\n\r\n",
+                  1, false, false });
+    mock_expect({ "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nfalse\r\n0\r\n\r\n", 0, false, false });
+
+    char          body[64];
+    HttpsResponse response;
+    TEST_ASSERT_TRUE(request(body, sizeof(body), &response));
+    TEST_ASSERT_EQUAL(0, strcmp(body, "{\"a\":\"b\",\"c\":[1,2]}\n"));
+
+    char value[16];
+    TEST_ASSERT_TRUE(https_client_get_header(response, "transfer-encoding", value, sizeof(value)));
+    TEST_ASSERT_EQUAL(0, strcmp(value, "chunked"));
+
+    TEST_ASSERT_TRUE(request(body, sizeof(body), &response));
+    TEST_ASSERT_EQUAL(0, strcmp(body, "false"));
+    TEST_ASSERT_EQUAL(1, server.accepted);
+}
+
+void test_body_too_large_fails() {
+    mock_expect({ "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n0123456789", 0, false, false });
+
+    char          body[8];
+    HttpsResponse response;
+    TEST_ASSERT_FALSE(request(body, sizeof(body), &response));
+    TEST_ASSERT_TRUE(client.pConnection == NULL);
+}
+
+void test_cancel_closes_connection() {
+    mock_expect({ "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok", 0, false, false });
+    mock_expect({ NULL, 0, false, true });
+    mock_expect({ "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nfresh", 0, false, false });
+
+    char          body[64];
+    HttpsResponse response;
+    TEST_ASSERT_TRUE(request(body, sizeof(body), &response));
+
+    // Cancelled while waiting on a server that never answers
+    https_client_set_cancel(&client, &cancel_after, NULL);
+    int64_t start   = esp_timer_get_time();
+    cancelAfterTime = start + (100 * 1000);
+    TEST_ASSERT_FALSE(request(body, sizeof(body), &response));
+    int64_t tookUs = esp_timer_get_time() - start;
+
+    TEST_ASSERT_TRUE(tookUs < (500 * 1000)); // Well short of cfg.timeout_ms
+    TEST_ASSERT_EQUAL_UINT32(1, client.cancelledCount);
+    TEST_ASSERT_TRUE(client.pConnection == NULL);
+
+    // The half answered connection isn't reused
+    cancelAfterTime = 0;
+    TEST_ASSERT_TRUE(request(body, sizeof(body), &response));
+    TEST_ASSERT_EQUAL(0, strcmp(body, "fresh"));
+    TEST_ASSERT_TRUE(server.bPeerClosed);
+    TEST_ASSERT_EQUAL(2, server.accepted);
+}
+
+void test_deadline_times_out() {
+    mock_expect({ NULL, 0, false, true });
+
+    https_client_set_deadline(&client, esp_timer_get_time() + (100 * 1000));
+
+    char          body[64];
+    HttpsResponse response;
+    TEST_ASSERT_FALSE(request(body, sizeof(body), &response));
+    TEST_ASSERT_EQUAL_UINT32(1, client.timedOutCount);
+    TEST_ASSERT_TRUE(client.pConnection == NULL);
+
+    // Already past it, so no connection is even tried
+    TEST_ASSERT_FALSE(request(body, sizeof(body), &response));
+    TEST_ASSERT_EQUAL_UINT32(2, client.timedOutCount);
+    TEST_ASSERT_EQUAL(1, server.accepted);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_keep_alive_reuses_connection);
+    RUN_TEST(test_connection_close_header_reconnects);
+    RUN_TEST(test_stale_connection_is_retried);
+    RUN_TEST(test_chunked_body_in_pieces);
+    RUN_TEST(test_body_too_large_fails);
+    RUN_TEST(test_cancel_closes_connection);
+    RUN_TEST(test_deadline_times_out);
+    return UNITY_END();
+}
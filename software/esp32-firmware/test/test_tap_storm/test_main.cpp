@@ -0,0 +1,790 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unity.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <esp_timer.h>
+
+#include "utils.h"
+
+#include <DoorLink.h>
+
+#include "main_thread.h"
+#include "uart_thread.h"
+#include "nomos_http_thread.h"
+#include "is_vhs_open_http_thread.h"
+#include "message_bus.h"
+#include "member_db.h"
+#include "rfid_cache.h"
+#include "access_metrics.h"
+
+// Replays a storm of taps through the main task on a simulated clock. The DoorLink stream, message
+// bus, state machine, RFID cache and access metrics are the firmware's own. Nomos, isvhsopen.com,
+// the member db and the STM32 are fakes. Nomos can be made slow, or gated so it answers nothing
+// until the gate opens. When the main task would block, the simulation runs the other "tasks" up to
+// its wake time instead, so a run depends only on its seed. Replay one with -D TAP_STORM_SEED=<seed>.
+// Run with: pio test -e native_storm
+
+#ifndef TAP_STORM_SEED
+#define TAP_STORM_SEED 1
+#endif
+
+#define STORM_START_US SECONDS_IN_US(1)
+#define STORM_DURATION_US SECONDS_IN_US(300)
+#define STORM_BURST_PERCENT 75 // Taps that follow the last one closely; the rest come after a lull
+#define STORM_RETAP_PERCENT 25 // Impatient members tapping again
+
+// When Nomos is quick, slow, gated (answers nothing) and quick again, from the start of the storm
+#define STORM_SLOW_FROM_US SECONDS_IN_US(60)
+#define STORM_GATE_FROM_US SECONDS_IN_US(120)
+#define STORM_GATE_UNTIL_US SECONDS_IN_US(180)
+
+// Gates on the storm as a whole. The budget never goes past ACCESS_BUDGET_MS with these latencies,
+// and nextWaitTicks() rounds the deadline up to the next tick.
+#define STORM_MAX_DECISION_US ((ACCESS_BUDGET_MS + 2) * 1000LL)
+#define STORM_MAX_RELOCK_US (20 * 1000)
+
+// Cards, by what Nomos says about them
+#define CARD_MEMBERS 24
+#define CARD_UNVETTED 6
+#define CARD_STRANGERS 40 // Mostly seen once, so rarely in the cache
+#define CARD_COUNT (CARD_MEMBERS + CARD_UNVETTED + CARD_STRANGERS + 3) // Plus one each for the scenario tests
+
+enum CardKind {
+    CARD_Member,   // Vetted, with door access
+    CARD_Unvetted, // Needs a PIN while VHS is closed
+    CARD_Stranger, // Nomos answers, without a grant
+};
+
+#define CARD_GatedStranger (CARD_COUNT - 3)
+#define CARD_RetryMember (CARD_COUNT - 2)
+#define CARD_StaleUnvetted (CARD_COUNT - 1)
+
+enum EventKind {
+    EVENT_Tap,       // arg: the card, or -1 for the next random tap of the storm
+    EVENT_UartRx,    // The UART driver hands over some of what has arrived
+    EVENT_NomosDone, // The fake Nomos task finishes, or abandons, the request it is working on
+    EVENT_DoorOpen,
+    EVENT_DoorClose,
+};
+
+struct Event {
+    bool      bUsed;
+    int64_t   time;
+    uint32_t  order; // Events due at the same time run in the order they were scheduled
+    EventKind kind;
+    int       arg;
+};
+
+struct FakeNomosRequest {
+    uint32_t              requestId;
+    NomosHttpNotification httpNotification;
+    char                  body[NOMOS_HTTP_REQUEST_BODY_SIZE];
+    int                   card;
+    int64_t               queuedTime;
+    bool                  bCancelled;
+};
+
+// Test knobs for how the fake Nomos answers
+struct NomosProfile {
+    uint32_t connectMinMs, connectMaxMs;
+    uint32_t responseMinMs, responseMaxMs;
+};
+
+struct SimulationEnd {
+};
+
+static const NomosProfile NomosQuick = { 300, 900, 40, 250 };
+static const NomosProfile NomosSlow  = { 1200, 1900, 300, 900 };
+
+static uint32_t rngState = TAP_STORM_SEED;
+
+static Event    events[64];
+static uint32_t eventOrder = 0;
+
+static uint8_t        cardIds[CARD_COUNT][RFID_CACHE_ID_LENGTH];
+static CardKind       cardKinds[CARD_COUNT];
+static DoorLinkStream uartStream;
+static uint8_t        wire[1024]; // Sent by the STM32, not yet handed over by the UART driver
+static size_t         wireLength = 0;
+static uint8_t        wireSeq    = 0;
+
+static FakeNomosRequest nomosQueue[8]; // nomosQueue[0] is in flight while bNomosBusy
+static int              nomosQueueLength = 0;
+static bool             bNomosBusy       = false;
+static bool             bNomosConnected  = false;
+static int64_t          nomosStartTime   = 0;
+static uint32_t         nomosConnectUs   = 0;
+static uint32_t         nomosResponseUs  = 0;
+static bool             bNomosTimedOut   = false;
+static const NomosProfile* pNomosProfile = NULL; // NULL to follow the storm's phases
+static int64_t             gateFromTime  = 0;
+static int64_t             gateUntilTime = 0;
+
+static IsVHSOpenStatus vhsStatus;
+static bool            bVhsStatusFresh = true; // Kept fresh, as if the poller never misses
+
+static int64_t stormEndTime      = 0;
+static bool    bStrikeUnlocked   = false;
+static bool    bDoorOpen         = false;
+static bool    bDoorOpenPending  = false;
+static int64_t relockDueTime     = 0; // The door opened while unlocked; it has to relock by then
+static int     lastAskedCard     = -1; // The card main last asked Nomos about
+static int     doorSensorReported = -1;
+
+// What happened
+static uint32_t tapCount[CARD_COUNT];
+static uint32_t askedCount[CARD_COUNT];
+static uint32_t unlockCount[CARD_COUNT];
+static uint32_t soundCount[UART_NOTIFICATION_COUNT];
+static uint32_t joinedCount      = 0;
+static uint32_t nomosTimeouts    = 0;
+static uint32_t lockedOutCount   = 0; // A member let in, then locked out again by someone else's tap
+static uint32_t safetyViolations = 0;
+
+
+// xorshift32, so a run can be replayed from its seed
+static uint32_t next_random() {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static uint32_t random_between(uint32_t min, uint32_t max) {
+    return min + (next_random() % (max - min + 1));
+}
+
+static int64_t now_us() {
+    return esp_timer_get_time();
+}
+
+//
+static void schedule(int64_t time, EventKind kind, int arg) {
+    for (size_t i = 0; i < ARRAY_COUNT(events); i++) {
+        if (!events[i].bUsed) {
+            events[i] = { true, time, eventOrder++, kind, arg };
+            return;
+        }
+    }
+    TEST_ASSERT_TRUE_MESSAGE(false, "Event table full");
+}
+
+static Event* next_event() {
+    Event* pNext = NULL;
+    for (size_t i = 0; i < ARRAY_COUNT(events); i++) {
+        Event& event = events[i];
+        if (event.bUsed && ((pNext == NULL) || (event.time < pNext->time) || ((event.time == pNext->time) && (event.order < pNext->order)))) {
+            pNext = &event;
+        }
+    }
+    return pNext;
+}
+
+static Event* find_event(EventKind kind) {
+    for (size_t i = 0; i < ARRAY_COUNT(events); i++) {
+        if (events[i].bUsed && (events[i].kind == kind)) {
+            return &events[i];
+        }
+    }
+    return NULL;
+}
+
+
+// The STM32's side of the link: frames go onto the wire, and the UART driver hands them over in
+// whatever pieces it likes
+static void send_from_stm32(uint8_t opcode, const uint8_t* pPayload, uint8_t length) {
+    TEST_ASSERT_TRUE((wireLength + DOORLINK_MAX_FRAME_SIZE) <= sizeof(wire));
+    bool bIdle = (wireLength == 0);
+    wireLength += doorlink_encode(wire + wireLength, wireSeq++, opcode, pPayload, length);
+    if (bIdle) {
+        schedule(now_us() + 1000, EVENT_UartRx, 0); // About a frame's time at 115200 baud
+    }
+}
+
+// Handled as uart_thread's frame handlers do
+static void on_rfid_frame(const DoorLinkFrameView& view) {
+    BusMessage message;
+    bzero(&message, sizeof(BusMessage));
+    message.main.notification      = MAIN_NOTIFICATION_RfidReady;
+    message.main.rfid.idLength     = view.length;
+    message.main.rfid.receivedTime = now_us();
+    doorlink_view_copy(view, message.main.rfid.id, sizeof(message.main.rfid.id));
+    bus_publish(BUS_TOPIC_Main, message, BUS_PRIORITY_Normal, 0);
+}
+
+static void on_door_sensor_frame(const DoorLinkFrameView& view) {
+    int bOpen = (doorlink_view_byte(view, 0) != 0) ? 1 : 0;
+    if (doorSensorReported < 0) {
+        doorSensorReported = bOpen;
+        return;
+    }
+    if (bOpen == doorSensorReported) {
+        return;
+    }
+
+    BusMessage message;
+    bzero(&message, sizeof(BusMessage));
+    message.main.notification = MAIN_NOTIFICATION_DoorSensor;
+    message.main.door.bOpen   = bOpen;
+    if (bus_publish(BUS_TOPIC_Main, message, BUS_PRIORITY_High, 0)) {
+        doorSensorReported = bOpen;
+    }
+}
+
+static const DoorLinkViewHandler frameHandlers[DL_OP_COUNT] = {
+    NULL,                  // DL_OP_Nop
+    NULL,                  // DL_OP_Ready
+    NULL,                  // DL_OP_Ack
+    NULL,                  // DL_OP_PlaySound
+    NULL,                  // DL_OP_LockDoor
+    NULL,                  // DL_OP_UnlockDoor
+    &on_rfid_frame,        // DL_OP_Rfid
+    NULL,                  // DL_OP_Pin
+    NULL,                  // DL_OP_RfidStats
+    &on_door_sensor_frame, // DL_OP_DoorSensor
+};
+
+static void uart_rx() {
+    size_t chunk = random_between(1, wireLength);
+    TEST_ASSERT_EQUAL(chunk, doorlink_stream_write(&uartStream, wire, chunk));
+    memmove(wire, wire + chunk, wireLength - chunk);
+    wireLength -= chunk;
+
+    DoorLinkFrameView view;
+    while (doorlink_stream_next(&uartStream, &view)) {
+        TEST_ASSERT_TRUE(doorlink_dispatch_view(frameHandlers, ARRAY_COUNT(frameHandlers), view));
+        doorlink_stream_consume(&uartStream, view);
+    }
+
+    if (wireLength > 0) {
+        schedule(now_us() + 1000, EVENT_UartRx, 0);
+    }
+}
+
+
+// The fake Nomos task works through its queue one request at a time, over a keep-alive connection
+static const NomosProfile& nomos_profile() {
+    if (pNomosProfile != NULL) {
+        return *pNomosProfile;
+    }
+    int64_t elapsed = now_us() - STORM_START_US;
+    return ((elapsed >= STORM_SLOW_FROM_US) && (elapsed < STORM_GATE_FROM_US)) ? NomosSlow : NomosQuick;
+}
+
+static void nomos_start_next() {
+    while ((nomosQueueLength > 0) && nomosQueue[0].bCancelled) {
+        // Skipped without being sent
+        memmove(nomosQueue, nomosQueue + 1, (nomosQueueLength - 1) * sizeof(FakeNomosRequest));
+        nomosQueueLength--;
+    }
+    if (bNomosBusy || (nomosQueueLength == 0)) {
+        return;
+    }
+
+    const NomosProfile& profile = nomos_profile();
+    bNomosBusy                  = true;
+    nomosStartTime              = now_us();
+    nomosConnectUs              = bNomosConnected ? 0 : (random_between(profile.connectMinMs, profile.connectMaxMs) * 1000);
+    nomosResponseUs             = random_between(profile.responseMinMs, profile.responseMaxMs) * 1000;
+
+    // Behind a closed gate, Nomos holds on to the request until the gate opens
+    int64_t doneTime = nomosStartTime + nomosConnectUs + nomosResponseUs;
+    if ((doneTime >= gateFromTime) && (nomosStartTime < gateUntilTime)) {
+        doneTime = (doneTime > gateUntilTime) ? doneTime : gateUntilTime;
+    }
+
+    int64_t deadline = nomosQueue[0].queuedTime + (NOMOS_HTTP_TIMEOUT_MS * 1000LL);
+    bNomosTimedOut   = (doneTime > deadline);
+    schedule(bNomosTimedOut ? deadline : doneTime, EVENT_NomosDone, 0);
+}
+
+static void nomos_done() {
+    const FakeNomosRequest& request = nomosQueue[0];
+    int64_t                 now     = now_us();
+
+    if (bNomosTimedOut) {
+        nomosTimeouts++;
+    }
+    // A cancelled or timed out request leaves its connection half read, so it is closed
+    bNomosConnected = !request.bCancelled && !bNomosTimedOut;
+
+    if (!request.bCancelled) {
+        BusMessage reply;
+        bzero(&reply, sizeof(BusMessage));
+        reply.requestId = request.requestId;
+
+        auto& result            = reply.main.NomosHttpRequestResult;
+        reply.main.notification = MAIN_NOTIFICATION_NomosHttpRequestResultReady;
+        result.httpNotification = request.httpNotification;
+        strcpy(result.body, request.body);
+
+        result.stageTimes.queueUs = (uint32_t)(nomosStartTime - request.queuedTime);
+        if (!bNomosTimedOut) {
+            result.bAnswered             = true;
+            result.stageTimes.connectUs  = nomosConnectUs;
+            result.stageTimes.responseUs = (uint32_t)(now - nomosStartTime - nomosConnectUs);
+            result.stageTimes.bodyUs     = 200;
+            result.stageTimes.parseUs    = 20;
+
+            // A stranger's reply is missing the fields a grant has
+            CardKind kind  = cardKinds[request.card];
+            result.success = (kind != CARD_Stranger);
+            if (result.success) {
+                result.result.userId         = 1000 + request.card;
+                result.result.bValidUser     = true;
+                result.result.bHasDoorAccess = true;
+                result.result.bHasBeenVetted = (kind == CARD_Member);
+            }
+        }
+
+        TEST_ASSERT_TRUE_MESSAGE(bus_publish(BUS_TOPIC_Main, reply, BUS_PRIORITY_High, 0), "Nomos reply lost");
+    }
+
+    memmove(nomosQueue, nomosQueue + 1, (nomosQueueLength - 1) * sizeof(FakeNomosRequest));
+    nomosQueueLength--;
+    bNomosBusy = false;
+    nomos_start_next();
+}
+
+static void nomos_cancel_at(int index) {
+    FakeNomosRequest& request = nomosQueue[index];
+    if (request.bCancelled) {
+        return;
+    }
+    request.bCancelled = true;
+
+    // The task polls for cancellation while it waits on the server
+    if ((index == 0) && bNomosBusy) {
+        Event*  pDone       = find_event(EVENT_NomosDone);
+        int64_t abandonTime = now_us() + (50 * 1000);
+        if (pDone->time > abandonTime) {
+            pDone->time    = abandonTime;
+            bNomosTimedOut = false;
+        }
+    }
+}
+
+static int card_for_body(const char* body) {
+    uint8_t id[RFID_CACHE_ID_LENGTH];
+    if (sscanf(body, "{ \"rfid\": \"%hhX:%hhX:%hhX:%hhX:%hhX:%hhX:%hhX\" }", &id[0], &id[1], &id[2], &id[3], &id[4], &id[5], &id[6]) != 7) {
+        return -1;
+    }
+    for (int card = 0; card < CARD_COUNT; card++) {
+        if (memcmp(cardIds[card], id, sizeof(id)) == 0) {
+            return card;
+        }
+    }
+    return -1;
+}
+
+// Fakes for the firmware's other tasks
+TaskHandle_t UART_taskHandle          = NULL;
+TaskHandle_t NomosHttpTaskHandle      = NULL;
+TaskHandle_t IsVHSOpenHttpTaskHandle  = NULL;
+
+// As documented in nomos_http_thread.h
+uint32_t nomos_http_request(NomosHttpNotification httpNotification, const char* body) {
+    int card = card_for_body(body);
+    TEST_ASSERT_TRUE_MESSAGE(card >= 0, body);
+    lastAskedCard = card;
+    askedCount[card]++;
+
+    for (int i = 0; i < nomosQueueLength; i++) {
+        FakeNomosRequest& request = nomosQueue[i];
+        if ((request.httpNotification == httpNotification) && !request.bCancelled) {
+            if (strcmp(request.body, body) == 0) {
+                joinedCount++;
+                return request.requestId;
+            }
+            nomos_cancel_at(i);
+        }
+    }
+
+    TEST_ASSERT_LESS_THAN_UINT32(ARRAY_COUNT(nomosQueue), nomosQueueLength);
+    FakeNomosRequest& request = nomosQueue[nomosQueueLength++];
+    bzero(&request, sizeof(FakeNomosRequest));
+    request.requestId        = bus_next_request_id();
+    request.httpNotification = httpNotification;
+    request.card             = card;
+    request.queuedTime       = now_us();
+    strncpy(request.body, body, sizeof(request.body) - 1);
+
+    nomos_start_next();
+    return request.requestId;
+}
+
+void nomos_http_cancel(NomosHttpNotification httpNotification, uint32_t requestId) {
+    for (int i = 0; i < nomosQueueLength; i++) {
+        if ((nomosQueue[i].httpNotification == httpNotification) && (nomosQueue[i].requestId == requestId)) {
+            nomos_cancel_at(i);
+        }
+    }
+}
+
+void is_vhs_open_get_status(IsVHSOpenStatus* pStatus) {
+    if (bVhsStatusFresh) {
+        vhsStatus.fetchTime = now_us();
+    }
+    *pStatus = vhsStatus;
+}
+
+// The poller is never asked in the storm, where the status is kept fresh, and never answers otherwise
+uint32_t is_vhs_open_request_status() {
+    return bus_next_request_id();
+}
+
+bool uart_thread_notify(UartNotification notification, TickType_t ticksToWait) {
+    soundCount[notification]++;
+
+    if (notification == UART_NOTIFICATION_UnlockDoor) {
+        // The decision is always for the card main last asked Nomos about
+        if ((lastAskedCard < 0) || (cardKinds[lastAskedCard] != CARD_Member)) {
+            safetyViolations++;
+            printf("Unlocked for card %d at %lld us\n", lastAskedCard, (long long)now_us());
+        } else {
+            unlockCount[lastAskedCard]++;
+        }
+
+        bStrikeUnlocked = true;
+        if (!bDoorOpen && !bDoorOpenPending && ((next_random() % 10) != 0)) {
+            bDoorOpenPending = true;
+            schedule(now_us() + (random_between(200, 2500) * 1000), EVENT_DoorOpen, 0);
+        }
+    } else if (notification == UART_NOTIFICATION_LockDoor) {
+        bStrikeUnlocked = false;
+        relockDueTime   = 0;
+    }
+    return true;
+}
+
+// An offline copy of every grant, never expiring
+static bool                    memberDbHas[CARD_COUNT];
+static NomosHttpResponseResult memberDbResults[CARD_COUNT];
+
+void member_db_init() {
+    bzero(memberDbHas, sizeof(memberDbHas));
+}
+
+bool member_db_find_rfid(const uint8_t* id, NomosHttpResponseResult* pResult) {
+    for (int card = 0; card < CARD_COUNT; card++) {
+        if (memberDbHas[card] && (memcmp(cardIds[card], id, RFID_CACHE_ID_LENGTH) == 0)) {
+            *pResult = memberDbResults[card];
+            return true;
+        }
+    }
+    return false;
+}
+
+void member_db_store_rfid(const uint8_t* id, const NomosHttpResponseResult& result) {
+    for (int card = 0; card < CARD_COUNT; card++) {
+        if (memcmp(cardIds[card], id, RFID_CACHE_ID_LENGTH) == 0) {
+            memberDbHas[card]     = true;
+            memberDbResults[card] = result;
+        }
+    }
+}
+
+void member_db_forget_rfid(const uint8_t* id) {
+    for (int card = 0; card < CARD_COUNT; card++) {
+        if (memcmp(cardIds[card], id, RFID_CACHE_ID_LENGTH) == 0) {
+            memberDbHas[card] = false;
+        }
+    }
+}
+
+bool member_db_find_pin(uint32_t pinCode, NomosHttpResponseResult* pResult) {
+    return false;
+}
+
+void member_db_store_pin(uint32_t pinCode, const NomosHttpResponseResult& result) {
+}
+
+void member_db_forget_pin(uint32_t pinCode) {
+}
+
+
+//
+static void tap(int card) {
+    tapCount[card]++;
+    send_from_stm32(DL_OP_Rfid, cardIds[card], RFID_CACHE_ID_LENGTH);
+}
+
+static void storm_tap() {
+    uint32_t roll = next_random() % 100;
+    int      card;
+    if (roll < 70) {
+        card = random_between(0, CARD_MEMBERS - 1);
+    } else if (roll < 85) {
+        card = CARD_MEMBERS + random_between(0, CARD_UNVETTED - 1);
+    } else {
+        card = CARD_MEMBERS + CARD_UNVETTED + random_between(0, CARD_STRANGERS - 1);
+    }
+    tap(card);
+
+    if ((next_random() % 100) < STORM_RETAP_PERCENT) {
+        schedule(now_us() + (random_between(100, 4000) * 1000), EVENT_Tap, card);
+    }
+
+    // While Nomos is gated, people wait to hear back before the next one tries
+    uint32_t gapMs;
+    if ((now_us() >= gateFromTime) && (now_us() < gateUntilTime)) {
+        gapMs = random_between(1000, 6000);
+    } else if ((next_random() % 100) < STORM_BURST_PERCENT) {
+        gapMs = random_between(20, 800);
+    } else {
+        gapMs = random_between(3000, 10000);
+    }
+    int64_t nextTime = now_us() + (gapMs * 1000LL);
+    if (nextTime < stormEndTime) {
+        schedule(nextTime, EVENT_Tap, -1);
+    }
+}
+
+static void run_event(const Event& event) {
+    switch (event.kind) {
+        case EVENT_Tap:
+            if (event.arg < 0) {
+                storm_tap();
+            } else {
+                tap(event.arg);
+            }
+            break;
+        case EVENT_UartRx:
+            uart_rx();
+            break;
+        case EVENT_NomosDone:
+            nomos_done();
+            break;
+        case EVENT_DoorOpen: {
+            bDoorOpenPending = false;
+            if (!bStrikeUnlocked) {
+                // Someone else's tap relocked it first
+                lockedOutCount++;
+                break;
+            }
+            bDoorOpen     = true;
+            relockDueTime = now_us() + STORM_MAX_RELOCK_US;
+            uint8_t open  = 1;
+            send_from_stm32(DL_OP_DoorSensor, &open, 1);
+            schedule(now_us() + (random_between(2000, 5000) * 1000), EVENT_DoorClose, 0);
+            break;
+        }
+        case EVENT_DoorClose: {
+            bDoorOpen      = false;
+            uint8_t closed = 0;
+            send_from_stm32(DL_OP_DoorSensor, &closed, 1);
+            break;
+        }
+    }
+}
+
+// Stands in for the main task blocking on the bus: everything else runs until it has a message
+// or its wait is up. Ends the run once nothing is left to happen.
+static void simulate(TickType_t ticksToWait, const UBaseType_t* pAvailable) {
+    int64_t wakeTime = (ticksToWait == portMAX_DELAY) ? INT64_MAX : (now_us() + (ticksToWait * portTICK_PERIOD_MS * 1000LL));
+
+    while (*pAvailable == 0) {
+        Event*  pEvent    = next_event();
+        int64_t timerTime = esp_timer_shim_next_due();
+        if ((pEvent == NULL) && (timerTime == 0)) {
+            throw SimulationEnd();
+        }
+
+        int64_t nextTime = (pEvent == NULL) ? timerTime : (((timerTime != 0) && (timerTime < pEvent->time)) ? timerTime : pEvent->time);
+        if (nextTime > wakeTime) {
+            esp_timer_shim_advance(wakeTime);
+            return;
+        }
+
+        if ((relockDueTime != 0) && (nextTime > relockDueTime)) {
+            TEST_ASSERT_TRUE_MESSAGE(false, "Door still unlocked after it opened");
+        }
+
+        esp_timer_shim_advance(nextTime);
+        if ((pEvent != NULL) && (pEvent->time == nextTime)) {
+            Event event   = *pEvent;
+            pEvent->bUsed = false;
+            run_event(event);
+        }
+    }
+}
+
+static void run_main_task() {
+    try {
+        main_thread_run();
+    } catch (const SimulationEnd&) {
+    }
+}
+
+static void reset_counts() {
+    bzero(tapCount, sizeof(tapCount));
+    bzero(askedCount, sizeof(askedCount));
+    bzero(unlockCount, sizeof(unlockCount));
+    bzero(soundCount, sizeof(soundCount));
+    joinedCount      = 0;
+    nomosTimeouts    = 0;
+    lockedOutCount   = 0;
+    safetyViolations = 0;
+}
+
+static void make_cards() {
+    for (int card = 0; card < CARD_COUNT; card++) {
+        CardKind kind = CARD_Stranger;
+        if ((card < CARD_MEMBERS) || (card == CARD_RetryMember)) {
+            kind = CARD_Member;
+        } else if ((card < (CARD_MEMBERS + CARD_UNVETTED)) || (card == CARD_StaleUnvetted)) {
+            kind = CARD_Unvetted;
+        }
+        cardKinds[card] = kind;
+
+        uint8_t id[RFID_CACHE_ID_LENGTH] = { 0x04, (uint8_t)kind, (uint8_t)card, 0x5A, 0x00, 0x00, 0x80 };
+        memcpy(cardIds[card], id, sizeof(id));
+    }
+}
+
+//
+void setUp() {
+    reset_counts();
+}
+
+void tearDown() {
+}
+
+void test_tap_storm() {
+    int64_t start = now_us();
+    TEST_ASSERT_EQUAL(STORM_START_US, start);
+    gateFromTime  = start + STORM_GATE_FROM_US;
+    gateUntilTime = start + STORM_GATE_UNTIL_US;
+    stormEndTime  = start + STORM_DURATION_US;
+    schedule(start, EVENT_Tap, -1);
+
+    run_main_task();
+
+    AccessMetrics metrics;
+    access_metrics_get(&metrics);
+    const AccessStageStats& decisions = metrics.stages[ACCESS_STAGE_Decision];
+
+    BusTopicStats busStats;
+    bus_get_stats(BUS_TOPIC_Main, &busStats);
+
+    uint32_t taps = 0, unlocks = 0;
+    for (int card = 0; card < CARD_COUNT; card++) {
+        taps += tapCount[card];
+        unlocks += unlockCount[card];
+    }
+
+    char message[320];
+    snprintf(message, sizeof(message),
+             "Seed %u: %u taps, %u unlocks, %u told to try again, %u refused, %u joined a request in flight, %u Nomos timeouts, "
+             "%u members relocked out by a later tap. Decision p50<=%u us p95<=%u us max=%u us.",
+             (unsigned)TAP_STORM_SEED, taps, unlocks, soundCount[UART_NOTIFICATION_PlayBeepLongLow], soundCount[UART_NOTIFICATION_PlayFailure],
+             joinedCount, nomosTimeouts, lockedOutCount, access_metrics_percentile(decisions, 50), access_metrics_percentile(decisions, 95),
+             decisions.maxUs);
+    TEST_MESSAGE(message);
+
+    // Nobody but a vetted member was ever let in, and the door always relocked behind them
+    TEST_ASSERT_EQUAL_UINT32(0, safetyViolations);
+    TEST_ASSERT_FALSE(bStrikeUnlocked);
+    TEST_ASSERT_EQUAL(0, nomosQueueLength);
+
+    // Every tap was decided within the budget, and no message was lost on the way to the main task
+    TEST_ASSERT_TRUE_MESSAGE(decisions.maxUs <= STORM_MAX_DECISION_US, "A tap waited past the access budget");
+    TEST_ASSERT_EQUAL_UINT32(0, busStats.overflows[BUS_PRIORITY_High]);
+    TEST_ASSERT_EQUAL_UINT32(0, busStats.overflows[BUS_PRIORITY_Normal]);
+
+    // Members got in and strangers didn't, whatever the seed. How many were told to try again or
+    // joined a request depends on the seed; the tests below cover those paths on purpose.
+    TEST_ASSERT_TRUE(unlocks > 0);
+    TEST_ASSERT_TRUE(soundCount[UART_NOTIFICATION_PlayFailure] > 0);
+}
+
+void test_gated_stranger_told_to_try_again() {
+    // Nomos holds on to the request past its timeout, and the card isn't known locally
+    int64_t start = now_us();
+    gateFromTime  = start;
+    gateUntilTime = start + SECONDS_IN_US(60);
+
+    AccessMetrics before;
+    access_metrics_get(&before);
+
+    schedule(start, EVENT_Tap, CARD_GatedStranger);
+    run_main_task();
+
+    AccessMetrics after;
+    access_metrics_get(&after);
+    TEST_ASSERT_EQUAL_UINT32(before.refusedAtDeadlineCount + 1, after.refusedAtDeadlineCount);
+    TEST_ASSERT_EQUAL_UINT32(1, soundCount[UART_NOTIFICATION_PlayBeepLongLow]);
+    TEST_ASSERT_EQUAL_UINT32(1, nomosTimeouts);
+    TEST_ASSERT_EQUAL_UINT32(0, soundCount[UART_NOTIFICATION_UnlockDoor]);
+    TEST_ASSERT_FALSE(bNomosConnected);
+
+    gateFromTime  = 0;
+    gateUntilTime = 0;
+}
+
+void test_retry_joins_slow_request() {
+    // A handshake that takes longer than the budget: the first tap is told to try again, and the
+    // second waits on the same request rather than starting a new one
+    static const NomosProfile coldHandshake = { 4000, 4000, 200, 200 };
+    pNomosProfile                           = &coldHandshake;
+    bNomosConnected                         = false;
+
+    int64_t start = now_us();
+    schedule(start, EVENT_Tap, CARD_RetryMember);
+    schedule(start + ((ACCESS_BUDGET_MS + 300) * 1000LL), EVENT_Tap, CARD_RetryMember);
+    run_main_task();
+
+    TEST_ASSERT_EQUAL_UINT32(2, askedCount[CARD_RetryMember]);
+    TEST_ASSERT_EQUAL_UINT32(1, joinedCount);
+    TEST_ASSERT_EQUAL_UINT32(1, soundCount[UART_NOTIFICATION_PlayBeepLongLow]);
+    TEST_ASSERT_EQUAL_UINT32(1, unlockCount[CARD_RetryMember]);
+    TEST_ASSERT_EQUAL_UINT32(0, safetyViolations);
+
+    pNomosProfile = NULL;
+}
+
+void test_stale_open_status_asks_for_pin() {
+    // The last poll said open, but long ago, and isvhsopen.com doesn't answer the refresh
+    vhsStatus.bValid    = true;
+    vhsStatus.bOpen     = true;
+    vhsStatus.fetchTime = now_us() - SECONDS_IN_US(10 * 60);
+    bVhsStatusFresh     = false;
+
+    schedule(now_us(), EVENT_Tap, CARD_StaleUnvetted);
+    run_main_task();
+
+    TEST_ASSERT_EQUAL_UINT32(0, unlockCount[CARD_StaleUnvetted]);
+    TEST_ASSERT_EQUAL_UINT32(0, safetyViolations);
+    TEST_ASSERT_EQUAL_UINT32(0, soundCount[UART_NOTIFICATION_UnlockDoor]);
+    TEST_ASSERT_EQUAL_UINT32(1, soundCount[UART_NOTIFICATION_PlaySuccess]); // The PIN prompt
+
+    vhsStatus.bOpen = false;
+    bVhsStatusFresh = true;
+}
+
+int main() {
+    esp_timer_shim_simulate(STORM_START_US);
+    freertos_shim_block_hook() = &simulate;
+
+    make_cards();
+    doorlink_stream_init(&uartStream);
+    vhsStatus = { true, false, 0 };
+
+    bus_init();
+    main_thread_init();
+
+    // As the STM32 does at boot
+    uint8_t closed = 0;
+    send_from_stm32(DL_OP_DoorSensor, &closed, 1);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_tap_storm);
+    RUN_TEST(test_gated_stranger_told_to_try_again);
+    RUN_TEST(test_retry_joins_slow_request);
+    RUN_TEST(test_stale_open_status_asks_for_pin);
+    return UNITY_END();
+}
@@ -0,0 +1,286 @@
+#include <string.h>
+
+#include "DoorLink.h"
+
+
+enum ParserState {
+    PARSER_Sof,
+    PARSER_Length,
+    PARSER_Seq,
+    PARSER_Opcode,
+    PARSER_Payload,
+    PARSER_CrcHigh,
+    PARSER_CrcLow,
+};
+
+#define STREAM_MASK (DOORLINK_STREAM_SIZE - 1)
+
+// CRC16-CCITT, poly 0x1021
+static const uint16_t crcTable[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+
+//
+uint16_t doorlink_crc16(uint16_t crc, uint8_t data) {
+    return (uint16_t)((crc << 8) ^ crcTable[((crc >> 8) ^ data) & 0xFF]);
+}
+
+bool doorlink_requires_ack(uint8_t opcode) {
+    return (opcode == DL_OP_LockDoor) || (opcode == DL_OP_UnlockDoor);
+}
+
+size_t doorlink_encode(uint8_t* pBuffer, uint8_t seq, uint8_t opcode, const uint8_t* pPayload, uint8_t length) {
+    if (length > DOORLINK_MAX_PAYLOAD) {
+        length = DOORLINK_MAX_PAYLOAD;
+    }
+
+    size_t size     = 0;
+    pBuffer[size++] = DOORLINK_SOF;
+    pBuffer[size++] = length;
+    pBuffer[size++] = seq;
+    pBuffer[size++] = opcode;
+    if (length > 0) {
+        memcpy(pBuffer + size, pPayload, length);
+        size += length;
+    }
+
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 1; i < size; i++) {
+        crc = doorlink_crc16(crc, pBuffer[i]);
+    }
+    pBuffer[size++] = (uint8_t)(crc >> 8);
+    pBuffer[size++] = (uint8_t)(crc & 0xFF);
+
+    return size;
+}
+
+void doorlink_parser_init(DoorLinkParser* pParser) {
+    memset(pParser, 0, sizeof(DoorLinkParser));
+    pParser->state = PARSER_Sof;
+}
+
+bool doorlink_parse_byte(DoorLinkParser* pParser, uint8_t data) {
+    switch (pParser->state) {
+        case PARSER_Sof:
+            if (data == DOORLINK_SOF) {
+                pParser->crc   = 0xFFFF;
+                pParser->state = PARSER_Length;
+            }
+            break;
+        case PARSER_Length:
+            if (data == DOORLINK_SOF) {
+                // Can't be a valid length, so treat it as the start of the next frame
+                pParser->crc = 0xFFFF;
+                break;
+            }
+            if (data > DOORLINK_MAX_PAYLOAD) {
+                pParser->oversizedCount++;
+                pParser->state = PARSER_Sof;
+                break;
+            }
+            pParser->frame.length = data;
+            pParser->crc          = doorlink_crc16(pParser->crc, data);
+            pParser->state        = PARSER_Seq;
+            break;
+        case PARSER_Seq:
+            pParser->frame.seq = data;
+            pParser->crc       = doorlink_crc16(pParser->crc, data);
+            pParser->state     = PARSER_Opcode;
+            break;
+        case PARSER_Opcode:
+            pParser->frame.opcode = data;
+            pParser->crc          = doorlink_crc16(pParser->crc, data);
+            pParser->index        = 0;
+            pParser->state        = (pParser->frame.length > 0) ? PARSER_Payload : PARSER_CrcHigh;
+            break;
+        case PARSER_Payload:
+            pParser->frame.payload[pParser->index++] = data;
+            pParser->crc                             = doorlink_crc16(pParser->crc, data);
+            if (pParser->index >= pParser->frame.length) {
+                pParser->state = PARSER_CrcHigh;
+            }
+            break;
+        case PARSER_CrcHigh:
+            pParser->crc ^= (uint16_t)data << 8;
+            pParser->state = PARSER_CrcLow;
+            break;
+        case PARSER_CrcLow:
+            pParser->crc ^= data;
+            pParser->state = PARSER_Sof;
+            if (pParser->crc != 0) {
+                pParser->crcErrorCount++;
+                break;
+            }
+            pParser->frameCount++;
+            return true;
+        default:
+            pParser->state = PARSER_Sof;
+            break;
+    }
+
+    return false;
+}
+
+bool doorlink_dispatch(const DoorLinkHandler* handlers, size_t count, const DoorLinkFrame& frame) {
+    if ((frame.opcode >= count) || (handlers[frame.opcode] == NULL)) {
+        return false;
+    }
+
+    handlers[frame.opcode](frame);
+    return true;
+}
+
+//
+void doorlink_stream_init(DoorLinkStream* pStream) {
+    memset(pStream, 0, sizeof(DoorLinkStream));
+}
+
+size_t doorlink_stream_free(const DoorLinkStream* pStream) {
+    return DOORLINK_STREAM_SIZE - (pStream->head - pStream->tail);
+}
+
+size_t doorlink_stream_write(DoorLinkStream* pStream, const uint8_t* pData, size_t len) {
+    size_t accepted = doorlink_stream_free(pStream);
+    if (accepted > len) {
+        accepted = len;
+    }
+    pStream->droppedBytes += len - accepted;
+
+    for (size_t i = 0; i < accepted; i++) {
+        pStream->buffer[(pStream->head + i) & STREAM_MASK] = pData[i];
+    }
+    pStream->head += accepted;
+
+    return accepted;
+}
+
+static uint8_t stream_at(const DoorLinkStream* pStream, uint32_t index) {
+    return pStream->buffer[index & STREAM_MASK];
+}
+
+bool doorlink_stream_next(DoorLinkStream* pStream, DoorLinkFrameView* pView) {
+    while (1) {
+        // Skip to the next start of frame
+        while ((pStream->tail != pStream->head) && (stream_at(pStream, pStream->tail) != DOORLINK_SOF)) {
+            pStream->tail++;
+        }
+
+        uint32_t available = pStream->head - pStream->tail;
+        if (available < 2) {
+            return false;
+        }
+
+        uint8_t length = stream_at(pStream, pStream->tail + 1);
+        if (length > DOORLINK_MAX_PAYLOAD) {
+            pStream->oversizedCount++;
+            pStream->tail++;
+            continue;
+        }
+
+        uint32_t frameSize = DOORLINK_HEADER_SIZE + length + DOORLINK_CRC_SIZE;
+        if (available < frameSize) {
+            return false;
+        }
+
+        // Running the CRC over the trailing big endian CRC as well leaves zero
+        uint16_t crc = 0xFFFF;
+        for (uint32_t i = 1; i < frameSize; i++) {
+            crc = doorlink_crc16(crc, stream_at(pStream, pStream->tail + i));
+        }
+        if (crc != 0) {
+            pStream->malformedCount++;
+            pStream->tail++;
+            continue;
+        }
+
+        uint32_t payloadStart = (pStream->tail + DOORLINK_HEADER_SIZE) & STREAM_MASK;
+        uint32_t firstLength  = DOORLINK_STREAM_SIZE - payloadStart;
+        if (firstLength > length) {
+            firstLength = length;
+        }
+
+        pView->seq             = stream_at(pStream, pStream->tail + 2);
+        pView->opcode          = stream_at(pStream, pStream->tail + 3);
+        pView->length          = length;
+        pView->pSlices[0]      = pStream->buffer + payloadStart;
+        pView->sliceLengths[0] = (uint8_t)firstLength;
+        pView->pSlices[1]      = pStream->buffer;
+        pView->sliceLengths[1] = (uint8_t)(length - firstLength);
+        pView->end             = pStream->tail + frameSize;
+        return true;
+    }
+}
+
+void doorlink_stream_consume(DoorLinkStream* pStream, const DoorLinkFrameView& view) {
+    pStream->tail = view.end;
+    pStream->frameCount++;
+}
+
+void doorlink_stream_resync(DoorLinkStream* pStream) {
+    if (pStream->tail != pStream->head) {
+        pStream->malformedCount++;
+        pStream->tail++;
+    }
+}
+
+size_t doorlink_view_copy(const DoorLinkFrameView& view, uint8_t* pDst, size_t size) {
+    size_t copied = 0;
+    for (int i = 0; i < 2; i++) {
+        size_t len = view.sliceLengths[i];
+        if (len > (size - copied)) {
+            len = size - copied;
+        }
+        memcpy(pDst + copied, view.pSlices[i], len);
+        copied += len;
+    }
+    return copied;
+}
+
+uint8_t doorlink_view_byte(const DoorLinkFrameView& view, uint8_t index) {
+    if (index < view.sliceLengths[0]) {
+        return view.pSlices[0][index];
+    }
+    index -= view.sliceLengths[0];
+    return (index < view.sliceLengths[1]) ? view.pSlices[1][index] : 0;
+}
+
+bool doorlink_dispatch_view(const DoorLinkViewHandler* handlers, size_t count, const DoorLinkFrameView& view) {
+    if ((view.opcode >= count) || (handlers[view.opcode] == NULL)) {
+        return false;
+    }
+
+    handlers[view.opcode](view);
+    return true;
+}
@@ -0,0 +1,173 @@
+#ifndef __DOORLINK__H__
+#define __DOORLINK__H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Framing for the UART link between the STM32 and the ESP32, shared by both firmwares.
+//
+//   SOF | LEN | SEQ | OPCODE | PAYLOAD (LEN bytes) | CRC16 (big endian)
+//
+// The CRC is CRC16-CCITT (poly 0x1021, init 0xFFFF) over LEN, SEQ, OPCODE and the payload.
+// Opcodes that change the door state must be ACKed by the receiver, and are retransmitted
+// by the sender until they are.
+
+#define DOORLINK_SOF 0xA5
+
+#define DOORLINK_MAX_PAYLOAD 24
+#define DOORLINK_HEADER_SIZE 4
+#define DOORLINK_CRC_SIZE 2
+#define DOORLINK_MAX_FRAME_SIZE (DOORLINK_HEADER_SIZE + DOORLINK_MAX_PAYLOAD + DOORLINK_CRC_SIZE)
+
+// Must be a power of two, and hold several frames
+#define DOORLINK_STREAM_SIZE 128
+
+#define DOORLINK_RETRANSMIT_MS 50
+#define DOORLINK_MAX_RETRANSMITS 10
+
+enum DoorLinkOpcode {
+    DL_OP_Nop,
+
+    // Both directions
+    DL_OP_Ready, // Sent on boot
+    DL_OP_Ack,   // payload: SEQ of the acknowledged frame
+
+    // ESP32 -> STM32
+    DL_OP_PlaySound,  // payload: DoorLinkSound
+    DL_OP_LockDoor,   // ACKed
+    DL_OP_UnlockDoor, // ACKed
+
+    // STM32 -> ESP32
+    DL_OP_Rfid,      // payload: card UID
+    DL_OP_Pin,       // payload: ASCII digits
+    DL_OP_RfidStats,  // payload: DoorLinkRfidStats fields, each a big endian uint16
+    DL_OP_DoorSensor, // payload: 1 if the door is open, 0 if closed. Sent on change and with each RfidStats.
+
+    DL_OP_COUNT
+};
+
+enum DoorLinkSound {
+    DL_SOUND_BeepShortMedium,
+    DL_SOUND_BeepShortLow,
+    DL_SOUND_BeepLongMedium,
+    DL_SOUND_BeepLongLow,
+    DL_SOUND_BeepShortHigh,
+    DL_SOUND_BeepLongHigh,
+    DL_SOUND_Buzzer01,
+    DL_SOUND_Buzzer02,
+    DL_SOUND_Success,
+    DL_SOUND_Failure,
+    DL_SOUND_Smb,
+
+    DL_SOUND_COUNT
+};
+
+// Card reader poll rate and detect-to-UART latency over the last report period. A tap can wait up
+// to one poll interval before it is seen, so worst case tap-to-UART is interval + max latency.
+// The STM32's queue overflow and sound counts ride along, as this is its only periodic report.
+enum DoorLinkRfidStats {
+    DL_RFID_STATS_PeriodMs,     // Length of the report period
+    DL_RFID_STATS_IntervalMs,   // Scheduled time between polls
+    DL_RFID_STATS_Polls,        // Polls made in the period
+    DL_RFID_STATS_Taps,         // Cards read and sent
+    DL_RFID_STATS_AvgLatencyUs, // From the poll that saw the card to its frame being sent
+    DL_RFID_STATS_MaxLatencyUs,
+    DL_RFID_STATS_Repeats,      // Reads of a card that was already on the reader, not sent
+    DL_RFID_STATS_CommandDrops, // Commands and ACKs from the ESP32 lost to a full queue, since boot
+    DL_RFID_STATS_KeyDrops,     // Key presses lost to a full queue, since boot
+    DL_RFID_STATS_Coalesced,    // Repeats of a sound already queued, not played again
+
+    DL_RFID_STATS_COUNT
+};
+
+struct DoorLinkFrame {
+    uint8_t seq;
+    uint8_t opcode;
+    uint8_t length;
+    uint8_t payload[DOORLINK_MAX_PAYLOAD];
+};
+
+// Called for each valid frame, from whatever context fed the parser
+typedef void (*DoorLinkHandler)(const DoorLinkFrame& frame);
+
+struct DoorLinkParser {
+    uint8_t       state;
+    uint8_t       index;
+    uint16_t      crc;
+    DoorLinkFrame frame;
+
+    // Stats
+    uint32_t frameCount;
+    uint32_t crcErrorCount;
+    uint32_t oversizedCount;
+};
+
+// Reassembles frames from arbitrarily chunked reads. Frames are validated in place and handed
+// out as views into the ring, so the payload is only copied once, straight to its destination.
+// After a bad length or CRC it resyncs on the next SOF byte rather than skipping the whole frame,
+// so a corrupt frame can't take the following good one with it.
+struct DoorLinkStream {
+    uint8_t  buffer[DOORLINK_STREAM_SIZE];
+    uint32_t head; // Free running write index
+    uint32_t tail; // Free running read index
+
+    // Stats
+    uint32_t frameCount;
+    uint32_t droppedBytes; // Didn't fit in the ring
+    uint32_t oversizedCount;
+    uint32_t malformedCount; // Bad CRC
+};
+
+// A validated frame still sitting in the ring. The payload may wrap, so it is up to two slices.
+struct DoorLinkFrameView {
+    uint8_t        seq;
+    uint8_t        opcode;
+    uint8_t        length;
+    const uint8_t* pSlices[2];
+    uint8_t        sliceLengths[2];
+    uint32_t       end;
+};
+
+typedef void (*DoorLinkViewHandler)(const DoorLinkFrameView& view);
+
+//
+uint16_t doorlink_crc16(uint16_t crc, uint8_t data);
+
+// True for opcodes that must be ACKed
+bool doorlink_requires_ack(uint8_t opcode);
+
+// Writes a complete frame to pBuffer (at least DOORLINK_MAX_FRAME_SIZE bytes). Returns its size.
+size_t doorlink_encode(uint8_t* pBuffer, uint8_t seq, uint8_t opcode, const uint8_t* pPayload, uint8_t length);
+
+//
+void doorlink_parser_init(DoorLinkParser* pParser);
+
+// Feed one received byte. Returns true when pParser->frame holds a complete, valid frame.
+bool doorlink_parse_byte(DoorLinkParser* pParser, uint8_t data);
+
+// Calls handlers[frame.opcode], if any. Returns false for unknown opcodes.
+bool doorlink_dispatch(const DoorLinkHandler* handlers, size_t count, const DoorLinkFrame& frame);
+
+//
+void   doorlink_stream_init(DoorLinkStream* pStream);
+size_t doorlink_stream_free(const DoorLinkStream* pStream);
+
+// Appends received bytes. Returns how many fit; the rest are counted in droppedBytes.
+size_t doorlink_stream_write(DoorLinkStream* pStream, const uint8_t* pData, size_t len);
+
+// Finds the next valid frame. It stays in the ring until doorlink_stream_consume.
+bool doorlink_stream_next(DoorLinkStream* pStream, DoorLinkFrameView* pView);
+void doorlink_stream_consume(DoorLinkStream* pStream, const DoorLinkFrameView& view);
+
+// Drops the frame that doorlink_stream_next is waiting on. For when the line has gone idle with a
+// partial frame in the ring - a corrupt length can otherwise hold up the good frame behind it.
+void doorlink_stream_resync(DoorLinkStream* pStream);
+
+// Copies up to size bytes of the payload to pDst. Returns the number copied.
+size_t  doorlink_view_copy(const DoorLinkFrameView& view, uint8_t* pDst, size_t size);
+uint8_t doorlink_view_byte(const DoorLinkFrameView& view, uint8_t index);
+
+// Calls handlers[view.opcode], if any. Returns false for unknown opcodes.
+bool doorlink_dispatch_view(const DoorLinkViewHandler* handlers, size_t count, const DoorLinkFrameView& view);
+
+#endif //__DOORLINK__H__
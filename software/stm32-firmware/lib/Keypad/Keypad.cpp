@@ -1,97 +1,100 @@
 #include "Keypad.h"
-#include <ticker_api.h>
-#include <Timer.h>
 
-void Keypad::_cbRow0Rise()
+Keypad::Keypad(PinName r0, PinName r1, PinName r2, PinName r3, PinName c0, PinName c1, PinName c2, int debounce_ms)
+    : _row0(r0, PullDown), _row1(r1, PullDown), _row2(r2, PullDown), _row3(r3, PullDown)
+    , _col0(c0), _col1(c1), _col2(c2)
+    , _rows { &_row0, &_row1, &_row2, &_row3 }
+    , _cols { &_col0, &_col1, &_col2 }
 {
-    _checkIndex(0, _rows[0]);
-}
+    // Each key is sampled once per full scan of the columns
+    int samples = (debounce_ms * 1000) / (scanPeriodUs * nCols);
+    _integratorMax = (samples < 2) ? 2 : ((samples > 255) ? 255 : samples);
 
-void Keypad::_cbRow1Rise()
-{
-    _checkIndex(1, _rows[1]);
+    for (int i = 0; i < nRows * nCols; i++) {
+        _integrators[i] = 0;
+        _pressed[i] = false;
+    }
+    _scanCol = 0;
 }
 
-void Keypad::_cbRow2Rise()
+Keypad::~Keypad()
 {
-    _checkIndex(2, _rows[2]);
+    stop();
 }
 
-void Keypad::_cbRow3Rise()
+void Keypad::start()
 {
-    _checkIndex(3, _rows[3]);
-}
+    for (int i = 0; i < nCols; i++)
+        _cols[i]->write(i == _scanCol);
 
-void Keypad::_cbRowFall() {
+    _scanTicker.attach_us(callback(this, &Keypad::_scan), scanPeriodUs);
 }
 
-Keypad::Keypad(PinName r0, PinName r1, PinName r2, PinName r3, PinName c0, PinName c1, PinName c2, int debounce_ms)
-    : _row0(r0, PullDown), _row1(r1, PullDown), _row2(r2, PullDown), _row3(r3, PullDown)
-    , _col0(c0), _col1(c1), _col2(c2)
-    , _rows { &_row0, &_row1, &_row2, &_row3 }
-    , _cols { &_col0, &_col1, &_col2 }
+void Keypad::stop()
 {
-    _nRow = 4;
-    _nCol = 3;
-
-    _row0.rise(callback(this, &Keypad::_cbRow0Rise));
-    _row1.rise(callback(this, &Keypad::_cbRow1Rise));
-    _row2.rise(callback(this, &Keypad::_cbRow2Rise));
-    _row3.rise(callback(this, &Keypad::_cbRow3Rise));
-
-    // _row0.fall(callback(this, &Keypad::_cbRowFall));
-    // _row1.fall(callback(this, &Keypad::_cbRowFall));
-    // _row2.fall(callback(this, &Keypad::_cbRowFall));
-    // _row3.fall(callback(this, &Keypad::_cbRowFall));
+    _scanTicker.detach();
 
-    _debounce = debounce_ms;
-    _debounceTimer.start();
+    for (int i = 0; i < nCols; i++)
+        _cols[i]->write(0);
 }
 
-Keypad::~Keypad()
+void Keypad::attach(uint32_t (*fptr)(uint32_t index))
 {
+    _callback.attach(fptr);
 }
 
-void Keypad::start()
+void Keypad::poll()
 {
-    for (int i = 0; i < _nCol; i++)
-        _cols[i]->write(1);
+    KeypadEvent event;
+    while (read(event)) {
+        if (event.pressed)
+            _callback.call(event.index);
+    }
 }
 
-void Keypad::stop()
+bool Keypad::read(KeypadEvent& event)
 {
-    for (int i = 0; i < _nCol; i++)
-        _cols[i++]->write(0);
+    return _events.pop(event);
 }
 
-void Keypad::attach(uint32_t (*fptr)(uint32_t index))
+uint32_t Keypad::dropped() const
 {
-    _callback.attach(fptr);
+    return _events.dropped();
 }
 
-void Keypad::_checkIndex(int row, InterruptIn *therow)
+// Ticker callback. The energized column has had a whole tick to settle, so
+// sample its rows, then move on to the next column.
+void Keypad::_scan()
 {
-    if (_debounceTimer.read_ms() < _debounce)
-        return;
-    _debounceTimer.reset();
-
-    if (therow->read() == 0)
-        return;
-
-    int c;
-    for (c = 0; c < _nCol; c++)
-    {
-        _cols[c]->write(0); // de-energize the column
-        if (therow->read() == 0)
-        {
-            break;
+    for (int r = 0; r < nRows; r++) {
+        int index = r * nCols + _scanCol;
+        uint8_t& integrator = _integrators[index];
+
+        if (_rows[r]->read()) {
+            if (integrator < _integratorMax)
+                integrator++;
+        } else {
+            if (integrator > 0)
+                integrator--;
+        }
+
+        // Only change state at the ends of the integrator, so bounces in between are ignored
+        bool pressed = _pressed[index];
+        if (!pressed && integrator == _integratorMax) {
+            _pressed[index] = true;
+        } else if (pressed && integrator == 0) {
+            _pressed[index] = false;
+        } else {
+            continue;
         }
-    }
 
-    if (c < _nCol) {
-        int index = row * _nCol + c;
-        _callback.call(index);
+        KeypadEvent event;
+        event.index = index;
+        event.pressed = !pressed;
+        _events.push(event);
     }
 
-    start(); // Re-energize all columns
+    _cols[_scanCol]->write(0);
+    _scanCol = (_scanCol + 1) % nCols;
+    _cols[_scanCol]->write(1);
 }
@@ -25,16 +25,25 @@
 #define KEYPAD_H
 
 #include <mbed.h>
-#include <Timer.h>
 
 #include "FPointer.h"
+#include "SpscRing.h"
+
+/** A key press or release, as queued by the scanner
+ */
+struct KeypadEvent {
+    uint8_t index;  // row * columns + column
+    bool pressed;
+};
 
 /**
- * An interrupt-based interface to 4x3 keypad.
+ * A timer-driven interface to 4x3 keypad.
  *
- * On each key pressed on a keypad, the index of the key is passed to a
- * user-defined function. User is free to define what to be done with the
- * input.
+ * A Ticker energizes one column at a time and samples the rows, keeping an
+ * integrator per key so each key is debounced independently. Presses and
+ * releases go into a lock-free FIFO that the main loop drains with poll() or
+ * read(), so several keys in quick succession are all registered and no user
+ * code runs in interrupt context.
  *
  * Example:
  * @code
@@ -42,30 +51,26 @@
  * #include "Keypad.h"
  *
  * // Define your own keypad values
- * char Keytable[] = { '1', '2', '3', 'A',   // r0
- *                     '4', '5', '6', 'B',   // r1
- *                     '7', '8', '9', 'C',   // r2
- *                     '*', '0', '#', 'D'    // r3
+ * char Keytable[] = { '1', '2', '3',   // r0
+ *                     '4', '5', '6',   // r1
+ *                     '7', '8', '9',   // r2
+ *                     '*', '0', '#',   // r3
  *                   };
- *                  // c0   c1   c2   c3
- *
- * uint32_t Index;
+ *                  // c0   c1   c2
  *
  * uint32_t cbAfterInput(uint32_t index) {
- *     Index = index;
+ *     printf("Index:%d => Key:%c\r\n", index, Keytable[index]);
  *     return 0;
  * }
  *
  * int main() {
- *                 // r0   r1   r2   r3   c0   c1   c2   c3
- *     Keypad keypad(p21, p22, p23, p24, p25, p26, p27, p28);
+ *                 // r0   r1   r2   r3   c0   c1   c2
+ *     Keypad keypad(p21, p22, p23, p24, p25, p26, p27);
  *     keypad.attach(&cbAfterInput);
- *     keypad.start();  // energize the keypad via c0-c3
+ *     keypad.start();  // start scanning
  *
  *     while (1) {
- *         __wfi();
- *         printf("Interrupted\r\n");
- *         printf("Index:%d => Key:%c\r\n", Index, Keytable[Index]);
+ *         keypad.poll(); // calls cbAfterInput for each key pressed
  *     }
  * }
  * @endcode
@@ -74,17 +79,17 @@
 class Keypad
 {
   public:
-    /** Create a 4x4 (row, col) or 4x3 keypad interface:
+    /** Create a 4x3 (row, col) keypad interface:
      *
-     *          | Col0 | Col1 | Col2 | Col3
-     *   -------+------+------+------+-----
-     *   Row 0  |   x  |   x  |   x  |  x
-     *   Row 1  |   x  |   x  |   x  |  x
-     *   Row 2  |   x  |   x  |   x  |  x
-     *   Row 3  |   x  |   x  |   x  |  x
+     *          | Col0 | Col1 | Col2
+     *   -------+------+------+------
+     *   Row 0  |   x  |   x  |   x
+     *   Row 1  |   x  |   x  |   x
+     *   Row 2  |   x  |   x  |   x
+     *   Row 3  |   x  |   x  |   x
      *
      *  @param row<0..3>     Row data lines
-     *  @param col<0..3>     Column data lines
+     *  @param col<0..2>     Column data lines
      *  @param debounce_ms   Debounce in ms (Default to 20ms)
      */
     Keypad(PinName r0, PinName r1, PinName r2, PinName r3,
@@ -95,42 +100,56 @@ class Keypad
      */
     ~Keypad();
 
-    /** Start the keypad interrupt routines
+    /** Start scanning the keypad
      */
     void start(void);
 
-    /** Stop the keypad interrupt routines
+    /** Stop scanning and de-energize the columns
      */
     void stop(void);
 
-    /** User-defined function that to be called when a key is pressed
+    /** User-defined function that to be called when a key is pressed.
+     *  Called from poll(), never from interrupt context.
      *  @param fptr           A function pointer takes a uint32_t and
      *                        returns uint32_t
      */
     void attach(uint32_t (*fptr)(uint32_t));
 
+    /** Drain queued events, calling the attached function for each press
+     */
+    void poll(void);
+
+    /** Take the next queued press or release. Returns false if there is none.
+     */
+    bool read(KeypadEvent& event);
+
+    /** Events lost because poll() or read() wasn't called often enough
+     */
+    uint32_t dropped(void) const;
+
   protected:
-    InterruptIn _row0;
-    InterruptIn _row1;
-    InterruptIn _row2;
-    InterruptIn _row3;
+    static const int nRows = 4;
+    static const int nCols = 3;
+    static const int scanPeriodUs = 1000; // One column per tick
+
+    DigitalIn _row0;
+    DigitalIn _row1;
+    DigitalIn _row2;
+    DigitalIn _row3;
     DigitalOut _col0;
     DigitalOut _col1;
     DigitalOut _col2;
-    InterruptIn* _rows[4];
-    DigitalOut* _cols[3];
-    int _debounce; // miliseconds
-    Timer _debounceTimer;
-    int _nRow;
-    int _nCol;
+    DigitalIn* _rows[nRows];
+    DigitalOut* _cols[nCols];
+    Ticker _scanTicker;
+    int _scanCol;       // Column currently energized
+    uint8_t _integratorMax;
+    uint8_t _integrators[nRows * nCols];
+    bool _pressed[nRows * nCols];
+    SpscRing<KeypadEvent, 16> _events;
     FPointer _callback; // Called after each input
 
-    void _checkIndex(int row, InterruptIn *therow);
-    void _cbRow0Rise(void);
-    void _cbRow1Rise(void);
-    void _cbRow2Rise(void);
-    void _cbRow3Rise(void);
-    void _cbRowFall(void);
+    void _scan(void);
 };
 
 #endif // KEYPAD_H
@@ -38,6 +38,9 @@
  * 0.00 25Mar14 PG  File created.
  * 1.00 30Mar14 PG  Initial release.
  * 2.00 06May14 PG  Added play() etc to support MML music. Removed tune() etc.
+ * 3.00 17Oct26 VHS Added background note sequencer for playAsync().
+ * 3.01 17Oct26 VHS Added playTable().
+ * 3.02 17Oct26 VHS Integer periods and durations throughout, no soft-float.
  *
  ******************************************************************************/
 
@@ -51,9 +54,14 @@
 // Constructor
 
 PwmSound::PwmSound(PinName pin) : _pin(pin) {
-	_dutyCycle = 0.5;
-	_pin = 0.0;
+	_timbre = 4;
+	_pin.pulsewidth_us(0);
 	_playing = false;
+    _queueHead = 0;
+    _queueTail = 0;
+    _seqActive = false;
+    _seqSounding = false;
+    _wait = false;
 }
 
 // Play a tone on output pin
@@ -63,24 +71,47 @@ PwmSound::PwmSound(PinName pin) : _pin(pin) {
 //    duration - duration of tone in seconds
 //               if duration = 0.0, tone continues in background until stopped
 // Returns: nothing
-// Uses: current duty cycle
+// Uses: current timbre
+// Note: Converted to integer period and duration once, see _tone()
 
 void PwmSound::tone(float frequency, float duration) {
-    _pin.period(1.0 / frequency);
-    _pin = _dutyCycle;
-    if (duration == 0.0) {
+    _tone((int) (1000000.0f / frequency), (int) (duration * 1000.0f));
+}
+
+// Integer version of tone()
+//
+// Parameters:
+//    period - period of tone in us, 0 for silence
+//    duration - duration of tone in ms, 0 = continue in background until stopped
+// Returns: nothing
+
+void PwmSound::_tone(int period, int duration) {
+    _start(period);
+    if (duration == 0) {
         _playing = true;
         return;
     }
-    wait(duration);
-    _pin = 0.0;
+    wait_ms(duration);
+    _pin.pulsewidth_us(0);
+}
+
+// Start a square wave at the current timbre, or silence for period 0
+
+void PwmSound::_start(int period) {
+    if (period > 0) {
+        _pin.period_us(period);
+        _pin.pulsewidth_us((period * _timbre) / 8);
+    } else {
+        _pin.pulsewidth_us(0);
+    }
 }
 
 // Stop background tone or sound generation
 
 void PwmSound::stop(void) {
     _playing = false;
-    _pin = 0.0;
+    _flush();
+    _pin.pulsewidth_us(0);
 }
 
 // Set timbre (tonal quality)
@@ -91,13 +122,14 @@ void PwmSound::stop(void) {
 
 void PwmSound::timbre(int t) {
 	if (t >= 1 && t <= 4) {
-		_dutyCycle = t / 8.0;
+		_timbre = t;
 	}
 }
 // Beeps of various types and other sounds
 // Note: All sounds below except phone permit continuous sound in background
 //       To invoke this call the function with a zero parameter
 //       Call stop() to end the sound
+//       Periods are in us, durations in ms (1047Hz = 955us etc)
 //
 // Parameters:
 //    n - number of cycles, 0 for continuous sound in background (not phone)
@@ -105,99 +137,99 @@ void PwmSound::timbre(int t) {
 
 void PwmSound::bip(int n) {
     if (n == 0) {
-        _setup(1047.0, 0.1, 0.0, 0.03);
+        _setup(955, 100, 0, 30);
         return;
     }
     for (int i = 0; i < n; i++) {
-        tone(1047.0, 0.10);
-        wait(0.03);
+        _tone(955, 100);
+        wait_ms(30);
     }
 }
 
 void PwmSound::bop(int n) {
     if (n == 0) {
-        _setup(700.0, 0.1, 0.0, 0.03);
+        _setup(1429, 100, 0, 30);
         return;
     }
     for (int i = 0; i < n; i++) {
-        tone(700.0, 0.10);
-        wait(0.03);
+        _tone(1429, 100);
+        wait_ms(30);
     }
 }
 
 void PwmSound::beep(int n) {
     if (n == 0) {
-        _setup(969.0, 0.3, 0.0, 0.1);
+        _setup(1032, 300, 0, 100);
         return;
     }
     for (int i = 0; i < n; i++) {
-        tone(969.0, 0.3);
-        wait(0.1);
+        _tone(1032, 300);
+        wait_ms(100);
     }
 }
 
 void PwmSound::bleep(int n) {
     if (n == 0) {
-        _setup(800.0, 0.4, 0.0, 0.1);
+        _setup(1250, 400, 0, 100);
         return;
     }
     for (int i = 0; i < n; i++) {
-        tone(800.0, 0.4);
-        wait(0.1);
+        _tone(1250, 400);
+        wait_ms(100);
     }
 }
 
 void PwmSound::buzz(int n) {
     if (n == 0) {
-        _setup(1900.0, 0.01, 300.0, 0.01);
+        _setup(526, 10, 3333, 10);
         return;
     }
     for (int i = 0; i < n; i++) {
         for (int j = 0; j < 20; j++) {
-            tone(1900.0, 0.01);
-            tone(300.0, 0.01);
+            _tone(526, 10);
+            _tone(3333, 10);
         }
     }
 }
 
 void PwmSound::siren(int n) {
     if (n == 0) {
-        _setup(969.0, 0.5, 800.0, 0.5);
+        _setup(1032, 500, 1250, 500);
         return;
     }
     for (int i = 0; i < n; i++) {
-        tone(969.0, 0.5);
-        tone(800.0, 0.5);
+        _tone(1032, 500);
+        _tone(1250, 500);
     }
 }
 
 void PwmSound::trill(int n) {
     if (n == 0) {
-        _setup(969.0, 0.05, 800.0, 0.05);
+        _setup(1032, 50, 1250, 50);
         return;
     }
     for (int i = 0; i < n; i++) {
         if (i > 0) {
-            tone(800.0, 0.05); //make the trills sound continouus
+            _tone(1250, 50); //make the trills sound continouus
         }
-        tone(969.0, 0.05);
-        tone(800.0, 0.05);
-        tone(969.0, 0.05);
-        tone(800.0, 0.05);
-        tone(969.0, 0.05);
-        tone(800.0, 0.05);
-        tone(969.0, 0.05);
-        tone(800.0, 0.05);
-        tone(969.0, 0.05);
+        _tone(1032, 50);
+        _tone(1250, 50);
+        _tone(1032, 50);
+        _tone(1250, 50);
+        _tone(1032, 50);
+        _tone(1250, 50);
+        _tone(1032, 50);
+        _tone(1250, 50);
+        _tone(1032, 50);
     }
 }
 
 void PwmSound::phone(int n) {
     for (int i = 0; i < n; i++) {
         trill();
-        wait(0.10);
+        wait_ms(100);
         trill();
-        wait(0.7);
+        wait_ms(700);
     }
 }   
 
@@ -205,16 +237,19 @@ void PwmSound::phone(int n) {
 // _sustain() has been optimised for speed. On a 96MHz LPC1768 it takes 8.5us.
 // Non-optimised version with floating point freqency & duration took 11.4us.
 // Execution times measured with 'scope on LED1 pin.
+//
+// Parameters:
+//    period1, period2 - periods of the two tones in us, 0 for silence
+//    dur1, dur2 - durations of the two tones in ms
 
-void PwmSound::_setup(float freq1, float dur1, float freq2, float dur2) {
-    _period1 = (int) (1000000.0 / freq1);
-    _period2 = (int) (1000000.0 / freq2);
-    _dur1 = (unsigned int) (1000000.0 * dur1);
-    _dur2 = (unsigned int) (1000000.0 * dur2);
+void PwmSound::_setup(int period1, int dur1, int period2, int dur2) {
+    _period1 = period1;
+    _period2 = period2;
+    _dur1 = (unsigned int) dur1 * 1000;
+    _dur2 = (unsigned int) dur2 * 1000;
     _phase = false;
     _sustainTmo.attach_us(callback(this, &PwmSound::_sustain), _dur1);
-    _pin.period_us(_period1);      //start the sound
-    _pin = _dutyCycle;
+    _start(_period1);      //start the sound
     _playing = true;
 }
         
@@ -222,20 +257,128 @@ void PwmSound::_sustain(void) {
     //led1 = 1;
     if (_playing == false) {
         //kill pwm and no more callbacks
-        _pin = 0.0;
+        _pin.pulsewidth_us(0);
     } else {
         _phase = !_phase;
         if (_phase) {
-            _pin.period_us(_period2);
-            _pin = _dutyCycle;
+            _start(_period2);
             _sustainTmo.attach_us(callback(this, &PwmSound::_sustain), _dur2);
         } else {
-            _pin.period_us(_period1);
-            _pin = _dutyCycle;
+            _start(_period1);
             _sustainTmo.attach_us(callback(this, &PwmSound::_sustain), _dur1);
         }
     }
     //led1 = 0;
 }
 
+// Background note sequencer
+// Notes are queued by the play functions and played one after the other from
+// _seqTmo callbacks, so playback doesn't hold up the caller.
+
+// Test if there's anything playing or queued
+//
+// Parameters: none
+// Returns: true if playing
+
+bool PwmSound::isPlaying(void) {
+    return _seqActive;
+}
+
+// Queue a tune precompiled to a note table (see utils/compile-tunes.py) and
+// return immediately. No parsing is done, the notes are queued as they are.
+//
+// Parameters:
+//    notes - note table, usually in flash
+//    count - number of notes in table
+//    preempt - if true, stop whatever is playing or queued first
+// Returns: false if the queue couldn't take the whole tune
+
+bool PwmSound::playTable(const PwmSoundNote* notes, int count, bool preempt) {
+    if (preempt) {
+        _flush();
+    }
+    for (int i = 0; i < count; i++) {
+        if (!_enqueue(notes[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Add a note to the end of the queue, starting playback if idle
+//
+// Parameters:
+//    note - note to add
+// Returns: false if the queue is full (and _wait is false)
+
+bool PwmSound::_enqueue(const PwmSoundNote& note) {
+    while ((_queueHead - _queueTail) >= PWMSOUND_QUEUE_SIZE) {
+        if (!_wait) {
+            return false;
+        }
+        wait_ms(1);
+    }
+
+    _queue[_queueHead & (PWMSOUND_QUEUE_SIZE - 1)] = note;
+    __DMB();            //note must be visible before it's published
+    _queueHead++;
+
+    core_util_critical_section_enter();
+    if (!_seqActive) {
+        _seqNext();
+    }
+    core_util_critical_section_exit();
+    return true;
+}
+
+// Drop all queued notes and silence the one playing
+
+void PwmSound::_flush(void) {
+    core_util_critical_section_enter();
+    _seqTmo.detach();
+    _queueTail = _queueHead;
+    _seqActive = false;
+    _seqSounding = false;
+    _pin.pulsewidth_us(0);
+    core_util_critical_section_exit();
+}
+
+// Start the next queued note. Called from the callback, or with interrupts off.
+
+void PwmSound::_seqNext(void) {
+    if (_queueTail == _queueHead) {
+        _seqActive = false;
+        _seqSounding = false;
+        _pin.pulsewidth_us(0);
+        return;
+    }
+
+    PwmSoundNote note = _queue[_queueTail & (PWMSOUND_QUEUE_SIZE - 1)];
+    _queueTail++;       //slot may be reused from here on
+    _seqActive = true;
+    _seqOff = note.off;
+
+    if (note.period > 0 && note.on > 0) {
+        _pin.period_us(note.period);
+        _pin.pulsewidth_us((note.period * note.timbre) / 8);
+        _seqSounding = true;
+        _seqTmo.attach_us(callback(this, &PwmSound::_seqTick), note.on * 1000);
+    } else {
+        //rest for the whole note
+        _pin.pulsewidth_us(0);
+        _seqSounding = false;
+        _seqTmo.attach_us(callback(this, &PwmSound::_seqTick), (note.on + note.off) * 1000 + 1);
+    }
+}
+
+void PwmSound::_seqTick(void) {
+    if (_seqSounding && _seqOff > 0) {
+        _pin.pulsewidth_us(0);
+        _seqSounding = false;
+        _seqTmo.attach_us(callback(this, &PwmSound::_seqTick), _seqOff * 1000);
+    } else {
+        _seqNext();
+    }
+}
+
 // END of PwmSound.cpp
@@ -33,6 +33,10 @@
  * 0.00 25Mar14 PG  File created.
  * 1.00 30Mar14 PG  Initial release
  * 2.00 06May14 PG  Added play() etc to support MML music. Removed tune() etc.
+ * 3.00 17Oct26 VHS Added playAsync(). MML is compiled into a note queue that
+ *                  is played from a Timeout callback.
+ * 3.01 17Oct26 VHS Added playTable() for tunes precompiled to note tables.
+ * 3.02 17Oct26 VHS Integer periods and durations throughout, no soft-float.
  *
  ******************************************************************************/
 
@@ -41,6 +45,17 @@
 
 #include "mbed.h"
 
+// Compiled note, as queued for background playback
+struct PwmSoundNote {
+    uint16_t period;    //PWM period in us, 0 = rest
+    uint8_t timbre;     //duty cycle in eighths (1-4)
+    uint8_t reserved;
+    uint16_t on;        //time sounded in ms
+    uint16_t off;       //time silent afterwards in ms
+};
+
+#define PWMSOUND_QUEUE_SIZE 64  //in notes, must be a power of two
+
 class PwmSound {
 //private:
 
@@ -61,13 +76,19 @@ public:
     void phone(int n = 1);
 
     int play(const char* m, int options = 0);		//play tune in MML format
+    int playAsync(const char* m, int options = 0, bool preempt = false);   //queue tune, return immediately
+    bool playTable(const PwmSoundNote* notes, int count, bool preempt = false);   //queue precompiled tune
+    bool isPlaying(void);
 
 private:
     PwmOut _pin;
-    float _dutyCycle;   //PWM duty cycle 0-50%
+    int _timbre;        //PWM duty cycle in eighths (1-4), 12.5-50%
+
+    void _tone(int period, int duration);
+    void _start(int period);
 
     //the following support continuous two-tone sounds in background
-    void _setup(float freq1, float dur1, float freq2, float dur2);
+    void _setup(int period1, int dur1, int period2, int dur2);
     void _sustain(void);    
     Timeout _sustainTmo;
     int _period1;           //in us
@@ -77,7 +98,22 @@ private:
     bool _phase;
     bool _playing;
 
+    //the following support background playback of queued notes
+    bool _enqueue(const PwmSoundNote& note);
+    void _flush(void);
+    void _seqNext(void);
+    void _seqTick(void);
+    Timeout _seqTmo;
+    PwmSoundNote _queue[PWMSOUND_QUEUE_SIZE];
+    volatile uint32_t _queueHead;   //written by play functions
+    volatile uint32_t _queueTail;   //written by sequencer callback
+    volatile bool _seqActive;
+    bool _seqSounding;              //in the on part of the current note
+    uint16_t _seqOff;               //off time of current note in ms
+    bool _wait;                     //block until there's room in the queue
+
     //the following support play
+    int _compile(const char* m, int options);
     void _note(int number, int length, int dots = 0);
     char _getChar(void);
     char _nextChar(void);
@@ -88,10 +124,9 @@ private:
     int _tempo;     //pace of music in beats per minute (32-255)
                     //one beat equals one quarter note (ie a crotchet)
     int _length;    //length of note (1-64), 1 = whole note, 4 = quarter etc
-    float _1dot;	//note length extension factors
-    float _2dots;
-    float _3dots;
+    const uint8_t* _dots;   //note length extension factors in eighths, by number of dots
     int _style;     //music style (1-8), 6 = Staccato, 7 = Normal, 8 = Legato
+    bool _queueFull;
     const char* _mp;		//current position in music string
     char _nextCh;
     bool _haveNext;
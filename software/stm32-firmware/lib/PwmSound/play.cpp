@@ -33,6 +33,8 @@
  * Ver  Date    By  Details
  * 0.00 28Mar14 PG  File created.
  * 1.00 06May14 PG  Initial release.
+ * 2.00 17Oct26 VHS MML is compiled into the note queue. Added playAsync().
+ * 2.01 17Oct26 VHS Integer note periods and timing, replacing notePitches[].
  *
  ******************************************************************************/
 /*
@@ -134,31 +136,37 @@
 
 // extern Serial pc;	//for debug, comment out of not needed
 
- // Standard note pitches in Hz
-// From Wikipedia: http://en.wikipedia.org/wiki/Scientific_pitch_notation
+ // Standard note periods in us (1000000 / pitch in Hz, rounded down)
+// Pitches from Wikipedia: http://en.wikipedia.org/wiki/Scientific_pitch_notation
  // First entry is a dummy, real note numbers start at 1
  // Seven octaves, twelve notes per octave
  // C, C#, D, D#, E, F, F#, G, G#, A, A#, B
- // Middle C (261.63Hz) is element 37
-
- float notePitches[1+84] = {
-     1.0,												//dummy
-     32.703, 34.648, 36.708, 38.891, 41.203, 43.654,	//first octave
-     46.249, 48.999, 51.913, 55.000, 58.270, 61.735,
-     65.406, 69.296, 73.416, 77.782, 82.407, 87.307,	//second octave
-     92.499, 97.999, 103.83, 110.00, 116.54, 123.47,
-     130.81, 138.59, 146.83, 155.56, 164.81, 174.61,	//third octave
-     185.00, 196.00, 207.65, 220.00, 233.08, 246.94,
-     261.63, 277.18, 293.66, 311.13, 329.63, 349.23,	//fourth octave
-     369.99, 392.00, 415.30, 440.00, 466.16, 493.88,
-     523.25, 554.37, 587.33, 622.25, 659.26, 698.46,	//fifth octave
-     739.99, 783.99, 830.61, 880.00, 932.33, 987.77,
-     1046.5, 1108.7, 1174.7, 1244.5, 1318.5, 1396.9,	//sixth octave
-     1480.0, 1568.0, 1661.2, 1760.0, 1864.7, 1975.5,
-     2093.0, 2217.5, 2349.3, 2489.0, 2637.0, 2793.8,	//seventh octave
-     2960.0, 3136.0, 3322.4, 3520.0, 3729.3, 3951.1,
+ // Middle C (261.63Hz = 3822us) is element 37
+ // Must match utils/compile-tunes.py
+
+ static const uint16_t notePeriods[1+84] = {
+     0,												//dummy
+     30578, 28861, 27242, 25712, 24270, 22907,	//first octave
+     21622, 20408, 19262, 18181, 17161, 16198,
+     15289, 14430, 13621, 12856, 12134, 11453,	//second octave
+     10810, 10204,  9631,  9090,  8580,  8099,
+      7644,  7215,  6810,  6428,  6067,  5727,	//third octave
+      5405,  5102,  4815,  4545,  4290,  4049,
+      3822,  3607,  3405,  3214,  3033,  2863,	//fourth octave
+      2702,  2551,  2407,  2272,  2145,  2024,
+      1911,  1803,  1702,  1607,  1516,  1431,	//fifth octave
+      1351,  1275,  1203,  1136,  1072,  1012,
+       955,   901,   851,   803,   758,   715,	//sixth octave
+       675,   637,   601,   568,   536,   506,
+       477,   450,   425,   401,   379,   357,	//seventh octave
+       337,   318,   300,   284,   268,   253,
  };
 
+// Note length extension factors in eighths, indexed by number of dots
+
+static const uint8_t standardDots[4] = { 8, 12, 14, 15 };   //100%, 150%, 175%, 187.5%
+static const uint8_t longDots[4] = { 8, 12, 18, 27 };       //100%, 150%, 225%, 337.5%
+
 // Note numbers within octave for notes A - G (white keys on piano)
 
 int notes[7] = { 10, 12, 1, 3, 5, 6, 8 };   //C is first note = 1
@@ -168,7 +176,7 @@ int notes[7] = { 10, 12, 1, 3, 5, 6, 8 };   //C is first note = 1
 int flats[7] = { -1, -1, 0, -1, -1, 0, -1 };    //not C or F
 int sharps[7] = {1, 0, 1, 1, 0, 1, 1 };         //not B or E 
 
-// Play a melody from music data written in MML format.
+// Play a melody from music data written in MML format, returning when done.
 //
 // Parameters:
 //    m - pointer to string containing music data
@@ -185,25 +193,60 @@ int sharps[7] = {1, 0, 1, 1, 0, 1, 1 };         //not B or E
 // Returns: 0 if no error in input, otherwise position of offending character
 
 int PwmSound::play(const char* m, int options) {
+    _flush();
+    _wait = true;       //long tunes are fed to the queue as it drains
+    int result = _compile(m, options);
+    _wait = false;
+
+    while (isPlaying()) {
+        wait_ms(1);
+    }
+    return result;
+}
+
+// Queue a melody written in MML format and return immediately. It plays
+// in the background after anything already queued.
+//
+// Parameters:
+//    m - pointer to string containing music data
+//    options - as for play()
+//    preempt - if true, stop whatever is playing or queued first
+// Returns: 0 if no error in input, otherwise position of offending character
+//          (or of the first note that didn't fit in the queue)
+
+int PwmSound::playAsync(const char* m, int options, bool preempt) {
+    if (preempt) {
+        _flush();
+    }
+    return _compile(m, options);
+}
+
+// Compile a melody written in MML format into the note queue
+//
+// Parameters:
+//    m - pointer to string containing music data
+//    options - as for play()
+// Returns: 0 if no error, otherwise position of offending character
+
+int PwmSound::_compile(const char* m, int options) {
 	bool run = true;//, kbdPoll = true;
     char c, c1;
     int n, n1, n2;
 
 	bool stdOctNum = (options & 1) ? true : false;	//options bits
     bool stickyShift = (options & 2) ? true : false;
-    bool longDots = (options & 4) ? true : false;
+    bool useLongDots = (options & 4) ? true : false;
 
     _octave = 4;    //set defaults
     _shift = 0;
     _tempo = 120;
     _length = 4;
-    _1dot = 1.5;
-    _2dots = (longDots == true) ? 2.25 : 1.75;
-    _3dots = (longDots == true) ? 3.375 : 1.875;
+    _dots = (useLongDots == true) ? longDots : standardDots;
     _style = 7;
-    _dutyCycle = 0.5;
+    _timbre = 4;
     _mp = m;
     _haveNext = false;
+    _queueFull = false;
     //pc.putc('[');
     while (run) {
         // if (kbdPoll && pc.readable()) {
@@ -306,7 +349,7 @@ int PwmSound::play(const char* m, int options) {
             case 'Q':   //set timbre
                 n = _getNumber();
                 if (n >= 1 && n <= 4) {
-                	_dutyCycle = n / 8.0;
+                	_timbre = n;
                 }
                 break;
 
@@ -341,16 +384,17 @@ int PwmSound::play(const char* m, int options) {
                 break;
 
             default:		//abort on invalid characters
-            	_pin = 0.0;
             	return(int (_mp - m) );	//return position of error
         }
+        if (_queueFull) {
+            return(int (_mp - m) );
+        }
     }   //end of while
     //pc.putc(']');
-    _pin = 0.0;
     return 0;
 }
 
-// Play a musical note on output pin
+// Queue a musical note to play on output pin
 //
 // Parameters:
 //    number - 0 = rest, notes from 1 to 84, middle C (262Hz) = 37
@@ -363,30 +407,28 @@ int PwmSound::play(const char* m, int options) {
 // Returns: nothing
 
 void PwmSound::_note(int number, int length, int dots) {
-    float duration, play, rest;
+    uint32_t duration, play;
 
     if (number < 1 || number > 84) {    //convert bad note to a rest
         number = 0;
     }
 
-    duration = 240.0 / (_tempo * length);
-    if (dots == 1) {
-        duration *= _1dot;
-    } else if (dots == 2) {
-        duration *= _2dots;
-    } else if (dots == 3) {
-        duration *= _3dots;
+    //all in us, no soft-float (must match utils/compile-tunes.py)
+    duration = 240000000 / (_tempo * length);
+    if (dots >= 1 && dots <= 3) {
+        duration = (duration * _dots[dots]) / 8;
     }
-    play = duration * _style / 8.0;
-    rest = duration * (8 - _style) / 8.0;
-
-    if (number > 0) {
-        _pin.period(1.0 / notePitches[number]);
-        _pin = _dutyCycle;
+    play = (duration * _style) / 8;
+
+    PwmSoundNote note;
+    note.period = notePeriods[number];
+    note.timbre = _timbre;
+    note.reserved = 0;
+    note.on = play / 1000;
+    note.off = (duration - play) / 1000;
+    if (!_enqueue(note)) {
+        _queueFull = true;
     }
-    wait(play);
-    _pin = 0.0;
-    wait(rest);
 }
 
 // Read next character in input string
@@ -0,0 +1,77 @@
+#ifndef __SPSC_RING_H__
+#define __SPSC_RING_H__
+
+#include <mbed.h>
+
+/**
+ * Lock-free single producer, single consumer ring buffer.
+ *
+ * One side (typically an interrupt handler) only ever calls push(), the other
+ * (typically the main loop) only ever calls pop(), so neither needs to mask
+ * interrupts. A push into a full ring is dropped and counted rather than
+ * overwriting the oldest entry, as mbed's CircularBuffer does.
+ *
+ * @param T     Element type, copied in and out
+ * @param Size  Capacity, must be a power of two
+ */
+template <typename T, uint32_t Size>
+class SpscRing
+{
+  public:
+    SpscRing() : _head(0), _tail(0), _dropped(0)
+    {
+    }
+
+    /** Producer side. Returns false (and counts a drop) if the ring is full.
+     */
+    bool push(const T& item)
+    {
+        uint32_t head = _head;
+        if ((head - _tail) >= Size) {
+            _dropped++;
+            return false;
+        }
+
+        _buffer[head & (Size - 1)] = item;
+        __DMB(); // Item must be visible before it's published
+        _head = head + 1;
+        return true;
+    }
+
+    /** Consumer side. Returns false if the ring is empty.
+     */
+    bool pop(T& item)
+    {
+        uint32_t tail = _tail;
+        if (tail == _head) {
+            return false;
+        }
+
+        item = _buffer[tail & (Size - 1)];
+        __DMB(); // Finish reading before the slot is handed back
+        _tail = tail + 1;
+        return true;
+    }
+
+    bool empty() const
+    {
+        return _tail == _head;
+    }
+
+    /** Pushes dropped because the ring was full
+     */
+    uint32_t dropped() const
+    {
+        return _dropped;
+    }
+
+  private:
+    static_assert((Size & (Size - 1)) == 0, "SpscRing size must be a power of two");
+
+    T                 _buffer[Size];
+    volatile uint32_t _head;
+    volatile uint32_t _tail;
+    volatile uint32_t _dropped;
+};
+
+#endif //__SPSC_RING_H__
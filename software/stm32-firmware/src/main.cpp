@@ -1,12 +1,15 @@
 #include <mbed.h>
 #include <Timer.h>
-#include <platform/CircularBuffer.h>
 
 #include <MFRC522.h>
 #include <PwmSound.h>
 #include <Keypad.h>
+#include <DoorLink.h>
+#include <SpscRing.h>
 
 #include "nfc_debug.h"
+#include "rfid_pins.h"
+#include "tunes.h"
 
 #define ARRAY_COUNT(arr) (sizeof(arr) / (sizeof((arr)[0])))
 
@@ -14,6 +17,25 @@ static DigitalOut ledNFC(PC_13);
 
 static DigitalOut doorRelay(PA_0);
 
+// Reed switch to ground, closed while the door is. The interrupt only notes that it moved; the
+// loop reports it once it has stopped bouncing.
+//
+// Build with -D DOOR_SENSOR_FITTED=0 where none is wired up. The pull up would read the bare input
+// as a door that is always open, so it is never reported instead, and the ESP32 logs that it has
+// no sensor.
+#ifndef DOOR_SENSOR_FITTED
+#define DOOR_SENSOR_FITTED 1
+#endif
+
+#define DOOR_SENSOR_DEBOUNCE_MS 30
+
+#if DOOR_SENSOR_FITTED
+static InterruptIn   doorSensor(PB_9, PullUp);
+static Timer         doorSensorTimer;
+static volatile bool doorSensorMoved = false;
+#endif
+static int doorSensorReported = -1;
+
 static PwmSound audioPlayback(PB_1);
 
 static const char Keytable[] = {
@@ -25,7 +47,7 @@ static const char Keytable[] = {
 //  c0   c1   c2
 
 static Keypad keypad(PB_0, PA_7, PA_6, PA_5, // rows
-                     PA_4, PA_3, PA_2, 200); // columns
+                     PA_4, PA_3, PA_2, 20);  // columns, debounce ms
 
 static char  pinCode[16]  = {};
 static bool  pinCompleted = false;
@@ -33,9 +55,9 @@ static Timer pinTimeout;
 
 // Serial pc(PA_9, PA_10, 115200);
 
-static RawSerial esp32(PB_10, PB_11, 115200);
-static uint8_t   esp32RXBuffer[64] = {};
-static int       esp32RXLen        = 0;
+static RawSerial      esp32(PB_10, PB_11, 115200);
+static DoorLinkParser esp32Parser;
+static uint8_t        esp32TxSeq = 0;
 
 enum ControlCmd {
     CCMD_NOP,
@@ -49,21 +71,68 @@ enum ControlCmd {
     CCMD_PLAY_BUZZER_02,
     CCMD_PLAY_SUCCESS,
     CCMD_PLAY_FAILURE,
-    CCMD_PLAY_SMB,
-    CCMD_LOCK_DOOR,
-    CCMD_UNLOCK_DOOR
+    CCMD_PLAY_SMB
 };
 
-static CircularBuffer<ControlCmd, 16, uint8_t> commandBuffer;
-
-#define SPI2_MOSI PB_15
-#define SPI2_MISO PB_14
-#define SPI2_SCK PB_13
-#define MFRC522_SS_PIN PB_12
-#define MFRC522_RST_PIN PA_8
+// Sounds go through one lock-free ring per producer, drained by the main loop, so the UART RX
+// interrupt never masks interrupts to queue one. Door commands don't queue at all: they're
+// applied as soon as their frame has been received.
+static SpscRing<ControlCmd, 16> esp32Sounds;  // From the UART RX interrupt
+static SpscRing<ControlCmd, 8>  keypadSounds; // From onKeypadPressed, in the main loop
+static uint32_t                 coalescedSounds = 0;
+
+// Door commands are ACKed from the main loop. The relay has already been switched by then.
+static SpscRing<uint8_t, 8> pendingAcks;
+
+// Indexed by DoorLinkSound
+static const ControlCmd soundCommands[DL_SOUND_COUNT] = {
+    CCMD_PLAY_BEEP_01,   // DL_SOUND_BeepShortMedium
+    CCMD_PLAY_BEEP_02,   // DL_SOUND_BeepShortLow
+    CCMD_PLAY_BEEP_03,   // DL_SOUND_BeepLongMedium
+    CCMD_PLAY_BEEP_04,   // DL_SOUND_BeepLongLow
+    CCMD_PLAY_BEEP_05,   // DL_SOUND_BeepShortHigh
+    CCMD_PLAY_BEEP_06,   // DL_SOUND_BeepLongHigh
+    CCMD_PLAY_BUZZER_01, // DL_SOUND_Buzzer01
+    CCMD_PLAY_BUZZER_02, // DL_SOUND_Buzzer02
+    CCMD_PLAY_SUCCESS,   // DL_SOUND_Success
+    CCMD_PLAY_FAILURE,   // DL_SOUND_Failure
+    CCMD_PLAY_SMB,       // DL_SOUND_Smb
+};
 
 MFRC522 rfid(SPI2_MOSI, SPI2_MISO, SPI2_SCK, MFRC522_SS_PIN, MFRC522_RST_PIN);
 
+// Each poll is a REQA over SPI and RF, so only poll as often as a tap needs. A card is held in the
+// field for far longer than this, and it is what keeps the loop free for audio and the UART.
+#define RFID_POLL_INTERVAL_MS 50
+#define RFID_STATS_PERIOD_MS 60000
+
+static Timer rfidPollTimer;
+static Timer rfidStatsTimer;
+
+struct RfidPollStats {
+    uint32_t polls;
+    uint32_t taps;
+    uint32_t totalLatencyUs;
+    uint32_t maxLatencyUs;
+    uint32_t repeats;
+};
+static RfidPollStats rfidStats = {};
+
+// Cards currently on the reader. A card is only sent when it arrives, not on every poll while
+// it is held there, and is forgotten once it has been out of the field for RFID_DEPARTURE_MS.
+// Cards are halted after each read, so each poll wakes them with WUPA to check they're present.
+#define RFID_MAX_CARDS 4
+#define RFID_DEPARTURE_MS 1000
+
+struct RfidSession {
+    bool     bActive;
+    uint8_t  uidSize;
+    uint8_t  uid[10];
+    uint32_t lastSeenMs;
+};
+static RfidSession rfidSessions[RFID_MAX_CARDS] = {};
+static Timer       rfidClock;
+
 
 // static void reset_chip() {
 //   rstNFC = 0;
@@ -71,52 +140,199 @@ MFRC522 rfid(SPI2_MOSI, SPI2_MISO, SPI2_SCK, MFRC522_SS_PIN, MFRC522_RST_PIN);
 //   rstNFC = 1;
 // }
 
+static void send_frame(uint8_t opcode, const uint8_t* pPayload, uint8_t length) {
+    uint8_t frame[DOORLINK_MAX_FRAME_SIZE];
+    size_t  size = doorlink_encode(frame, esp32TxSeq++, opcode, pPayload, length);
+
+    for (size_t i = 0; i < size; i++) {
+        esp32.putc(frame[i]);
+    }
+}
+
+static void on_play_sound_frame(const DoorLinkFrame& frame) {
+    if ((frame.length >= 1) && (frame.payload[0] < DL_SOUND_COUNT)) {
+        esp32Sounds.push(soundCommands[frame.payload[0]]);
+    }
+}
+
+// Called from the UART RX interrupt. Switching the relay is just a GPIO write, so it's done right
+// here rather than waiting for the loop to get round to it.
+static void on_door_frame(const DoorLinkFrame& frame) {
+    // Always applied, even if it looks like a retransmit. Lock and unlock are idempotent, and the
+    // ESP32's sequence numbers start again from 0 when it restarts.
+    if (frame.opcode == DL_OP_UnlockDoor) {
+        ledNFC    = 0; // led on
+        doorRelay = 1;
+    } else {
+        ledNFC    = 1; // led off
+        doorRelay = 0;
+    }
+
+    pendingAcks.push(frame.seq);
+}
+
+// Indexed by DoorLinkOpcode
+static const DoorLinkHandler frameHandlers[DL_OP_COUNT] = {
+    NULL,                 // DL_OP_Nop
+    NULL,                 // DL_OP_Ready
+    NULL,                 // DL_OP_Ack
+    &on_play_sound_frame, // DL_OP_PlaySound
+    &on_door_frame,       // DL_OP_LockDoor
+    &on_door_frame,       // DL_OP_UnlockDoor
+    NULL,                 // DL_OP_Rfid
+    NULL,                 // DL_OP_Pin
+    NULL,                 // DL_OP_RfidStats
+    NULL,                 // DL_OP_DoorSensor
+};
+
 static void process_esp32_uart() {
-    int ch = esp32.getc();
-
-    esp32RXBuffer[esp32RXLen++] = (uint8_t)ch;
-    if ((ch == EOF) || (ch == '\n') || (ch == '\0')) {
-        if (esp32RXLen > 1) {
-            esp32RXBuffer[esp32RXLen - 1] = '\0';
-
-            if (strcmp((const char*)esp32RXBuffer, "PLAY_BEEP_01") == 0) {
-                commandBuffer.push(CCMD_PLAY_BEEP_01);
-            } else if (strcmp((const char*)esp32RXBuffer, "PLAY_BEEP_02") == 0) {
-                commandBuffer.push(CCMD_PLAY_BEEP_02);
-            } else if (strcmp((const char*)esp32RXBuffer, "PLAY_BEEP_03") == 0) {
-                commandBuffer.push(CCMD_PLAY_BEEP_03);
-            } else if (strcmp((const char*)esp32RXBuffer, "PLAY_BEEP_04") == 0) {
-                commandBuffer.push(CCMD_PLAY_BEEP_04);
-            } else if (strcmp((const char*)esp32RXBuffer, "PLAY_BEEP_05") == 0) {
-                commandBuffer.push(CCMD_PLAY_BEEP_05);
-            } else if (strcmp((const char*)esp32RXBuffer, "PLAY_BEEP_06") == 0) {
-                commandBuffer.push(CCMD_PLAY_BEEP_06);
-            } else if (strcmp((const char*)esp32RXBuffer, "PLAY_BUZZER_01") == 0) {
-                commandBuffer.push(CCMD_PLAY_BUZZER_01);
-            } else if (strcmp((const char*)esp32RXBuffer, "PLAY_BUZZER_02") == 0) {
-                commandBuffer.push(CCMD_PLAY_BUZZER_02);
-            } else if (strcmp((const char*)esp32RXBuffer, "PLAY_SUCCESS") == 0) {
-                commandBuffer.push(CCMD_PLAY_SUCCESS);
-            } else if (strcmp((const char*)esp32RXBuffer, "PLAY_FAILURE") == 0) {
-                commandBuffer.push(CCMD_PLAY_FAILURE);
-            } else if (strcmp((const char*)esp32RXBuffer, "PLAY_SMB") == 0) {
-                commandBuffer.push(CCMD_PLAY_SMB);
-            } else if (strcmp((const char*)esp32RXBuffer, "LOCK_DOOR") == 0) {
-                commandBuffer.push(CCMD_LOCK_DOOR);
-            } else if (strcmp((const char*)esp32RXBuffer, "UNLOCK_DOOR") == 0) {
-                commandBuffer.push(CCMD_UNLOCK_DOOR);
-            }
+    while (esp32.readable()) {
+        if (doorlink_parse_byte(&esp32Parser, (uint8_t)esp32.getc())) {
+            doorlink_dispatch(frameHandlers, ARRAY_COUNT(frameHandlers), esp32Parser.frame);
         }
+    }
+}
 
-        esp32RXLen = 0;
-    } else {
-        if (esp32RXLen >= ((int)ARRAY_COUNT(esp32RXBuffer) - 1)) {
-            // Erk... just wrap if the buffer's full without a newline
-            esp32RXLen = 0;
+static void send_door_sensor(int bOpen) {
+    uint8_t payload = (uint8_t)bOpen;
+    send_frame(DL_OP_DoorSensor, &payload, 1);
+    doorSensorReported = bOpen;
+}
+
+#if DOOR_SENSOR_FITTED
+static void on_door_sensor_edge() {
+    doorSensorMoved = true;
+    doorSensorTimer.reset();
+}
+
+static void poll_door_sensor() {
+    if (!doorSensorMoved || (doorSensorTimer.read_ms() < DOOR_SENSOR_DEBOUNCE_MS)) {
+        return;
+    }
+    doorSensorMoved = false;
+
+    int bOpen = doorSensor.read();
+    if (bOpen != doorSensorReported) {
+        send_door_sensor(bOpen);
+    }
+}
+#endif
+
+static void put_u16(uint8_t* pBuffer, uint32_t value) {
+    if (value > 0xFFFF) {
+        value = 0xFFFF;
+    }
+    pBuffer[0] = (uint8_t)(value >> 8);
+    pBuffer[1] = (uint8_t)value;
+}
+
+static void send_rfid_stats() {
+    uint8_t payload[DL_RFID_STATS_COUNT * 2];
+    put_u16(&payload[DL_RFID_STATS_PeriodMs * 2], rfidStatsTimer.read_ms());
+    put_u16(&payload[DL_RFID_STATS_IntervalMs * 2], RFID_POLL_INTERVAL_MS);
+    put_u16(&payload[DL_RFID_STATS_Polls * 2], rfidStats.polls);
+    put_u16(&payload[DL_RFID_STATS_Taps * 2], rfidStats.taps);
+    put_u16(&payload[DL_RFID_STATS_AvgLatencyUs * 2], (rfidStats.taps == 0) ? 0 : (rfidStats.totalLatencyUs / rfidStats.taps));
+    put_u16(&payload[DL_RFID_STATS_MaxLatencyUs * 2], rfidStats.maxLatencyUs);
+    put_u16(&payload[DL_RFID_STATS_Repeats * 2], rfidStats.repeats);
+    put_u16(&payload[DL_RFID_STATS_CommandDrops * 2], esp32Sounds.dropped() + pendingAcks.dropped());
+    put_u16(&payload[DL_RFID_STATS_KeyDrops * 2], keypadSounds.dropped() + keypad.dropped());
+    put_u16(&payload[DL_RFID_STATS_Coalesced * 2], coalescedSounds);
+    send_frame(DL_OP_RfidStats, payload, sizeof(payload));
+
+    // In case a change was lost on the way, or the ESP32 has restarted since
+    if (doorSensorReported >= 0) {
+        send_door_sensor(doorSensorReported);
+    }
+
+    memset(&rfidStats, 0, sizeof(rfidStats));
+    coalescedSounds = 0;
+    rfidStatsTimer.reset();
+}
 
-            // pc.printf("ERROR: Read buffer overflow from ESP32!\n");
+// WUPA wakes every card in the field, including halted ones. REQA only wakes cards that
+// haven't been halted yet.
+static bool rfid_request(bool bWakeup) {
+    uint8_t atqa[2];
+    uint8_t atqaSize = sizeof(atqa);
+    uint8_t status   = bWakeup ? rfid.PICC_WakeupA(atqa, &atqaSize) : rfid.PICC_RequestA(atqa, &atqaSize);
+
+    // A collision still means there are cards to select
+    return (status == MFRC522::STATUS_OK) || (status == MFRC522::STATUS_COLLISION);
+}
+
+// Refreshes the card's session. Returns false if it has just arrived.
+static bool rfid_session_seen(const MFRC522::Uid& uid, uint32_t nowMs) {
+    RfidSession* pFree = NULL;
+    for (int i = 0; i < RFID_MAX_CARDS; i++) {
+        RfidSession& session = rfidSessions[i];
+        if (!session.bActive) {
+            pFree = pFree ? pFree : &session;
+        } else if ((session.uidSize == uid.size) && (memcmp(session.uid, uid.uidByte, uid.size) == 0)) {
+            session.lastSeenMs = nowMs;
+            return true;
+        } else if (!pFree || (pFree->bActive && ((int32_t)(session.lastSeenMs - pFree->lastSeenMs) < 0))) {
+            // No free slot yet, so the least recently seen card is replaced
+            pFree = &session;
+        }
+    }
+
+    pFree->bActive    = true;
+    pFree->uidSize    = (uid.size <= sizeof(pFree->uid)) ? uid.size : sizeof(pFree->uid);
+    pFree->lastSeenMs = nowMs;
+    memcpy(pFree->uid, uid.uidByte, pFree->uidSize);
+    return false;
+}
+
+// Returns true if a card was read and sent
+static bool poll_rfid() {
+    // Measures from the start of the poll that sees the card
+    rfidPollTimer.reset();
+    rfidStats.polls++;
+
+    uint32_t nowMs = rfidClock.read_ms();
+    for (int i = 0; i < RFID_MAX_CARDS; i++) {
+        if (rfidSessions[i].bActive && ((nowMs - rfidSessions[i].lastSeenMs) > RFID_DEPARTURE_MS)) {
+            rfidSessions[i].bActive = false;
+        }
+    }
+
+    // Anticollision in PICC_ReadCardSerial() selects one card at a time. Halting it lets the
+    // next REQA find any others still in the field.
+    bool bSent = false;
+    for (int i = 0; i < RFID_MAX_CARDS; i++) {
+        if (!rfid_request(i == 0)) {
+            break;
+        }
+
+        // Verify if the NUID has been readed
+        if (!rfid.PICC_ReadCardSerial()) {
+            break;
+        }
+        rfid.PICC_HaltA();
+
+        if (rfid_session_seen(rfid.uid, nowMs)) {
+            rfidStats.repeats++;
+            continue;
+        }
+
+        ledNFC = 0; // led on
+
+        // DumpToSerial(&rfid.uid);
+
+        send_frame(DL_OP_Rfid, rfid.uid.uidByte, rfid.uid.size);
+
+        ledNFC = 1; // led off
+
+        uint32_t latencyUs = rfidPollTimer.read_us();
+        rfidStats.taps++;
+        rfidStats.totalLatencyUs += latencyUs;
+        if (latencyUs > rfidStats.maxLatencyUs) {
+            rfidStats.maxLatencyUs = latencyUs;
         }
+        bSent = true;
     }
+    return bSent;
 }
 
 static uint32_t onKeypadPressed(uint32_t index) {
@@ -134,7 +350,7 @@ static uint32_t onKeypadPressed(uint32_t index) {
         }
     }
 
-    commandBuffer.push(CCMD_PLAY_BEEP_01);
+    keypadSounds.push(CCMD_PLAY_BEEP_01);
 
     pinTimeout.reset();
 
@@ -144,6 +360,7 @@ static uint32_t onKeypadPressed(uint32_t index) {
 static void setup() {
     // pc.printf("MFRC522 initializing...\n");
 
+    doorlink_parser_init(&esp32Parser);
     esp32.attach(&process_esp32_uart);
 
     rfid.PCD_Init();
@@ -163,27 +380,24 @@ static void setup() {
 
     // pc.printf("\nWaiting for an ISO14443A card.\n");
 
-    esp32.printf("STM32_READY\n");
-}
+    rfidPollTimer.start();
+    rfidStatsTimer.start();
+    rfidClock.start();
 
-const char* BEEP_01   = "T200 L6 O3 C";
-const char* BEEP_02   = "T200 L6 O2 C";
-const char* BEEP_03   = "T200 L1 O3 C";
-const char* BEEP_04   = "T200 L1 O2 C";
-const char* BEEP_05   = "T200 L6 O4 C";
-const char* BEEP_06   = "T200 L1 O4 C";
-const char* BUZZER_01 = "T200 L16 O4 CDEF CDEF CDEF CDEF";
-const char* BUZZER_02 = "T200 L16 O3 CD O4 EF O3 CD O4 EF";
-
-// const char* DOODLY = "O3>CG8G8AGPB>C";
-const char* YAY = "O4L32MLCDEFG";  //success
-const char* WAH = "T80O2L32GFEDC"; //failure
-// Super Mario Brothers theme (11 notes)
-const char* smb = {
-    "T180 O3 E8 E8 P8 E8 P8 C8 D#4 G4 P4 <G4 P4"
-};
+    send_frame(DL_OP_Ready, NULL, 0);
+
+#if DOOR_SENSOR_FITTED
+    doorSensorTimer.start();
+    doorSensor.rise(&on_door_sensor_edge);
+    doorSensor.fall(&on_door_sensor_edge);
+    send_door_sensor(doorSensor.read());
+#endif
+}
 
 static void loop() {
+    // Keypad events are queued by the scanner and handled here, calling onKeypadPressed
+    keypad.poll();
+
     // PIN
     if (pinTimeout.read_ms() > 5000) {
         // Send whatever has been entered already
@@ -193,7 +407,7 @@ static void loop() {
     if (pinCompleted) {
         // Minimum 5 characters (single digit user ID, 4 digit pin)
         if (strlen(pinCode) >= 5) {
-            esp32.printf("PIN:%s\n", pinCode);
+            send_frame(DL_OP_Pin, (const uint8_t*)pinCode, strlen(pinCode));
             // pc.printf("PIN completed: %s\n", pinCode);
         }
 
@@ -201,61 +415,59 @@ static void loop() {
         pinCompleted = false;
     }
 
-    // Process pending commands
-    ControlCmd cmd = CCMD_NOP;
-    while (commandBuffer.pop(cmd)) {
+#if DOOR_SENSOR_FITTED
+    poll_door_sensor();
+#endif
+
+    // ACK door commands first. The ESP32 is retransmitting until it hears back.
+    uint8_t ackSeq = 0;
+    while (pendingAcks.pop(ackSeq)) {
+        send_frame(DL_OP_Ack, &ackSeq, 1);
+    }
+
+    // Process pending sounds. Tunes are precompiled (see utils/tunes.csv), queued and play in the background.
+    // The same sound queued several times in a row since the last pass is only played once.
+    ControlCmd cmd     = CCMD_NOP;
+    ControlCmd lastCmd = CCMD_NOP;
+    while (esp32Sounds.pop(cmd) || keypadSounds.pop(cmd)) {
+        if (cmd == lastCmd) {
+            coalescedSounds++;
+            continue;
+        }
+        lastCmd = cmd;
+
         if (cmd == CCMD_PLAY_BEEP_01) {
-            audioPlayback.play(BEEP_01);
+            audioPlayback.playTable(TUNE_BEEP_01, ARRAY_COUNT(TUNE_BEEP_01));
         } else if (cmd == CCMD_PLAY_BEEP_02) {
-            audioPlayback.play(BEEP_02);
+            audioPlayback.playTable(TUNE_BEEP_02, ARRAY_COUNT(TUNE_BEEP_02));
         } else if (cmd == CCMD_PLAY_BEEP_03) {
-            audioPlayback.play(BEEP_03);
+            audioPlayback.playTable(TUNE_BEEP_03, ARRAY_COUNT(TUNE_BEEP_03));
         } else if (cmd == CCMD_PLAY_BEEP_04) {
-            audioPlayback.play(BEEP_04);
+            audioPlayback.playTable(TUNE_BEEP_04, ARRAY_COUNT(TUNE_BEEP_04));
         } else if (cmd == CCMD_PLAY_BEEP_05) {
-            audioPlayback.play(BEEP_05);
+            audioPlayback.playTable(TUNE_BEEP_05, ARRAY_COUNT(TUNE_BEEP_05));
         } else if (cmd == CCMD_PLAY_BEEP_06) {
-            audioPlayback.play(BEEP_06);
+            audioPlayback.playTable(TUNE_BEEP_06, ARRAY_COUNT(TUNE_BEEP_06));
         } else if (cmd == CCMD_PLAY_BUZZER_01) {
-            audioPlayback.play(BUZZER_01);
+            audioPlayback.playTable(TUNE_BUZZER_01, ARRAY_COUNT(TUNE_BUZZER_01));
         } else if (cmd == CCMD_PLAY_BUZZER_02) {
-            audioPlayback.play(BUZZER_02);
+            audioPlayback.playTable(TUNE_BUZZER_02, ARRAY_COUNT(TUNE_BUZZER_02));
         } else if (cmd == CCMD_PLAY_SUCCESS) {
-            audioPlayback.play(YAY);
+            audioPlayback.playTable(TUNE_SUCCESS, ARRAY_COUNT(TUNE_SUCCESS));
         } else if (cmd == CCMD_PLAY_FAILURE) {
-            audioPlayback.play(WAH);
+            audioPlayback.playTable(TUNE_FAILURE, ARRAY_COUNT(TUNE_FAILURE), true); // Cuts off whatever was playing
         } else if (cmd == CCMD_PLAY_SMB) {
-            audioPlayback.play(smb);
-        } else if (cmd == CCMD_LOCK_DOOR) {
-            ledNFC    = 1; // led off
-            doorRelay = 0;
-        } else if (cmd == CCMD_UNLOCK_DOOR) {
-            ledNFC    = 0; // led on
-            doorRelay = 1;
+            audioPlayback.playTable(TUNE_SMB, ARRAY_COUNT(TUNE_SMB));
         }
     }
 
-    // Look for new cards
-    if (!rfid.PICC_IsNewCardPresent()) {
-        return;
-    }
-
-    // Verify if the NUID has been readed
-    if (!rfid.PICC_ReadCardSerial()) {
-        return;
+    if (rfidPollTimer.read_ms() >= RFID_POLL_INTERVAL_MS) {
+        poll_rfid();
     }
 
-    ledNFC = 0; // led on
-
-    // DumpToSerial(&rfid.uid);
-
-    esp32.printf("RFID:");
-    for (int i = 0; i < rfid.uid.size; i++) {
-        esp32.putc(rfid.uid.uidByte[i]);
+    if (rfidStatsTimer.read_ms() >= RFID_STATS_PERIOD_MS) {
+        send_rfid_stats();
     }
-    esp32.putc('\n');
-
-    ledNFC = 1; // led off
 }
 
 int main() {
@@ -266,5 +478,9 @@ int main() {
 
     while (1) {
         loop();
+
+        // Everything the loop handles arrives by interrupt (the keypad scan ticks every ms), so
+        // sleep until the next one rather than spinning
+        sleep();
     }
 }
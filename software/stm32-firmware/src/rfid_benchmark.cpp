@@ -0,0 +1,100 @@
+#ifdef RFID_BENCHMARK
+#include <mbed.h>
+
+#include <MFRC522.h>
+
+#include "rfid_pins.h"
+#include "rfid_benchmark.h"
+
+
+extern Serial  pc;
+extern MFRC522 rfid;
+
+
+// Times a full card select + UID read through the MFRC522 library, and the register traffic
+// it is made of: reading back a UID's worth of FIFO a byte at a time, as the library does, against
+// one burst. Build with -DRFID_BENCHMARK, hold a card on the reader and call from setup() with the
+// pc serial port uncommented.
+
+#define BENCHMARK_RUNS 32
+#define BENCHMARK_FIFO_BYTES 10 // Longest UID
+
+// The MFRC522 library owns its SPI object, so the burst read drives SPI2 directly.
+// mbed reconfigures the peripheral for whichever SPI object is used, so the settings match the library's.
+static SPI        benchmarkSpi(SPI2_MOSI, SPI2_MISO, SPI2_SCK);
+static DigitalOut benchmarkSelect(MFRC522_SS_PIN, 1);
+
+#define MFRC522_FIFO_DATA_READ (0x80 | (0x09 << 1)) // FIFODataReg, read address
+
+// Each byte clocked out addresses the next read and the reply to it arrives one byte later;
+// the final 0 ends the burst.
+static void burst_read_fifo(uint8_t* pValues) {
+    char tx[BENCHMARK_FIFO_BYTES + 1];
+    char rx[BENCHMARK_FIFO_BYTES + 1];
+    memset(tx, MFRC522_FIFO_DATA_READ, BENCHMARK_FIFO_BYTES);
+    tx[BENCHMARK_FIFO_BYTES] = 0;
+
+    benchmarkSpi.lock();
+    benchmarkSelect = 0;
+    benchmarkSpi.write(tx, sizeof(tx), rx, sizeof(rx));
+    benchmarkSelect = 1;
+    benchmarkSpi.unlock();
+
+    memcpy(pValues, &rx[1], BENCHMARK_FIFO_BYTES);
+}
+
+static void cycleCounterStart() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static uint32_t cyclesToUs(uint32_t cycles) {
+    return cycles / (SystemCoreClock / 1000000);
+}
+
+void RunRfidBenchmark() {
+    uint8_t fifo[BENCHMARK_FIFO_BYTES];
+    uint8_t atqa[2];
+    uint8_t atqaSize;
+
+    benchmarkSpi.format(8, 0);
+    benchmarkSpi.frequency(8000000);
+
+    cycleCounterStart();
+
+    uint32_t selectCycles = 0;
+    int      selected     = 0;
+    for (int i = 0; i < BENCHMARK_RUNS; i++) {
+        atqaSize       = sizeof(atqa);
+        uint32_t start = DWT->CYCCNT;
+        if ((rfid.PICC_WakeupA(atqa, &atqaSize) == MFRC522::STATUS_OK) && (rfid.PICC_Select(&rfid.uid) == MFRC522::STATUS_OK)) {
+            selectCycles += DWT->CYCCNT - start;
+            selected++;
+        }
+        rfid.PICC_HaltA();
+    }
+
+    uint32_t start = DWT->CYCCNT;
+    for (int i = 0; i < BENCHMARK_RUNS; i++) {
+        for (int j = 0; j < BENCHMARK_FIFO_BYTES; j++) {
+            fifo[j] = rfid.PCD_ReadRegister(MFRC522::FIFODataReg);
+        }
+    }
+    uint32_t byteCycles = DWT->CYCCNT - start;
+
+    start = DWT->CYCCNT;
+    for (int i = 0; i < BENCHMARK_RUNS; i++) {
+        burst_read_fifo(fifo);
+    }
+    uint32_t burstCycles = DWT->CYCCNT - start;
+
+    if (selected > 0) {
+        pc.printf("Select + UID: %lu us (%d of %d selected)\n", cyclesToUs(selectCycles / selected), selected, BENCHMARK_RUNS);
+    } else {
+        pc.printf("Select + UID: no card\n");
+    }
+    pc.printf("%d FIFO bytes: per byte %lu us, burst %lu us\n", BENCHMARK_FIFO_BYTES,
+              cyclesToUs(byteCycles / BENCHMARK_RUNS), cyclesToUs(burstCycles / BENCHMARK_RUNS));
+}
+#endif
@@ -0,0 +1,6 @@
+#ifndef __RFID_BENCHMARK_H__
+#define __RFID_BENCHMARK_H__
+
+void RunRfidBenchmark();
+
+#endif //__RFID_BENCHMARK_H__
@@ -0,0 +1,11 @@
+#ifndef __RFID_PINS_H__
+#define __RFID_PINS_H__
+
+// The MFRC522 on SPI2
+#define SPI2_MOSI PB_15
+#define SPI2_MISO PB_14
+#define SPI2_SCK PB_13
+#define MFRC522_SS_PIN PB_12
+#define MFRC522_RST_PIN PA_8
+
+#endif //__RFID_PINS_H__
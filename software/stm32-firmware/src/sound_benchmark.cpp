@@ -0,0 +1,82 @@
+#if 0
+#include <mbed.h>
+
+#include <PwmSound.h>
+
+#include "sound_benchmark.h"
+
+
+extern Serial pc;
+
+
+// Compares the per-note setup cost of the old floating point note math in
+// PwmSound::_note() against the integer version, using the DWT cycle counter.
+// Enable with #if 1 and call from setup() with the pc serial port uncommented.
+
+#define BENCHMARK_NOTES 84
+
+static float benchmarkPitches[1 + BENCHMARK_NOTES];
+static uint16_t benchmarkPeriods[1 + BENCHMARK_NOTES];
+static const uint8_t benchmarkDots[4] = { 8, 12, 14, 15 };
+
+static volatile uint32_t sink;
+
+
+static void cycleCounterStart() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// The old _note(): float duration, dot factors and 1.0 / frequency period
+static void oldNoteSetup(int number, int tempo, int length, int dots, int style) {
+    float duration = 240.0 / (tempo * length);
+    if (dots == 1) {
+        duration *= 1.5;
+    } else if (dots == 2) {
+        duration *= 1.75;
+    } else if (dots == 3) {
+        duration *= 1.875;
+    }
+    float play = duration * style / 8.0;
+    float rest = duration * (8 - style) / 8.0;
+    float period = 1.0 / benchmarkPitches[number];
+
+    sink = (uint32_t)(play * 1000.0) + (uint32_t)(rest * 1000.0) + (uint32_t)(period * 1000000.0);
+}
+
+// The new _note(): period table and integer microseconds
+static void newNoteSetup(int number, int tempo, int length, int dots, int style) {
+    uint32_t duration = 240000000 / (tempo * length);
+    if (dots >= 1 && dots <= 3) {
+        duration = (duration * benchmarkDots[dots]) / 8;
+    }
+    uint32_t play = (duration * style) / 8;
+
+    sink = (play / 1000) + ((duration - play) / 1000) + benchmarkPeriods[number];
+}
+
+void RunSoundBenchmark() {
+    for (int i = 1; i <= BENCHMARK_NOTES; i++) {
+        benchmarkPitches[i] = 32.703 * powf(2.0f, (i - 1) / 12.0f);
+        benchmarkPeriods[i] = (uint16_t)(1000000.0 / benchmarkPitches[i]);
+    }
+
+    cycleCounterStart();
+
+    uint32_t start = DWT->CYCCNT;
+    for (int i = 1; i <= BENCHMARK_NOTES; i++) {
+        oldNoteSetup(i, 120 + i, 1 << (i % 6), i % 4, 7);
+    }
+    uint32_t oldCycles = DWT->CYCCNT - start;
+
+    start = DWT->CYCCNT;
+    for (int i = 1; i <= BENCHMARK_NOTES; i++) {
+        newNoteSetup(i, 120 + i, 1 << (i % 6), i % 4, 7);
+    }
+    uint32_t newCycles = DWT->CYCCNT - start;
+
+    pc.printf("Note setup: float %lu cycles/note, integer %lu cycles/note\n",
+              oldCycles / BENCHMARK_NOTES, newCycles / BENCHMARK_NOTES);
+}
+#endif
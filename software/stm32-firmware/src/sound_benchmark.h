@@ -0,0 +1,6 @@
+#ifndef __SOUND_BENCHMARK_H__
+#define __SOUND_BENCHMARK_H__
+
+void RunSoundBenchmark();
+
+#endif //__SOUND_BENCHMARK_H__
@@ -0,0 +1,102 @@
+// Generated by utils/compile-tunes.py from utils/tunes.csv - do not edit.
+#ifndef __TUNES_H__
+#define __TUNES_H__
+
+#include <PwmSound.h>
+
+// T200 L6 O3 C
+static const PwmSoundNote TUNE_BEEP_01[] = {
+    { 3822, 4, 0, 175, 25 },
+};
+
+// T200 L6 O2 C
+static const PwmSoundNote TUNE_BEEP_02[] = {
+    { 7644, 4, 0, 175, 25 },
+};
+
+// T200 L1 O3 C
+static const PwmSoundNote TUNE_BEEP_03[] = {
+    { 3822, 4, 0, 1050, 150 },
+};
+
+// T200 L1 O2 C
+static const PwmSoundNote TUNE_BEEP_04[] = {
+    { 7644, 4, 0, 1050, 150 },
+};
+
+// T200 L6 O4 C
+static const PwmSoundNote TUNE_BEEP_05[] = {
+    { 1911, 4, 0, 175, 25 },
+};
+
+// T200 L1 O4 C
+static const PwmSoundNote TUNE_BEEP_06[] = {
+    { 1911, 4, 0, 1050, 150 },
+};
+
+// T200 L16 O4 CDEF CDEF CDEF CDEF
+static const PwmSoundNote TUNE_BUZZER_01[] = {
+    { 1911, 4, 0, 65, 9 },
+    { 1702, 4, 0, 65, 9 },
+    { 1516, 4, 0, 65, 9 },
+    { 1431, 4, 0, 65, 9 },
+    { 1911, 4, 0, 65, 9 },
+    { 1702, 4, 0, 65, 9 },
+    { 1516, 4, 0, 65, 9 },
+    { 1431, 4, 0, 65, 9 },
+    { 1911, 4, 0, 65, 9 },
+    { 1702, 4, 0, 65, 9 },
+    { 1516, 4, 0, 65, 9 },
+    { 1431, 4, 0, 65, 9 },
+    { 1911, 4, 0, 65, 9 },
+    { 1702, 4, 0, 65, 9 },
+    { 1516, 4, 0, 65, 9 },
+    { 1431, 4, 0, 65, 9 },
+};
+
+// T200 L16 O3 CD O4 EF O3 CD O4 EF
+static const PwmSoundNote TUNE_BUZZER_02[] = {
+    { 3822, 4, 0, 65, 9 },
+    { 3405, 4, 0, 65, 9 },
+    { 1516, 4, 0, 65, 9 },
+    { 1431, 4, 0, 65, 9 },
+    { 3822, 4, 0, 65, 9 },
+    { 3405, 4, 0, 65, 9 },
+    { 1516, 4, 0, 65, 9 },
+    { 1431, 4, 0, 65, 9 },
+};
+
+// O4L32MLCDEFG
+static const PwmSoundNote TUNE_SUCCESS[] = {
+    { 1911, 4, 0, 62, 0 },
+    { 1702, 4, 0, 62, 0 },
+    { 1516, 4, 0, 62, 0 },
+    { 1431, 4, 0, 62, 0 },
+    { 1275, 4, 0, 62, 0 },
+};
+
+// T80O2L32GFEDC
+static const PwmSoundNote TUNE_FAILURE[] = {
+    { 5102, 4, 0, 82, 11 },
+    { 5727, 4, 0, 82, 11 },
+    { 6067, 4, 0, 82, 11 },
+    { 6810, 4, 0, 82, 11 },
+    { 7644, 4, 0, 82, 11 },
+};
+
+// T180 O3 E8 E8 P8 E8 P8 C8 D#4 G4 P4 <G4 P4
+static const PwmSoundNote TUNE_SMB[] = {
+    { 3033, 4, 0, 145, 20 },
+    { 3033, 4, 0, 145, 20 },
+    { 0, 4, 0, 145, 20 },
+    { 3033, 4, 0, 145, 20 },
+    { 0, 4, 0, 145, 20 },
+    { 3822, 4, 0, 145, 20 },
+    { 3214, 4, 0, 291, 41 },
+    { 2551, 4, 0, 291, 41 },
+    { 0, 4, 0, 291, 41 },
+    { 5102, 4, 0, 291, 41 },
+    { 0, 4, 0, 291, 41 },
+};
+
+#endif //__TUNES_H__
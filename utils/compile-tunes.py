@@ -0,0 +1,181 @@
+#!/usr/local/bin/python2.7
+
+import sys
+import os
+import argparse
+import csv
+import pprint
+
+pp = pprint.PrettyPrinter(indent=4)
+
+# Mirrors the MML dialect of PwmSound::play() (lib/PwmSound/play.cpp) with default options, so a
+# precompiled tune sounds exactly like the same string played at runtime.
+
+# Standard note pitches in Hz. First entry is a dummy, real note numbers start at 1.
+# Periods are 1000000 / pitch rounded down, the same as notePeriods[] in play.cpp.
+notePitches = [
+    1.0,
+    32.703, 34.648, 36.708, 38.891, 41.203, 43.654,
+    46.249, 48.999, 51.913, 55.000, 58.270, 61.735,
+    65.406, 69.296, 73.416, 77.782, 82.407, 87.307,
+    92.499, 97.999, 103.83, 110.00, 116.54, 123.47,
+    130.81, 138.59, 146.83, 155.56, 164.81, 174.61,
+    185.00, 196.00, 207.65, 220.00, 233.08, 246.94,
+    261.63, 277.18, 293.66, 311.13, 329.63, 349.23,
+    369.99, 392.00, 415.30, 440.00, 466.16, 493.88,
+    523.25, 554.37, 587.33, 622.25, 659.26, 698.46,
+    739.99, 783.99, 830.61, 880.00, 932.33, 987.77,
+    1046.5, 1108.7, 1174.7, 1244.5, 1318.5, 1396.9,
+    1480.0, 1568.0, 1661.2, 1760.0, 1864.7, 1975.5,
+    2093.0, 2217.5, 2349.3, 2489.0, 2637.0, 2793.8,
+    2960.0, 3136.0, 3322.4, 3520.0, 3729.3, 3951.1,
+]
+
+notes = [10, 12, 1, 3, 5, 6, 8]
+flats = [-1, -1, 0, -1, -1, 0, -1]
+sharps = [1, 0, 1, 1, 0, 1, 1]
+
+# Dot extensions in eighths: 1, 1.5, 1.75, 1.875
+dotEighths = [8, 12, 14, 15]
+
+
+def notePeriod(number):
+    return int(1000000.0 / notePitches[number])
+
+
+class MmlCompiler:
+    def __init__(self, mml):
+        self.mml = mml + '\0'
+        self.pos = 0
+        self.octave = 4
+        self.shift = 0
+        self.tempo = 120
+        self.length = 4
+        self.style = 7
+        self.timbre = 4
+        self.notes = []
+
+    def getChar(self):
+        c = self.mml[self.pos]
+        self.pos += 1
+        return c
+
+    def nextChar(self):
+        return self.mml[self.pos]
+
+    def getNumber(self):
+        n = 0
+        while self.nextChar().isdigit():
+            n = n * 10 + int(self.getChar())
+        return n
+
+    def getDots(self):
+        n = 0
+        while self.nextChar() == '.':
+            self.getChar()
+            n += 1
+        return n
+
+    def note(self, number, length, dots=0):
+        if number < 1 or number > 84:
+            number = 0
+
+        # Same integer math as PwmSound::_note(), in microseconds
+        durationUs = 240000000 // (self.tempo * length)
+        if 1 <= dots <= 3:
+            durationUs = (durationUs * dotEighths[dots]) // 8
+        playUs = (durationUs * self.style) // 8
+        restUs = durationUs - playUs
+
+        period = notePeriod(number) if number > 0 else 0
+        self.notes.append((period, self.timbre, playUs // 1000, restUs // 1000))
+
+    def compile(self):
+        while True:
+            c = self.getChar()
+            if c in 'ABCDEFG':
+                n = (self.octave * 12) + notes[ord(c) - ord('A')]
+                c1 = self.nextChar()
+                if c1 in '-+#':
+                    self.getChar()
+                    n += flats[ord(c) - ord('A')] if c1 == '-' else sharps[ord(c) - ord('A')]
+                n += self.shift * 12
+                self.shift = 0
+                n1 = self.getNumber()
+                n2 = self.getDots()
+                self.note(n, n1 if n1 != 0 else self.length, n2)
+            elif c == 'K':
+                pass
+            elif c == 'L':
+                n = self.getNumber()
+                if 1 <= n <= 64:
+                    self.length = n
+            elif c == 'M':
+                self.style = {'L': 8, 'N': 7, 'S': 6}.get(self.getChar(), self.style)
+            elif c == 'N':
+                n = self.getNumber() + self.shift * 12
+                self.shift = 0
+                self.note(n, self.length)
+            elif c == 'O':
+                n = self.getNumber()
+                if 0 <= n <= 6:
+                    self.octave = n
+            elif c in 'PR':
+                n1 = self.getNumber()
+                n2 = self.getDots()
+                self.note(0, n1 if n1 != 0 else self.length, n2)
+            elif c == 'Q':
+                n = self.getNumber()
+                if 1 <= n <= 4:
+                    self.timbre = n
+            elif c == 'T':
+                n = self.getNumber()
+                if 32 <= n <= 255:
+                    self.tempo = n
+            elif c == '<':
+                self.shift -= 1
+            elif c == '>':
+                self.shift += 1
+            elif c in ':#':
+                while self.getChar() not in '\n\0':
+                    pass
+            elif c in ' \t\r\n':
+                pass
+            elif c == '\0':
+                return self.notes
+            else:
+                raise ValueError('invalid character %r at position %d' % (c, self.pos))
+
+
+def main(args):
+    tunes = []
+    with open(args.tunes) as csvfile:
+        reader = csv.DictReader(csvfile)
+        for row in reader:
+            row['Notes'] = MmlCompiler(row['MML']).compile()
+            tunes.append(row)
+
+    with open(args.output, 'w') as header:
+        header.write('// Generated by utils/compile-tunes.py from utils/tunes.csv - do not edit.\n')
+        header.write('#ifndef __TUNES_H__\n')
+        header.write('#define __TUNES_H__\n\n')
+        header.write('#include <PwmSound.h>\n\n')
+
+        for tune in tunes:
+            header.write('// %s\n' % tune['MML'])
+            header.write('static const PwmSoundNote TUNE_%s[] = {\n' % tune['Name'])
+            for note in tune['Notes']:
+                header.write('    { %d, %d, 0, %d, %d },\n' % note)
+            header.write('};\n\n')
+
+        header.write('#endif //__TUNES_H__\n')
+
+    pp.pprint([(tune['Name'], len(tune['Notes'])) for tune in tunes])
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Compile MML tunes into note tables for the STM32 firmware')
+    parser.add_argument('-t', action="store", dest="tunes", help="path to csv of tunes to compile")
+    parser.add_argument('-o', action="store", dest="output", help="path to output generated header")
+
+    main(parser.parse_args())